@@ -0,0 +1,87 @@
+/*
+ * Runtime statistics snapshot (CPU load per core, stack high-water marks, heap)
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+
+#include "diag.h"
+
+
+#define DIAG_MAX_TASKS          32
+
+static const char *TAG = "DIAG";
+
+
+
+int json_append(char *buf, size_t len, int n, const char *fmt, ...)
+{
+    if (n < 0 || (size_t)n >= len) return n;
+    va_list args;
+    va_start(args, fmt);
+    n += vsnprintf(buf + n, len - n, fmt, args);
+    va_end(args);
+    return n;
+}
+
+
+int diag_append_system(char *buf, size_t len, int n, diag_cpu_window_t *window)
+{
+    UBaseType_t task_count = uxTaskGetNumberOfTasks();
+    if (task_count > DIAG_MAX_TASKS) task_count = DIAG_MAX_TASKS;
+
+    // Heap, not the task stack: this runs on mqtt_pub_task, one of the stacks being measured
+    TaskStatus_t *tasks = malloc(task_count * sizeof(TaskStatus_t));
+    if (tasks == NULL) {
+        ESP_LOGW(TAG, "No memory for task snapshot");
+        return n;
+    }
+
+    configRUN_TIME_COUNTER_TYPE total = 0;
+    task_count = uxTaskGetSystemState(tasks, task_count, &total);
+
+    // 1. CPU load per core since the previous snapshot (100% - idle share)
+#if configGENERATE_RUN_TIME_STATS
+    configRUN_TIME_COUNTER_TYPE idle[portNUM_PROCESSORS] = {0};
+    for (int core = 0; core < portNUM_PROCESSORS; core++) {
+        TaskHandle_t idle_handle = xTaskGetIdleTaskHandleForCore(core);
+        for (UBaseType_t i = 0; i < task_count; i++) {
+            if (tasks[i].xHandle == idle_handle) idle[core] = tasks[i].ulRunTimeCounter;
+        }
+    }
+
+    configRUN_TIME_COUNTER_TYPE elapsed = total - window->total;
+    n = json_append(buf, len, n, "\"cpu\":[");
+    for (int core = 0; core < portNUM_PROCESSORS; core++) {
+        float load = 0.f;
+        if (elapsed > 0) load = 100.f - 100.f * (float)(idle[core] - window->idle[core]) / elapsed;
+        if (load < 0.f) load = 0.f;
+        n = json_append(buf, len, n, "%s%.1f", core ? "," : "", load);
+        window->idle[core] = idle[core];
+    }
+    n = json_append(buf, len, n, "],");
+    window->total = total;
+#endif
+
+    // 2. Heap (8-bit capable, i.e. what malloc and the network stack use)
+    n = json_append(buf, len, n, "\"heap\":{\"free\":%u,\"min\":%u,\"largest\":%u},",
+                    (unsigned)heap_caps_get_free_size(MALLOC_CAP_8BIT),
+                    (unsigned)heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT),
+                    (unsigned)heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+
+    // 3. Stack high-water marks (bytes never used) of every task
+    n = json_append(buf, len, n, "\"stacks\":{");
+    for (UBaseType_t i = 0; i < task_count; i++) {
+        n = json_append(buf, len, n, "%s\"%s\":%u", i ? "," : "", tasks[i].pcTaskName,
+                        (unsigned)tasks[i].usStackHighWaterMark);
+    }
+    n = json_append(buf, len, n, "}");
+
+    free(tasks);
+    return n;
+}
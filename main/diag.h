@@ -0,0 +1,43 @@
+#ifndef DIAG_H
+#define DIAG_H
+
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+
+
+#define DIAG_PAYLOAD_LEN        2048
+#define DIAG_MIN_PERIOD_S       1
+
+/**
+ * @brief Start of a CPU load window: run-time counters of the previous snapshot.
+ * One per caller, so snapshots for different consumers do not cut each other's window.
+ * Zero-initialised means "since boot".
+ */
+typedef struct {
+#if configGENERATE_RUN_TIME_STATS
+    configRUN_TIME_COUNTER_TYPE idle[portNUM_PROCESSORS];
+    configRUN_TIME_COUNTER_TYPE total;
+#else
+    int unused;
+#endif
+} diag_cpu_window_t;
+
+/**
+ * @brief snprintf that keeps appending at `n` and never runs past `len`.
+ * @return new length of `buf` (may be >= len when truncated, like snprintf)
+ */
+int json_append(char *buf, size_t len, int n, const char *fmt, ...) __attribute__((format(printf, 4, 5)));
+
+/**
+ * @brief Append the system part of a diagnostics snapshot as JSON members (no braces):
+ * "cpu":[load% per core],"heap":{free,min,largest},"stacks":{"<task>":free_bytes,...}
+ *
+ * CPU load is measured since the previous call with the same `window`, from FreeRTOS
+ * run-time stats of the idle tasks (requires CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS, see
+ * sdkconfig.defaults); `window` is advanced to now.
+ *
+ * @return new length of `buf` (may be >= len when truncated, like snprintf)
+ */
+int diag_append_system(char *buf, size_t len, int n, diag_cpu_window_t *window);
+
+#endif
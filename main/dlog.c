@@ -0,0 +1,152 @@
+/*
+ * Deferred logging: bounded MPSC ring (per-slot sequence numbers, no locks) drained by
+ * a low-priority formatter task
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+
+#include "dlog.h"
+
+
+#define DLOG_TASK_PRIO          1       // just above idle; formatting is never urgent
+#define DLOG_DRAIN_PERIOD_MS    50
+#define DLOG_LINE_LEN           160
+
+static const char *TAG = "DLOG";
+static const char level_letter[] = { 'N', 'E', 'W', 'I', 'D', 'V' };
+
+_Static_assert((DLOG_RING_RECORDS & (DLOG_RING_RECORDS - 1)) == 0, "DLOG_RING_RECORDS must be a power of two");
+
+typedef struct {
+    atomic_uint seq;        // == position when free, position + 1 when filled
+    uint32_t timestamp_ms;  // capture time, so the formatter's delay does not show in the log
+    const char *tag;
+    const char *fmt;
+    uint8_t level;
+    uint8_t nargs;
+    dlog_arg_t args[DLOG_MAX_ARGS];
+} dlog_record_t;
+
+static dlog_record_t dlog_ring[DLOG_RING_RECORDS];
+static atomic_uint dlog_head = 0;   // next position to reserve (producers)
+static uint32_t dlog_tail = 0;      // next position to format (formatter task only)
+static atomic_uint dlog_dropped = 0;
+static atomic_bool dlog_ring_ready = false;
+
+
+
+static void dlog_ring_init(void)
+{
+    // Slot i is free for position i; done once, before the first record
+    for (int i = 0; i < DLOG_RING_RECORDS; i++) atomic_init(&dlog_ring[i].seq, i);
+}
+
+
+void dlog_write(esp_log_level_t level, const char *tag, const char *fmt, const dlog_arg_t *args, int nargs)
+{
+    if (!atomic_load_explicit(&dlog_ring_ready, memory_order_acquire)) {
+        // Before dlog_init(): format in place, like ESP_LOGx would
+        char line[DLOG_LINE_LEN];
+        dlog_arg_t a[DLOG_MAX_ARGS] = {0};
+        memcpy(a, args, nargs * sizeof(dlog_arg_t));
+        snprintf(line, sizeof(line), fmt, a[0], a[1], a[2], a[3], a[4], a[5]);
+        esp_log_write(level, tag, "%c (%lu) %s: %s\n", level_letter[level < sizeof(level_letter) ? level : 0],
+                      (uint32_t)(esp_timer_get_time() / 1000), tag, line);
+        return;
+    }
+
+    unsigned pos = atomic_load_explicit(&dlog_head, memory_order_relaxed);
+    dlog_record_t *rec;
+
+    for (;;) {
+        rec = &dlog_ring[pos & (DLOG_RING_RECORDS - 1)];
+        unsigned seq = atomic_load_explicit(&rec->seq, memory_order_acquire);
+        int diff = (int)(seq - pos);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&dlog_head, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) break;
+        } else if (diff < 0) {
+            // Formatter has not caught up: drop instead of stalling a control path
+            atomic_fetch_add_explicit(&dlog_dropped, 1, memory_order_relaxed);
+            return;
+        } else {
+            pos = atomic_load_explicit(&dlog_head, memory_order_relaxed);
+        }
+    }
+
+    rec->timestamp_ms = (uint32_t)(esp_timer_get_time() / 1000);
+    rec->tag = tag;
+    rec->fmt = fmt;
+    rec->level = level;
+    rec->nargs = nargs;
+    memcpy(rec->args, args, nargs * sizeof(dlog_arg_t));
+
+    atomic_store_explicit(&rec->seq, pos + 1, memory_order_release);
+}
+
+
+static bool dlog_format_one(void)
+{
+    char line[DLOG_LINE_LEN];
+    dlog_record_t *rec = &dlog_ring[dlog_tail & (DLOG_RING_RECORDS - 1)];
+
+    if (atomic_load_explicit(&rec->seq, memory_order_acquire) != dlog_tail + 1) return false;
+
+    // Unused trailing arguments are ignored by printf
+    dlog_arg_t a[DLOG_MAX_ARGS] = {0};
+    memcpy(a, rec->args, rec->nargs * sizeof(dlog_arg_t));
+    snprintf(line, sizeof(line), rec->fmt, a[0], a[1], a[2], a[3], a[4], a[5]);
+
+    esp_log_write(rec->level, rec->tag, "%c (%lu) %s: %s\n",
+                  level_letter[rec->level < sizeof(level_letter) ? rec->level : 0],
+                  rec->timestamp_ms, rec->tag, line);
+
+    // Hand the slot back to producers for the position one lap ahead
+    atomic_store_explicit(&rec->seq, dlog_tail + DLOG_RING_RECORDS, memory_order_release);
+    dlog_tail++;
+    return true;
+}
+
+
+static void dlog_task(void *pvParameters)
+{
+    uint32_t reported_drops = 0;
+
+    while (1) {
+        while (dlog_format_one()) { }
+
+        uint32_t drops = atomic_load_explicit(&dlog_dropped, memory_order_relaxed);
+        if (drops != reported_drops) {
+            ESP_LOGW(TAG, "%lu deferred log records dropped (ring full)", drops - reported_drops);
+            reported_drops = drops;
+        }
+        vTaskDelay(pdMS_TO_TICKS(DLOG_DRAIN_PERIOD_MS));
+    }
+}
+
+
+
+esp_err_t dlog_init(void)
+{
+    if (atomic_load(&dlog_ring_ready)) return ESP_ERR_INVALID_STATE;
+
+    dlog_ring_init();
+    atomic_store_explicit(&dlog_ring_ready, true, memory_order_release);
+
+    if (xTaskCreatePinnedToCore(dlog_task, "dlog_task", 3072, NULL, DLOG_TASK_PRIO, NULL, 0) != pdPASS) {
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+
+uint32_t dlog_get_dropped(void)
+{
+    return atomic_load_explicit(&dlog_dropped, memory_order_relaxed);
+}
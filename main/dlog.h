@@ -0,0 +1,75 @@
+#ifndef DLOG_H
+#define DLOG_H
+
+/*
+ * Deferred logging for control paths
+ *
+ * A call site only stores the format string pointer (its ID), a timestamp and up to
+ * DLOG_MAX_ARGS raw 32-bit arguments in a lock-free ring; printf formatting happens
+ * later in a low-priority task. Consequences for callers:
+ *   - arguments are integers only (scale floats, e.g. mod_index in permille)
+ *   - %s arguments must outlive the record: string literals / static tables, via DLOG_STR()
+ *   - when the ring is full the record is dropped and counted, the caller never blocks
+ *
+ * Per-module compile-time gating: define DLOG_LOCAL_LEVEL before including this header
+ * (default DLOG_DEFAULT_LEVEL). Calls above the level compile to nothing.
+ */
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_log.h"
+
+
+#ifndef DLOG_DEFAULT_LEVEL
+#ifdef NDEBUG
+#define DLOG_DEFAULT_LEVEL      ESP_LOG_INFO    // release: debug records are not even compiled
+#else
+#define DLOG_DEFAULT_LEVEL      ESP_LOG_DEBUG
+#endif
+#endif
+
+#ifndef DLOG_LOCAL_LEVEL
+#define DLOG_LOCAL_LEVEL        DLOG_DEFAULT_LEVEL
+#endif
+
+#define DLOG_MAX_ARGS           6
+#define DLOG_RING_RECORDS       64      // power of two
+
+typedef uint32_t dlog_arg_t;
+
+#define DLOG_STR(s)             ((dlog_arg_t)(uintptr_t)(s))
+
+// Number of arguments, 0..DLOG_MAX_ARGS (GNU ## swallows the comma when empty)
+#define DLOG_NARGS(...)         (sizeof((dlog_arg_t[]){ 0, ##__VA_ARGS__ }) / sizeof(dlog_arg_t) - 1)
+
+#define DLOG_LEVEL(level, tag, fmt, ...) do {                                           \
+        if ((level) <= DLOG_LOCAL_LEVEL) {                                              \
+            _Static_assert(DLOG_NARGS(__VA_ARGS__) <= DLOG_MAX_ARGS, "too many args");  \
+            const dlog_arg_t _dlog_args[] = { 0, ##__VA_ARGS__ };                       \
+            dlog_write((level), (tag), (fmt), &_dlog_args[1], DLOG_NARGS(__VA_ARGS__)); \
+        }                                                                               \
+    } while (0)
+
+#define DLOGE(tag, fmt, ...)    DLOG_LEVEL(ESP_LOG_ERROR, tag, fmt, ##__VA_ARGS__)
+#define DLOGW(tag, fmt, ...)    DLOG_LEVEL(ESP_LOG_WARN,  tag, fmt, ##__VA_ARGS__)
+#define DLOGI(tag, fmt, ...)    DLOG_LEVEL(ESP_LOG_INFO,  tag, fmt, ##__VA_ARGS__)
+#define DLOGD(tag, fmt, ...)    DLOG_LEVEL(ESP_LOG_DEBUG, tag, fmt, ##__VA_ARGS__)
+
+
+/**
+ * @brief Record one log entry (use the DLOGx macros). Safe from any task on either core;
+ *        not from ISRs. `tag` and `fmt` must be string literals.
+ */
+void dlog_write(esp_log_level_t level, const char *tag, const char *fmt, const dlog_arg_t *args, int nargs);
+
+/**
+ * @brief Start the formatter task. Records written before this are kept (up to the ring size).
+ */
+esp_err_t dlog_init(void);
+
+/**
+ * @brief Records lost because the ring was full, since boot
+ */
+uint32_t dlog_get_dropped(void);
+
+#endif
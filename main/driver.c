@@ -7,13 +7,24 @@
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
 #include "driver/gpio.h"
 #include "driver/mcpwm_prelude.h"
 #include "esp_log.h"
 #include "esp_attr.h"
 #include "esp_clk_tree.h"
+#include "esp_cpu.h"
+#include "esp_timer.h"
+#include "esp_memory_utils.h"
+#include "esp_pm.h"
+#include "nvs.h"
+#include "sdkconfig.h"
 
 #include "driver.h"
+#include "dlog.h"
+#include "phase_sync.h"
+#include "she.h"
+#include "spwm_lut.h"
 
 
 typedef struct {
@@ -36,29 +47,63 @@ typedef struct {
 #define SPWM_LEG2_LOW_PIN       14
 #define SPWM_LEG2_HIGH_PIN      27
 
-#define CARRIER_FREQ_HZ         20000UL   // 20kHz
+// Second inverter (MCPWM group 1)
+#define SPWM_B_LEG1_LOW_PIN     25
+#define SPWM_B_LEG1_HIGH_PIN    26
+#define SPWM_B_LEG2_LOW_PIN     32
+#define SPWM_B_LEG2_HIGH_PIN    33
+
 #define DEAD_TIME_NS            700UL     // 500ns Deadtime
 
 
 
-#define MAX_SAMPLES             (CARRIER_FREQ_HZ / MIN_FREQ_HZ)
+#define MAX_SAMPLES             (SPWM_SAMPLE_RATE_HZ / MIN_FREQ_HZ)
 #define MOD_INDEX               1U
 #define MAX_DUTY_CYCLE_PERC     0.95f //duty cycle maximum; caps require re-charging
 
 static const char *TAG = "SPWM";
 
-#define TIMER_RESOLUTION_HZ 10000000UL
 #define PEAK_TICKS (TIMER_RESOLUTION_HZ / (CARRIER_FREQ_HZ * 2))
 #define MAX_TICKS ((uint32_t)(PEAK_TICKS*0.95f))
 
+// SHE slots live in the LUT buffers. The shortest slot gets the same ISR budget as SPWM, the
+// longest keeps the up-down period register (2 * peak) in 16 bits.
+#define SHE_MAX_SLOTS     (MAX_SAMPLES * sizeof(uint16_t) / sizeof(she_slot_t))
+#define SHE_MIN_PEAK      PEAK_TICKS
+#define SHE_MAX_PEAK      32000
+#define SHE_GAIN_REBUILD  (SPWM_GAIN_ONE / 100)  // slots are rebuilt when the gain moves by 1%
+
+#define VF_TABLE_LEN      (MAX_FREQ_HZ - MIN_FREQ_HZ + 1)
+#define VF_NVS_NAMESPACE  "spwm"
+
 #define DEAD_TIME_TICKS   ((uint32_t)((uint64_t)DEAD_TIME_NS * TIMER_RESOLUTION_HZ / 1000000000UL))
 
+// Dead time eats DEAD_TIME_TICKS of the conducting side's pulse once per carrier period,
+// i.e. a duty error of DEAD_TIME_TICKS * CARRIER_FREQ_HZ / TIMER_RESOLUTION_HZ. In up-down
+// mode duty = cmp / PEAK_TICKS, so the compare correction is that duty times PEAK_TICKS (rounded).
+// With double update each half-period sample carries the same correction, the mean is unchanged.
+#define DT_COMP_TICKS     ((uint32_t)(((uint64_t)DEAD_TIME_TICKS * CARRIER_FREQ_HZ * PEAK_TICKS + TIMER_RESOLUTION_HZ / 2) / TIMER_RESOLUTION_HZ))
 
-static DRAM_ATTR uint32_t sine_lut[2][MAX_SAMPLES];
-static volatile uint32_t * volatile active_lut = sine_lut[0];
-static volatile uint32_t * volatile pending_lut = sine_lut[1];
 
-static SemaphoreHandle_t lut_calc_mutex = NULL;
+typedef struct {
+    int leg1_low;
+    int leg1_high;
+    int leg2_low;
+    int leg2_high;
+    int fault;
+} spwm_pinout_t;
+
+// Hardware trip inputs (e.g. overcurrent comparator), open-drain, active low
+#define SPWM_FAULT_PIN          4
+#define SPWM_B_FAULT_PIN        16
+#define SPWM_FAULT_ACTIVE_LEVEL 0
+
+
+// Indexed by instance id == MCPWM group id
+static const spwm_pinout_t spwm_pinouts[SPWM_MAX_INSTANCES] = {
+    { SPWM_LEG1_LOW_PIN,   SPWM_LEG1_HIGH_PIN,   SPWM_LEG2_LOW_PIN,   SPWM_LEG2_HIGH_PIN,   SPWM_FAULT_PIN },
+    { SPWM_B_LEG1_LOW_PIN, SPWM_B_LEG1_HIGH_PIN, SPWM_B_LEG2_LOW_PIN, SPWM_B_LEG2_HIGH_PIN, SPWM_B_FAULT_PIN },
+};
 
 
 
@@ -66,77 +111,538 @@ typedef struct {
     volatile bool enabled;
     volatile int current_freq;
     volatile float mod_index;
-    volatile int samples;
+    volatile int samples;           // LUT samples, or SHE slots
+    volatile bool she;              // the LUT buffer holds she_slot_t
 } spwm_internal_state_t;
 
-static volatile spwm_internal_state_t active_state = {
-  .enabled = false,  //tied to ISR update, requested from thread
-  .current_freq = 0, //tied to LUT update, requested from thread
-  .mod_index = 0.f, //tied to LUT update, requested from thread
-  .samples = 0
-};
 
-static volatile spwm_internal_state_t pending_state = {
-  .enabled = false,  //tied to ISR update, requested from thread
-  .current_freq = 0, //tied to LUT update, requested from thread
-  .mod_index = 0.f, //tied to LUT update, requested from thread
-  .samples = 0
+struct spwm_inverter_t {
+    int id;
+    bool initialized;
+
+    // Final compare values (<= PEAK_TICKS), 16 bit: double update doubles the sample count
+    uint16_t sine_lut[2][MAX_SAMPLES];
+    volatile uint16_t * volatile active_lut;
+    volatile uint16_t * volatile pending_lut;
+
+    SemaphoreHandle_t lut_calc_mutex;
+    SemaphoreHandle_t api_mutex;    // start / stop / target / fault clear, one caller at a time; taken before lut_calc_mutex
+
+    volatile spwm_internal_state_t active_state;  //enabled tied to ISR update, the rest to LUT update; requested from thread
+    volatile spwm_internal_state_t pending_state;
+
+    volatile int target_freq;
+    volatile bool g_update_pending;
+    volatile int g_current_sample_idx;
+
+    volatile uint32_t output_gain_q15; // SPWM_GAIN_ONE == unity, read by the ISR every sample
+
+    volatile spwm_modulation_t modulation; // requested; the LUT in use says what is playing
+    uint32_t she_gain_q15;             // gain the pending / active SHE slots were built with
+    bool she_low_m;                    // SHE selected but M below SHE_MIN_M: SPWM plays, under lut_calc_mutex
+
+    // V/f curve and its evaluation per integer Hz (Q15, index hz - MIN_FREQ_HZ), both under lut_calc_mutex
+    spwm_vf_curve_t vf_curve;
+    uint16_t vf_q15[VF_TABLE_LEN];
+    volatile bool lut_rebuild;         // curve or modulation changed: ramp task rebuilds the LUT at the current frequency
+
+    // Phase alignment: cycle starts stamped by the ISR, trim staged by the ramp task
+    volatile int64_t cycle_start_us;   // esp_timer at the last sample index 0
+    volatile uint32_t cycle_count;
+    volatile int32_t phase_trim_periods; // per cycle, 0 = untrimmed
+    int32_t phase_trim_left;           // ISR: trimmed periods still to run in this cycle
+    uint32_t phase_peak;               // ISR: timer peak in effect
+    bool phase_sync_enabled;
+    bool phase_clock_valid;
+    uint32_t phase_last_cycle;
+    phase_sync_t phase_ctl;
+
+    EventGroupHandle_t mqtt_dirty_flags;
+    TaskHandle_t freq_task;
+
+    // Idle power: carrier (timer + ISR) on only while running, under lut_calc_mutex
+    bool carrier_on;
+    esp_pm_lock_handle_t pm_lock;      // CPU_FREQ_MAX while the carrier runs, NULL without CONFIG_PM_ENABLE
+    int64_t idle_since_us;
+    int64_t idle_total_us;             // completed idle stretches since boot
+    volatile int64_t resume_request_us; // ISR: stamp the first call after a resume
+    volatile uint32_t resume_latency_us;
+    volatile bool isr_resync;          // first ISR after a resume: no interval to measure
+
+    portMUX_TYPE spwm_lock; //metadata about the SPWM module
+
+    mcpwm_timer_handle_t timer;
+    mcpwm_oper_handle_t oper_leg1;
+    mcpwm_oper_handle_t oper_leg2;
+    mcpwm_cmpr_handle_t comparator_leg1;
+    mcpwm_cmpr_handle_t comparator_leg2;
+
+    mcpwm_gen_handle_t gen_leg1_h;
+    mcpwm_gen_handle_t gen_leg1_l;
+    mcpwm_gen_handle_t gen_leg2_h;
+    mcpwm_gen_handle_t gen_leg2_l;
+
+    // Fault handling: hardware one-shot brake, latched until spwm_fault_clear()
+    mcpwm_fault_handle_t gpio_fault;
+    mcpwm_fault_handle_t soft_fault;
+    volatile bool fault_latched;
+    volatile uint32_t fault_reasons;
+    volatile uint32_t fault_trip_count;
+    volatile int64_t fault_last_trip_us;
+    volatile int64_t estop_request_us;
+    volatile uint32_t estop_sw_path_cycles;
+    volatile uint32_t estop_isr_latency_us;
+
+    // ISR timing (CPU cycles, single writer: the ISR)
+    uint32_t isr_last_entry;
+    uint32_t isr_count;
+    uint32_t isr_max_exec;
+    uint32_t isr_max_jitter;
+    uint32_t isr_watch_max_exec;    // worst case since spwm_isr_watch_start(), apart from the above
+    uint32_t isr_watch_max_jitter;
+    uint32_t isr_calls;             // ISR calls and their total cycles since boot; readers keep windows
+    uint64_t isr_exec_total;
+
+    // Command latency trace (esp_timer us); one command in flight, 0 = none
+    int64_t trace_cmd_us;
+    int64_t trace_target_us;
+    int64_t trace_calc_us;
+    int64_t trace_staged_us;
+    volatile int64_t trace_swap_us;   // written by the ISR
+    volatile bool trace_armed;        // ISR stamps the next LUT swap
+    bool trace_first_done;
+    spwm_latency_hist_t latency[SPWM_LAT_STAGE_COUNT];
 };
 
+// DRAM: the ISR reads LUTs and state through this array
+static DRAM_ATTR struct spwm_inverter_t spwm_inverters[SPWM_MAX_INSTANCES];
 
+static TaskHandle_t mqtt_task_handle = NULL; //single MQTT task serves every instance
 
-static volatile int target_freq = 0;
-static volatile bool g_update_pending = false;  
+static uint32_t cpu_cycles_per_update = 0; // expected ISR-to-ISR interval
+static spwm_clock_fn_t phase_clock = NULL;
+static uint32_t cpu_cycles_per_us = 0;
 
-static volatile int g_current_sample_idx = 0;
 
-static EventGroupHandle_t mqtt_dirty_flags = NULL;
-static TaskHandle_t mqtt_task_handle = NULL;
 
+static inline __attribute__((always_inline)) void swap_lut_pointers(volatile uint16_t * volatile *a, volatile uint16_t * volatile *b)
+{
+    volatile uint16_t *temp = *a;
+    *a = *b;
+    *b = temp;
+}
 
-mcpwm_cmpr_handle_t comparator_leg1 = NULL;
-mcpwm_cmpr_handle_t comparator_leg2 = NULL;
 
-mcpwm_gen_handle_t gen_leg1_h = NULL;
-mcpwm_gen_handle_t gen_leg1_l = NULL;
-mcpwm_gen_handle_t gen_leg2_h = NULL;
-mcpwm_gen_handle_t gen_leg2_l = NULL;
+#define DEFAULT_FREQ_STEP 2 //for smooth changes in the frequency
 
-mcpwm_timer_handle_t timer = NULL;
 
 
 
-static inline __attribute__((always_inline)) void swap_lut_pointers(volatile uint32_t * volatile *a, volatile uint32_t * volatile *b)
+int spwm_get_instance_id(spwm_handle_t inv)
 {
-    volatile uint32_t *temp = *a;
-    *a = *b;
-    *b = temp;
+    return inv->id;
 }
 
 
-#define DEFAULT_FREQ_STEP 2 //for smooth changes in the frequency
+void spwm_get_state(spwm_handle_t inv, spwm_runtime_state_t *out)
+{
+    taskENTER_CRITICAL(&inv->spwm_lock);
+    out->running              = inv->active_state.enabled;
+    out->current_frequency    = inv->active_state.current_freq;
+    out->target_frequency     = inv->target_freq;
+    out->mod_index            = inv->active_state.mod_index;
+    out->fuzzy_en             = false;
+    out->silent               = false;
+    out->update_pending       = inv->g_update_pending;
+    if (inv->active_state.she) {
+        out->samples_per_cycle = inv->active_state.current_freq > 0 ? CARRIER_FREQ_HZ / inv->active_state.current_freq : 0;
+    } else {
+        out->samples_per_cycle = inv->active_state.samples / SPWM_UPDATES_PER_CARRIER;
+    }
+    taskEXIT_CRITICAL(&inv->spwm_lock);
+}
 
 
+void spwm_set_output_gain(spwm_handle_t inv, float gain)
+{
+    if (gain < SPWM_GAIN_MIN) gain = SPWM_GAIN_MIN;
+    if (gain > SPWM_GAIN_MAX) gain = SPWM_GAIN_MAX;
+    inv->output_gain_q15 = (uint32_t)(gain * SPWM_GAIN_ONE + 0.5f);
+}
 
-static portMUX_TYPE spwm_lock = portMUX_INITIALIZER_UNLOCKED;
-//metadata about the SPWM module
 
+float spwm_get_output_gain(spwm_handle_t inv)
+{
+    return (float)inv->output_gain_q15 / SPWM_GAIN_ONE;
+}
 
 
-void spwm_get_state(spwm_runtime_state_t *out)
+void spwm_set_bus_voltage(spwm_handle_t inv, float vbus)
 {
-    taskENTER_CRITICAL(&spwm_lock);
-    out->running              = active_state.enabled;
-    out->current_frequency    = active_state.current_freq;
-    out->target_frequency     = target_freq;
-    out->mod_index            = active_state.mod_index;
-    out->fuzzy_en             = false;
-    out->silent               = false;
-    out->update_pending       = g_update_pending;
-    taskEXIT_CRITICAL(&spwm_lock);
+    if (vbus < NOMINAL_VBUS_V * (1.0f - SPWM_VBUS_VALID_BAND) || vbus > NOMINAL_VBUS_V * (1.0f + SPWM_VBUS_VALID_BAND)) {
+        inv->output_gain_q15 = SPWM_GAIN_ONE;
+        return;
+    }
+
+    float gain = NOMINAL_VBUS_V / vbus;
+    if (gain < SPWM_BUS_GAIN_MIN) gain = SPWM_BUS_GAIN_MIN;
+    if (gain > SPWM_BUS_GAIN_MAX) gain = SPWM_BUS_GAIN_MAX;
+    spwm_set_output_gain(inv, gain);
+}
+
+
+
+esp_err_t spwm_vf_curve_preset(spwm_vf_preset_t preset, spwm_vf_curve_t *out)
+{
+    memset(out, 0, sizeof(*out));
+    out->preset = preset;
+
+    switch (preset) {
+        case SPWM_VF_LINEAR:
+            // Same as the former fixed ratio: boost up to its knee, then proportional
+            out->count = 2;
+            out->points[0] = (spwm_vf_point_t){ NOMINAL_FREQ_HZ * MIN_VOLTAGE_BOOST, MIN_VOLTAGE_BOOST };
+            out->points[1] = (spwm_vf_point_t){ NOMINAL_FREQ_HZ, 1.0f };
+            return ESP_OK;
+        case SPWM_VF_QUADRATIC:
+            // Breakpoints spread over the lower operating range, where the curve bends
+            out->count = SPWM_VF_MAX_POINTS;
+            for (int i = 0; i < SPWM_VF_MAX_POINTS; i++) {
+                float hz = MIN_FREQ_HZ + (NOMINAL_FREQ_HZ - MIN_FREQ_HZ) * i / (SPWM_VF_MAX_POINTS - 1);
+                float v = (hz / NOMINAL_FREQ_HZ) * (hz / NOMINAL_FREQ_HZ);
+                out->points[i] = (spwm_vf_point_t){ hz, v > MIN_VOLTAGE_BOOST ? v : MIN_VOLTAGE_BOOST };
+            }
+            return ESP_OK;
+        default:
+            return ESP_ERR_INVALID_ARG;
+    }
+}
+
+
+static bool vf_curve_valid(const spwm_vf_curve_t *curve)
+{
+    if (curve->count == 0 || curve->count > SPWM_VF_MAX_POINTS || curve->preset > SPWM_VF_CUSTOM) return false;
+    for (int i = 0; i < curve->count; i++) {
+        const spwm_vf_point_t *p = &curve->points[i];
+        if (!(p->v >= 0.0f && p->v <= 1.0f) || !(p->hz >= 0.0f && p->hz <= 1000.0f)) return false;
+        if (i > 0 && p->hz <= curve->points[i - 1].hz) return false;
+    }
+    return true;
+}
+
+
+// Piecewise linear, held flat beyond the end points
+static void vf_build_table(const spwm_vf_curve_t *curve, uint16_t *table)
+{
+    const spwm_vf_point_t *p = curve->points;
+    int n = curve->count;
+
+    for (int hz = MIN_FREQ_HZ; hz <= MAX_FREQ_HZ; hz++) {
+        int k = 0;
+        while (k < n && p[k].hz < hz) k++;
+
+        float v;
+        if (k == 0) {
+            v = p[0].v;
+        } else if (k == n) {
+            v = p[n - 1].v;
+        } else {
+            v = p[k - 1].v + (p[k].v - p[k - 1].v) * (hz - p[k - 1].hz) / (p[k].hz - p[k - 1].hz);
+        }
+
+        if (v < MIN_VOLTAGE_BOOST) v = MIN_VOLTAGE_BOOST;
+        if (v > 1.0f) v = 1.0f;
+        table[hz - MIN_FREQ_HZ] = (uint16_t)(v * SPWM_GAIN_ONE + 0.5f);
+    }
 }
 
 
+static void vf_apply(spwm_handle_t inv, const spwm_vf_curve_t *curve)
+{
+    xSemaphoreTake(inv->lut_calc_mutex, portMAX_DELAY);
+    memset(&inv->vf_curve, 0, sizeof(inv->vf_curve));
+    inv->vf_curve.preset = curve->preset;
+    inv->vf_curve.count = curve->count;
+    memcpy(inv->vf_curve.points, curve->points, curve->count * sizeof(spwm_vf_point_t));
+    vf_build_table(&inv->vf_curve, inv->vf_q15);
+    inv->lut_rebuild = true;
+    xSemaphoreGive(inv->lut_calc_mutex);
+}
+
+
+// Stored curve, or the linear preset when there is none (first boot, NVS not initialised)
+static void vf_load(spwm_handle_t inv)
+{
+    spwm_vf_curve_t curve;
+    size_t size = sizeof(curve);
+    char key[8];
+    nvs_handle_t nvs;
+
+    snprintf(key, sizeof(key), "vf%d", inv->id);
+    bool loaded = nvs_open(VF_NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK;
+    if (loaded) {
+        loaded = nvs_get_blob(nvs, key, &curve, &size) == ESP_OK && size == sizeof(curve) && vf_curve_valid(&curve);
+        nvs_close(nvs);
+    }
+    if (!loaded) spwm_vf_curve_preset(SPWM_VF_LINEAR, &curve);
+
+    vf_apply(inv, &curve);
+    ESP_LOGI(TAG, "[%d] V/f curve: %s, %d points", inv->id, loaded ? "stored" : "default", curve.count);
+}
+
+
+esp_err_t spwm_set_vf_curve(spwm_handle_t inv, const spwm_vf_curve_t *curve)
+{
+    if (!vf_curve_valid(curve)) return ESP_ERR_INVALID_ARG;
+
+    vf_apply(inv, curve);
+
+    char key[8];
+    nvs_handle_t nvs;
+    snprintf(key, sizeof(key), "vf%d", inv->id);
+    esp_err_t err = nvs_open(VF_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err == ESP_OK) {
+        err = nvs_set_blob(nvs, key, &inv->vf_curve, sizeof(inv->vf_curve));
+        if (err == ESP_OK) err = nvs_commit(nvs);
+        nvs_close(nvs);
+    }
+    if (err != ESP_OK) ESP_LOGW(TAG, "[%d] V/f curve not persisted: %s", inv->id, esp_err_to_name(err));
+
+    ESP_LOGI(TAG, "[%d] V/f curve set, %d points", inv->id, curve->count);
+    if (mqtt_task_handle) xTaskNotify(mqtt_task_handle, NOTIFY_SOURCE_DRIVER, eSetBits);
+    return ESP_OK;
+}
+
+
+void spwm_get_vf_curve(spwm_handle_t inv, spwm_vf_curve_t *out)
+{
+    xSemaphoreTake(inv->lut_calc_mutex, portMAX_DELAY);
+    *out = inv->vf_curve;
+    xSemaphoreGive(inv->lut_calc_mutex);
+}
+
+
+
+void spwm_set_modulation(spwm_handle_t inv, spwm_modulation_t mode)
+{
+    if (mode != SPWM_MOD_SINE && mode != SPWM_MOD_SHE) return;
+    if (mode == inv->modulation) return;
+
+    inv->modulation = mode;
+    inv->lut_rebuild = true;
+    ESP_LOGI(TAG, "[%d] Modulation: %s", inv->id, mode == SPWM_MOD_SHE ? "SHE" : "SPWM");
+    if (mqtt_task_handle) xTaskNotify(mqtt_task_handle, NOTIFY_SOURCE_DRIVER, eSetBits);
+}
+
+
+spwm_modulation_t spwm_get_modulation(spwm_handle_t inv)
+{
+    return inv->modulation;
+}
+
+
+
+#define PHASE_CLOCK_VALID_S     1704067200  // 2024-01-01: earlier means SNTP has not set the time
+
+static int64_t phase_clock_default(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    if (tv.tv_sec < PHASE_CLOCK_VALID_S) return 0;
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+void spwm_set_phase_clock(spwm_clock_fn_t clock)
+{
+    phase_clock = clock;
+}
+
+
+void spwm_set_phase_sync(spwm_handle_t inv, bool enable)
+{
+    taskENTER_CRITICAL(&inv->spwm_lock);
+    inv->phase_sync_enabled = enable;
+    inv->phase_trim_periods = 0;
+    inv->phase_last_cycle = inv->cycle_count;
+    phase_sync_reset(&inv->phase_ctl);
+    taskEXIT_CRITICAL(&inv->spwm_lock);
+    ESP_LOGI(TAG, "[%d] Phase alignment %s", inv->id, enable ? "on" : "off");
+}
+
+
+void spwm_get_phase_stats(spwm_handle_t inv, spwm_phase_stats_t *out)
+{
+    taskENTER_CRITICAL(&inv->spwm_lock);
+    out->enabled          = inv->phase_sync_enabled;
+    out->clock_valid      = inv->phase_clock_valid;
+    out->locked           = inv->phase_ctl.locked;
+    out->error_us         = inv->phase_ctl.error_us;
+    out->max_abs_error_us = inv->phase_ctl.max_abs_error_us;
+    out->trim_periods     = inv->phase_trim_periods;
+    out->updates          = inv->phase_ctl.updates;
+    taskEXIT_CRITICAL(&inv->spwm_lock);
+}
+
+
+// Ramp task: one controller update from the latest cycle start. Trims stop while ramping,
+// stopped, or without wall-clock time.
+static void spwm_phase_sync_step(spwm_handle_t inv)
+{
+    if (!inv->phase_sync_enabled) return;
+
+    int64_t wall_now = (phase_clock ? phase_clock : phase_clock_default)();
+    inv->phase_clock_valid = wall_now > 0;
+
+    // The ISR may run on the other core: reread until the stamp and its count match
+    int64_t cycle_start;
+    uint32_t count;
+    do {
+        count = inv->cycle_count;
+        cycle_start = inv->cycle_start_us;
+    } while (count != inv->cycle_count);
+
+    taskENTER_CRITICAL(&inv->spwm_lock);
+    bool steady = inv->active_state.enabled && !inv->g_update_pending && !inv->active_state.she &&
+                  inv->target_freq == inv->active_state.current_freq;
+    uint32_t cycles = count - inv->phase_last_cycle;
+    int freq = inv->active_state.current_freq;
+    int samples = inv->active_state.samples;
+    phase_sync_t ctl = inv->phase_ctl;
+    inv->phase_last_cycle = count;
+    taskEXIT_CRITICAL(&inv->spwm_lock);
+
+    if (!steady || !inv->phase_clock_valid || cycles == 0 || freq <= 0) {
+        inv->phase_trim_periods = 0;
+        return;
+    }
+
+    // Trimmed periods must end inside the first half cycle (leg 2 high)
+    int32_t max_trim = samples / (2 * SPWM_UPDATES_PER_CARRIER) - 2;
+    int64_t cycle_start_wall = wall_now - (esp_timer_get_time() - cycle_start);
+    float cycle_us = samples * 1e6f / SPWM_SAMPLE_RATE_HZ;
+
+    int32_t trim = phase_sync_update(&ctl, cycle_start_wall, freq, cycle_us, cycles, SPWM_PHASE_TRIM_US, max_trim);
+
+    taskENTER_CRITICAL(&inv->spwm_lock);
+    if (inv->phase_sync_enabled) { // not switched off meanwhile
+        inv->phase_ctl = ctl;
+        inv->phase_trim_periods = trim;
+    }
+    taskEXIT_CRITICAL(&inv->spwm_lock);
+
+    if (mqtt_task_handle) xTaskNotify(mqtt_task_handle, NOTIFY_SOURCE_DRIVER, eSetBits);
+}
+
+
+void spwm_get_isr_stats(spwm_handle_t inv, spwm_isr_stats_t *out, spwm_isr_window_t *window)
+{
+    taskENTER_CRITICAL(&inv->spwm_lock);
+    int64_t now = esp_timer_get_time();
+    int64_t idle_us = inv->idle_total_us + (inv->carrier_on ? 0 : now - inv->idle_since_us);
+
+    out->isr_count     = inv->isr_count;
+    out->max_exec_us   = (float)inv->isr_max_exec / cpu_cycles_per_us;
+    out->max_jitter_us = (float)inv->isr_max_jitter / cpu_cycles_per_us;
+    out->watch_max_exec_us   = (float)inv->isr_watch_max_exec / cpu_cycles_per_us;
+    out->watch_max_jitter_us = (float)inv->isr_watch_max_jitter / cpu_cycles_per_us;
+    out->idle          = !inv->carrier_on;
+    out->resume_us     = inv->resume_latency_us;
+
+    out->avg_exec_us = out->load_pct = out->rate_hz = out->idle_pct = 0.f;
+    if (window != NULL) {
+        uint32_t calls = inv->isr_calls - window->calls;    // wraps cleanly within ~29 h at 40k/s
+        float exec_us = (float)(inv->isr_exec_total - window->exec_total) / cpu_cycles_per_us;
+        int64_t window_us = now - window->at_us;
+
+        if (calls > 0) out->avg_exec_us = exec_us / calls;
+        if (window_us > 0) {
+            out->load_pct = 100.f * exec_us / window_us;
+            out->rate_hz  = 1e6f * calls / window_us;
+            out->idle_pct = 100.f * (float)(idle_us - window->idle_us) / window_us;
+        }
+
+        window->calls = inv->isr_calls;
+        window->exec_total = inv->isr_exec_total;
+        window->at_us = now;
+        window->idle_us = idle_us;
+    }
+    taskEXIT_CRITICAL(&inv->spwm_lock);
+}
+
+
+void spwm_isr_watch_start(spwm_handle_t inv)
+{
+    taskENTER_CRITICAL(&inv->spwm_lock);
+    inv->isr_watch_max_exec = 0;
+    inv->isr_watch_max_jitter = 0;
+    taskEXIT_CRITICAL(&inv->spwm_lock);
+}
+
+
+void spwm_get_latency_stats(spwm_handle_t inv, spwm_latency_hist_t out[SPWM_LAT_STAGE_COUNT], bool reset)
+{
+    taskENTER_CRITICAL(&inv->spwm_lock);
+    memcpy(out, inv->latency, sizeof(inv->latency));
+    if (reset) memset(inv->latency, 0, sizeof(inv->latency));
+    taskEXIT_CRITICAL(&inv->spwm_lock);
+}
+
+
+// Caller holds spwm_lock
+static void spwm_latency_record(spwm_handle_t inv, spwm_latency_stage_t stage, int64_t us)
+{
+    spwm_latency_hist_t *h = &inv->latency[stage];
+    if (us < 0) us = 0;
+
+    int bucket = 0;
+    for (int64_t limit = 10; us >= limit && bucket < SPWM_LAT_BUCKETS - 1; limit *= 10) bucket++;
+
+    h->hist[bucket]++;
+    h->count++;
+    if (us > h->max_us) h->max_us = (uint32_t)us;
+}
+
+
+// Turn ISR swap stamps into histogram entries; freq task, before it stages the next step
+static void spwm_trace_collect(spwm_handle_t inv)
+{
+    taskENTER_CRITICAL(&inv->spwm_lock);
+    if (inv->trace_cmd_us != 0 && !inv->active_state.enabled) {
+        inv->trace_cmd_us = 0; // stopped or tripped, never reaches its target
+        inv->trace_armed = false;
+    }
+
+    if (inv->trace_cmd_us != 0 && inv->trace_swap_us != 0) {
+        int64_t swap = inv->trace_swap_us;
+        inv->trace_swap_us = 0;
+
+        if (!inv->trace_first_done) {
+            spwm_latency_record(inv, SPWM_LAT_DISPATCH,   inv->trace_target_us - inv->trace_cmd_us);
+            spwm_latency_record(inv, SPWM_LAT_RAMP_WAIT,  inv->trace_calc_us - inv->trace_target_us);
+            spwm_latency_record(inv, SPWM_LAT_LUT_CALC,   inv->trace_staged_us - inv->trace_calc_us);
+            spwm_latency_record(inv, SPWM_LAT_SWAP_WAIT,  swap - inv->trace_staged_us);
+            spwm_latency_record(inv, SPWM_LAT_FIRST_EDGE, swap - inv->trace_cmd_us);
+            inv->trace_first_done = true;
+        }
+        if (inv->active_state.current_freq == inv->target_freq) {
+            spwm_latency_record(inv, SPWM_LAT_SETTLED, swap - inv->trace_cmd_us);
+            inv->trace_cmd_us = 0;
+        }
+    }
+    taskEXIT_CRITICAL(&inv->spwm_lock);
+}
+
+
+
+// SHE bakes the gain into the slots, and the gain decides the SHE_MIN_M fallback;
+// rebuild when bus compensation has moved it
+static bool spwm_she_gain_moved(spwm_handle_t inv)
+{
+    if (inv->modulation != SPWM_MOD_SHE) return false;
+    int32_t delta = (int32_t)inv->output_gain_q15 - (int32_t)inv->she_gain_q15;
+    return delta > (int32_t)SHE_GAIN_REBUILD || delta < -(int32_t)SHE_GAIN_REBUILD;
+}
 
 
 static void freq_update_task(void *);
@@ -145,9 +651,11 @@ static void freq_update_task(void *);
 // MATH (Task Context)
 // ----------------------------------------------------------------------------------
 
-void set_new_frequency(int new_freq)
+// Caller holds lut_calc_mutex. Builds into pending_lut; with `arm` the ISR takes it at the
+// next cycle boundary, without it the caller swaps it in itself (cold start)
+static void set_new_frequency_locked(spwm_handle_t inv, int new_freq, bool arm)
 {
-    xSemaphoreTake(lut_calc_mutex, portMAX_DELAY);
+    int64_t calc_start_us = esp_timer_get_time();
 
     float freq_hz = new_freq;
 
@@ -155,68 +663,82 @@ void set_new_frequency(int new_freq)
     if (freq_hz < MIN_FREQ_HZ) freq_hz = MIN_FREQ_HZ;
     if (freq_hz > MAX_FREQ_HZ) freq_hz = MAX_FREQ_HZ;
 
-    float v_f_ratio = freq_hz / NOMINAL_FREQ_HZ;
-    // Ensure we don't drop below a minimum torque threshold (Boost)
-    if (v_f_ratio < MIN_VOLTAGE_BOOST) v_f_ratio = MIN_VOLTAGE_BOOST;
-    // Ensure we never exceed 100% duty cycle
-    if (v_f_ratio > 1.0f) v_f_ratio = 1.0f;
-
-    
+    // Boost floor and the 100% cap are already part of the table
+    float v_f_ratio = (float)inv->vf_q15[(int)freq_hz - MIN_FREQ_HZ] / SPWM_GAIN_ONE;
 
 
-    int samples = (int)(CARRIER_FREQ_HZ / freq_hz);
+    int samples = (int)(SPWM_SAMPLE_RATE_HZ / freq_hz);
     if (samples > MAX_SAMPLES) samples = MAX_SAMPLES;
     
-    uint32_t *target_buffer = (uint32_t *)pending_lut; 
-    
+    uint16_t *target_buffer = (uint16_t *)inv->pending_lut;
+
+    bool she = inv->modulation == SPWM_MOD_SHE;
+    if (!she) inv->she_low_m = false;
+    if (she) {
+        // The gain scales the angles' modulation index here, not per sample in the ISR
+        uint32_t gain_q15 = inv->output_gain_q15;
+        float m = v_f_ratio * gain_q15 / SPWM_GAIN_ONE;
+        inv->she_gain_q15 = gain_q15;
+
+        bool low_m = m < (inv->she_low_m ? SHE_MIN_M + SHE_MIN_M_HYST : SHE_MIN_M);
+        if (low_m != inv->she_low_m) {
+            ESP_LOGI(TAG, "[%d] SHE: M %d permille, %s", inv->id, (int)(m * 1000.0f),
+                     low_m ? "below the SHE minimum, playing SPWM" : "back on SHE");
+            inv->she_low_m = low_m;
+        }
 
-    for (int i = 0; i < samples; i++) {
-        float angle = (2.0f * M_PI * i) / samples;
-        float sin_val = fabsf(sin(angle));
-        
-        // Calculate
-        uint32_t duty_ticks = (uint32_t)(PEAK_TICKS * sin_val * v_f_ratio);
-        
-        // PRE-CALCULATION CLAMP
-        if (duty_ticks > MAX_TICKS) {
-            duty_ticks = MAX_TICKS;
+        if (low_m) {
+            she = false;
+        } else {
+            int slots = she_build_cycle(m, (uint32_t)(TIMER_RESOLUTION_HZ / freq_hz), SHE_MIN_PEAK, SHE_MAX_PEAK,
+                                        (she_slot_t *)target_buffer, SHE_MAX_SLOTS);
+            if (slots > 0) {
+                samples = slots;
+            } else {
+                ESP_LOGE(TAG, "[%d] SHE slot table does not fit, staying on SPWM", inv->id);
+                she = false;
+            }
         }
-        
-        target_buffer[i] = duty_ticks;
     }
-    ESP_LOGI(TAG, "Freq Req: %.2f Hz | Samples: %d | Time per Sample: %.2f us", 
-             freq_hz, 
-             samples, 
-             (1000000.0 / CARRIER_FREQ_HZ));
-
-    taskENTER_CRITICAL(&spwm_lock);
+    
+    // The table holds final compare values; the ISR only applies the gain register
+    if (!she) spwm_lut_build(target_buffer, samples, v_f_ratio, PEAK_TICKS, MAX_TICKS, DT_COMP_TICKS);
+    DLOGI(TAG, "[%d] Freq Req: %d Hz | %s: %d | Mod: %d permille",
+          inv->id, (int)freq_hz, DLOG_STR(she ? "Slots" : "Samples"), samples, (int)(v_f_ratio * 1000.0f));
 
-    bool changed = false;
+    taskENTER_CRITICAL(&inv->spwm_lock);
 
-    if(pending_state.mod_index != v_f_ratio || pending_state.current_freq != new_freq) changed = true;
+    if(inv->pending_state.mod_index != v_f_ratio) 
+        xEventGroupSetBits(inv->mqtt_dirty_flags, MQTT_UPDATE_MOD_INDEX_BIT); //may not change, when freq does
+    inv->pending_state.mod_index = v_f_ratio;
+    if(inv->pending_state.current_freq != new_freq) 
+        xEventGroupSetBits(inv->mqtt_dirty_flags, MQTT_UPDATE_FREQ_BIT); //not fully bulletproof, but reduces traffic
+    inv->pending_state.current_freq = new_freq;
 
-    if(pending_state.mod_index != v_f_ratio) 
-        xEventGroupSetBits(mqtt_dirty_flags, MQTT_UPDATE_MOD_INDEX_BIT); //may not change, when freq does
-    pending_state.mod_index = v_f_ratio;
-    if(pending_state.current_freq != new_freq) 
-        xEventGroupSetBits(mqtt_dirty_flags, MQTT_UPDATE_FREQ_BIT); //not fully bulletproof, but reduces traffic
-    pending_state.current_freq = new_freq;
 
+    inv->pending_state.samples = samples;
+    inv->pending_state.she = she;
 
-    pending_state.samples = samples;
-    g_update_pending = true; 
-    taskEXIT_CRITICAL(&spwm_lock);
-    xSemaphoreGive(lut_calc_mutex);
+    // Traced command: stamp its first step and the step that lands on the target
+    if (inv->trace_cmd_us != 0 && (!inv->trace_first_done || new_freq == inv->target_freq)) {
+        if (!inv->trace_first_done) {
+            inv->trace_calc_us = calc_start_us;
+            inv->trace_staged_us = esp_timer_get_time();
+        }
+        inv->trace_swap_us = 0;
+        inv->trace_armed = true;
+    }
 
+    if (arm) inv->g_update_pending = true;
+    taskEXIT_CRITICAL(&inv->spwm_lock);
 }
 
 
-void force_new_frequency(void)
+static void set_new_frequency(spwm_handle_t inv, int new_freq)
 {
-    swap_lut_pointers(&active_lut, &pending_lut);
-    //g_samples_per_cycle = pending_state.samples;
-    active_state = pending_state;
-    g_update_pending = false;    
+    xSemaphoreTake(inv->lut_calc_mutex, portMAX_DELAY);
+    set_new_frequency_locked(inv, new_freq, true);
+    xSemaphoreGive(inv->lut_calc_mutex);
 }
 
 
@@ -224,20 +746,85 @@ void force_new_frequency(void)
 // ----------------------------------------------------------------------------------
 // ISR (High Speed)
 // ----------------------------------------------------------------------------------
-static bool IRAM_ATTR mcpwm_timer_event_cb(mcpwm_timer_handle_t timer, const mcpwm_timer_event_data_t *edata, void *user_ctx)
+
+// Phase trim: the first |phase_trim_left| carrier periods of a cycle run with the peak one
+// tick up (or down). Only called where period and compares latch together at the next TEZ,
+// once per carrier period. The period goes first: compare values are checked against it.
+// Leg 2 holds high with its compare at the peak; trims end before the half cycle.
+static inline __attribute__((always_inline)) void spwm_phase_trim_step(spwm_handle_t inv, int idx, int half_cycle)
+{
+    int32_t left = inv->phase_trim_left;
+    uint32_t peak = left > 0 ? PEAK_TICKS + 1 : (left < 0 ? PEAK_TICKS - 1 : PEAK_TICKS);
+
+    if (peak != inv->phase_peak) {
+        inv->phase_peak = peak;
+        mcpwm_timer_set_period(inv->timer, peak * 2);
+        if (idx < half_cycle) mcpwm_comparator_set_compare_value(inv->comparator_leg2, peak);
+    }
+    if (left != 0) inv->phase_trim_left = left > 0 ? left - 1 : left + 1;
+}
+
+
+// SHE: one step per slot, where period and compares latch together at the slot's TEZ. Both
+// legs are held by compare 0 (low) or the slot's peak (high); the period goes first.
+static inline __attribute__((always_inline)) void spwm_she_step(spwm_handle_t inv, bool latch_point)
 {
-    if (active_state.samples == 0) return false;
+    const volatile she_slot_t *slots = (const volatile she_slot_t *)inv->active_lut;
+    int idx = inv->g_current_sample_idx;
+
+    if (!latch_point) {
+        // Switched over from SPWM between latch points: the rest of this carrier period
+        // holds slot 0's levels, slot 0 itself starts at the next TEZ
+        uint32_t peak = inv->phase_peak;
+        mcpwm_comparator_set_compare_value(inv->comparator_leg1, (slots[0].level & SHE_LEG1_HIGH) ? peak : 0);
+        mcpwm_comparator_set_compare_value(inv->comparator_leg2, (slots[0].level & SHE_LEG2_HIGH) ? peak : 0);
+        return;
+    }
+
+    uint32_t peak = slots[idx].peak;
+    uint32_t level = slots[idx].level;
+    if (peak != inv->phase_peak) {
+        inv->phase_peak = peak;
+        mcpwm_timer_set_period(inv->timer, peak * 2);
+    }
+    mcpwm_comparator_set_compare_value(inv->comparator_leg1, (level & SHE_LEG1_HIGH) ? peak : 0);
+    mcpwm_comparator_set_compare_value(inv->comparator_leg2, (level & SHE_LEG2_HIGH) ? peak : 0);
+
+    inv->g_current_sample_idx = idx + 1;
+}
+
+
+static inline __attribute__((always_inline)) void spwm_isr_step(spwm_handle_t inv, bool latch_point)
+{
+    if (inv->active_state.samples == 0) return;
+
+    // Brake already holds the pins; keep compares at rest so recovery starts clean
+    if (inv->fault_latched) {
+        mcpwm_comparator_set_compare_value(inv->comparator_leg1, 0);
+        mcpwm_comparator_set_compare_value(inv->comparator_leg2, 0);
+        return;
+    }
+
+    // SHE programs each slot from the call before its TEZ; the other call has nothing to do
+    if (inv->active_state.she && !latch_point) return;
 
     // 1. Cycle End Check & LUT Swap
-    if (g_current_sample_idx >= active_state.samples) {
-        g_current_sample_idx = 0;
+    if (inv->g_current_sample_idx >= inv->active_state.samples) {
+        inv->g_current_sample_idx = 0;
+        inv->cycle_start_us = esp_timer_get_time();
+        inv->cycle_count++;
+        inv->phase_trim_left = inv->phase_trim_periods;
 
 
-        if (g_update_pending) {
+        if (inv->g_update_pending) {
 
-            swap_lut_pointers(&active_lut, &pending_lut);
-            //g_samples_per_cycle = g_pending_samples;
-            active_state = pending_state;
+            swap_lut_pointers(&inv->active_lut, &inv->pending_lut);
+            inv->active_state = inv->pending_state;
+
+            if (inv->trace_armed) {
+                inv->trace_swap_us = esp_timer_get_time();
+                inv->trace_armed = false;
+            }
 
             if (mqtt_task_handle != NULL) {
                 BaseType_t xHigherPriorityTaskWoken = pdFALSE;
@@ -251,66 +838,251 @@ static bool IRAM_ATTR mcpwm_timer_event_cb(mcpwm_timer_handle_t timer, const mcp
                 portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
             }
 
-            g_update_pending = false;
+            // Stopped at the cycle boundary: the ramp task parks the carrier right away
+            if (!inv->active_state.enabled && inv->freq_task != NULL) {
+                BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+                xTaskNotifyFromISR(inv->freq_task, 0, eIncrement, &xHigherPriorityTaskWoken);
+                portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
+            }
+
+            inv->g_update_pending = false;
         }
         
     }
 
     // 3. Update LF Commutation (Leg 2) via Hardware Force
     // We only issue the command twice per cycle to save overhead
-    int half_cycle = active_state.samples / 2;
+    int half_cycle = inv->active_state.samples / 2;
 
 
-    if(active_state.enabled == false)
+    if(inv->active_state.enabled == false)
     {
-        mcpwm_comparator_set_compare_value(comparator_leg1, 0);
-        mcpwm_comparator_set_compare_value(comparator_leg2, 0);
-        return false; 
+        mcpwm_comparator_set_compare_value(inv->comparator_leg1, 0);
+        mcpwm_comparator_set_compare_value(inv->comparator_leg2, 0);
+        return; 
+    }
+
+    if (inv->active_state.she) {
+        spwm_she_step(inv, latch_point);
+        return;
     }
 
+    // Also restores the carrier period after SHE
+    if (latch_point) spwm_phase_trim_step(inv, inv->g_current_sample_idx, half_cycle);
+
     // 2. Update HF SPWM (Leg 1)
 
-    uint32_t cmp_val;
-    if(g_current_sample_idx < half_cycle)
-    {
-        cmp_val = active_lut[(g_current_sample_idx+half_cycle/2)%active_state.samples] + (DEAD_TIME_NS/100*2);
-        if (cmp_val > PEAK_TICKS ) cmp_val = PEAK_TICKS; // Safety Clamp
-    }
-    else
-    {
-        cmp_val = active_lut[g_current_sample_idx] ;
-        if (cmp_val >  MAX_TICKS) cmp_val = MAX_TICKS; // Safety Clamp
-    }
+    // Phase remap and dead-time compensation are baked into the LUT at generation time;
+    // bus compensation scales |Vout|, i.e. the complement of the duty while leg 2 is high
+    int idx = inv->g_current_sample_idx;
+    uint32_t cmp_val = spwm_lut_compare(inv->active_lut[idx], idx < half_cycle, inv->output_gain_q15,
+                                        PEAK_TICKS, MAX_TICKS); // Safety Clamp, gain may push past the table clamp
     
     
-    mcpwm_comparator_set_compare_value(comparator_leg1, cmp_val);
+    mcpwm_comparator_set_compare_value(inv->comparator_leg1, cmp_val);
 
 
 
-    if (g_current_sample_idx == 0) {
+    if (idx == 0) {
         // First Half: Leg 2 High=ON, Leg 2 Low=OFF
         // (Force Level handles overrides; Deadtime module handles safety)
-        mcpwm_comparator_set_compare_value(comparator_leg2, PEAK_TICKS );  // Hold High; unsafe, critical fix required
+        mcpwm_comparator_set_compare_value(inv->comparator_leg2, inv->phase_peak);  // Hold High; unsafe, critical fix required
     } 
-    else if (g_current_sample_idx == half_cycle) {
+    else if (idx == half_cycle) {
         // Second Half: Leg 2 High=OFF, Leg 2 Low=ON
-        mcpwm_comparator_set_compare_value(comparator_leg2, 0); // Hold Low
+        mcpwm_comparator_set_compare_value(inv->comparator_leg2, 0); // Hold Low
+    }
+
+    inv->g_current_sample_idx = idx + 1;
+}
+
+
+// latch_point: the event whose update is taken by the period / compare latch that follows
+// (TEP with double update, every TEZ without). Passed by the trampolines below, never read
+// back from the counter, which has moved on by an unknown amount when the ISR runs late.
+static inline __attribute__((always_inline)) void spwm_timer_event(spwm_handle_t inv, bool latch_point)
+{
+    uint32_t entry = esp_cpu_get_cycle_count();
+
+    if (inv->resume_request_us != 0) {
+        inv->resume_latency_us = (uint32_t)(esp_timer_get_time() - inv->resume_request_us);
+        inv->resume_request_us = 0;
+    }
+
+    // Interval to the previous ISR should be exactly one update period (SPWM only)
+    if (inv->isr_count != 0 && !inv->active_state.she && !inv->isr_resync) {
+        uint32_t interval = entry - inv->isr_last_entry;
+        uint32_t jitter = interval > cpu_cycles_per_update ? interval - cpu_cycles_per_update
+                                                           : cpu_cycles_per_update - interval;
+        if (jitter > inv->isr_max_jitter) inv->isr_max_jitter = jitter;
+        if (jitter > inv->isr_watch_max_jitter) inv->isr_watch_max_jitter = jitter;
     }
+    inv->isr_last_entry = entry;
+    inv->isr_resync = false;
+    inv->isr_count++;
 
-    g_current_sample_idx++;
+    spwm_isr_step(inv, latch_point);
+
+    uint32_t exec = esp_cpu_get_cycle_count() - entry;
+    if (exec > inv->isr_max_exec) inv->isr_max_exec = exec;
+    if (exec > inv->isr_watch_max_exec) inv->isr_watch_max_exec = exec;
+    inv->isr_exec_total += exec;
+    inv->isr_calls++;
+}
+
+
+// TEZ: with double update its compares latch at TEP, the period only at TEZ
+static bool IRAM_ATTR spwm_timer_empty_cb(mcpwm_timer_handle_t timer, const mcpwm_timer_event_data_t *edata, void *user_ctx)
+{
+    spwm_timer_event((spwm_handle_t)user_ctx, !SPWM_DOUBLE_UPDATE);
+    return false;
+}
+
+
+#if SPWM_DOUBLE_UPDATE
+// TEP: its compares (and a period written with them) latch at the next TEZ
+static bool IRAM_ATTR spwm_timer_full_cb(mcpwm_timer_handle_t timer, const mcpwm_timer_event_data_t *edata, void *user_ctx)
+{
+    spwm_timer_event((spwm_handle_t)user_ctx, true);
     return false;
 }
+#endif
 
 
 
-//do not touch, confirmed to work
-void setup_mcpwm()
+// ----------------------------------------------------------------------------------
+// FAULT (ISR)
+// ----------------------------------------------------------------------------------
+static inline __attribute__((always_inline)) void spwm_fault_latch(spwm_handle_t inv, uint32_t reason)
+{
+    inv->fault_reasons |= reason;
+    if (inv->fault_latched) return;
+
+    inv->fault_latched = true;
+    inv->fault_trip_count++;
+    inv->fault_last_trip_us = esp_timer_get_time();
+
+    // Drop every staged change; the inverter comes back stopped after a clear
+    inv->active_state.enabled = false;
+    inv->pending_state.enabled = false;
+    inv->g_update_pending = false;
+    inv->target_freq = 0;
+}
+
+
+static bool IRAM_ATTR spwm_gpio_fault_cb(mcpwm_fault_handle_t fault, const mcpwm_fault_event_data_t *edata, void *user_ctx)
+{
+    spwm_fault_latch((spwm_handle_t)user_ctx, SPWM_FAULT_GPIO);
+    return false;
+}
+
+
+static bool IRAM_ATTR spwm_brake_ost_cb(mcpwm_oper_handle_t oper, const mcpwm_brake_event_data_t *edata, void *user_ctx)
+{
+    spwm_handle_t inv = (spwm_handle_t)user_ctx;
+    int64_t now = esp_timer_get_time();
+
+    // Both operators report the same trip; the first one in records it
+    if (inv->estop_request_us != 0) {
+        inv->estop_isr_latency_us = (uint32_t)(now - inv->estop_request_us);
+        inv->estop_request_us = 0;
+    }
+    spwm_fault_latch(inv, 0); // reason comes from the fault source (GPIO callback / E-stop caller)
+
+    BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+    if (mqtt_task_handle != NULL) {
+        xTaskNotifyFromISR(mqtt_task_handle, NOTIFY_SOURCE_DRIVER, eSetBits, &xHigherPriorityTaskWoken);
+    }
+    return xHigherPriorityTaskWoken == pdTRUE;
+}
+
+
+
+// Everything the carrier and fault ISRs execute or read, for spwm_check_isr_residency()
+typedef struct {
+    const char *name;
+    const void *ptr;
+    bool code;
+} spwm_isr_ref_t;
+
+esp_err_t spwm_check_isr_residency(spwm_handle_t inv)
+{
+    esp_err_t ret = ESP_OK;
+
+#if !CONFIG_MCPWM_ISR_IRAM_SAFE
+    ESP_LOGE(TAG, "CONFIG_MCPWM_ISR_IRAM_SAFE is off: MCPWM interrupts are masked while the cache is disabled");
+    ret = ESP_ERR_NOT_SUPPORTED;
+#endif
+#if !CONFIG_MCPWM_CTRL_FUNC_IN_IRAM
+    ESP_LOGE(TAG, "CONFIG_MCPWM_CTRL_FUNC_IN_IRAM is off: compare updates from the ISR run from flash");
+    ret = ESP_ERR_NOT_SUPPORTED;
+#endif
+
+    const spwm_isr_ref_t refs[] = {
+        { "spwm_timer_empty_cb",                (const void *)spwm_timer_empty_cb,                true  },
+#if SPWM_DOUBLE_UPDATE
+        { "spwm_timer_full_cb",                 (const void *)spwm_timer_full_cb,                 true  },
+#endif
+        { "spwm_gpio_fault_cb",                 (const void *)spwm_gpio_fault_cb,                 true  },
+        { "spwm_brake_ost_cb",                  (const void *)spwm_brake_ost_cb,                  true  },
+        { "mcpwm_comparator_set_compare_value", (const void *)mcpwm_comparator_set_compare_value, true  },
+        { "mcpwm_timer_set_period",             (const void *)mcpwm_timer_set_period,             true  },
+        { "xTaskGenericNotifyFromISR",          (const void *)xTaskGenericNotifyFromISR,          true  },
+        { "esp_timer_get_time",                 (const void *)esp_timer_get_time,                 true  },
+        { "inverter context",                   inv,                                              false },
+        { "active LUT",                         (const void *)inv->active_lut,                    false },
+        { "pending LUT",                        (const void *)inv->pending_lut,                   false },
+        { "mqtt_task_handle",                   &mqtt_task_handle,                                false },
+        { "cpu_cycles_per_update",              &cpu_cycles_per_update,                           false },
+    };
+
+    for (int i = 0; i < sizeof(refs) / sizeof(refs[0]); i++) {
+        bool resident = refs[i].code ? esp_ptr_in_iram(refs[i].ptr) : esp_ptr_in_dram(refs[i].ptr);
+        if (!resident) {
+            ESP_LOGE(TAG, "[%d] ISR path: %s at %p is not in %s", inv->id, refs[i].name, refs[i].ptr,
+                     refs[i].code ? "IRAM" : "DRAM");
+            ret = ESP_ERR_NOT_SUPPORTED;
+        }
+    }
+
+    // Driver objects the ISR dereferences come from the heap; internal RAM when IRAM-safe
+    const void *objs[] = { inv->timer, inv->comparator_leg1, inv->comparator_leg2 };
+    for (int i = 0; i < sizeof(objs) / sizeof(objs[0]); i++) {
+        if (!esp_ptr_internal(objs[i])) {
+            ESP_LOGE(TAG, "[%d] ISR path: driver object %p outside internal RAM", inv->id, objs[i]);
+            ret = ESP_ERR_NOT_SUPPORTED;
+        }
+    }
+
+    if (ret == ESP_OK) ESP_LOGI(TAG, "[%d] ISR call graph is IRAM/DRAM resident", inv->id);
+    return ret;
+}
+
+
+
+// One MCPWM group per instance; the bridge bring-up sequence is the original, hardware-proven one
+spwm_handle_t setup_mcpwm(int instance)
 {
+    if (instance < 0 || instance >= SPWM_MAX_INSTANCES || spwm_inverters[instance].initialized) {
+        ESP_LOGE(TAG, "Invalid or already used inverter instance %d", instance);
+        return NULL;
+    }
+
+    spwm_handle_t inv = &spwm_inverters[instance];
+    const spwm_pinout_t *pinout = &spwm_pinouts[instance];
+
+    inv->id = instance;
+    inv->active_lut = inv->sine_lut[0];
+    inv->pending_lut = inv->sine_lut[1];
+    inv->output_gain_q15 = SPWM_GAIN_ONE;
+    inv->phase_peak = PEAK_TICKS;
+    portMUX_INITIALIZE(&inv->spwm_lock);
+
     int pins[] = {
-        SPWM_LEG1_LOW_PIN,
-        SPWM_LEG1_HIGH_PIN,
-        SPWM_LEG2_LOW_PIN,
-        SPWM_LEG2_HIGH_PIN
+        pinout->leg1_low,
+        pinout->leg1_high,
+        pinout->leg2_low,
+        pinout->leg2_high
     };
 
     for (int i = 0; i < 4; i++) {
@@ -319,8 +1091,18 @@ void setup_mcpwm()
     
     }
 
-    lut_calc_mutex = xSemaphoreCreateMutex();
-    mqtt_dirty_flags = xEventGroupCreate();
+    inv->lut_calc_mutex = xSemaphoreCreateMutex();
+    inv->api_mutex = xSemaphoreCreateMutex();
+    inv->mqtt_dirty_flags = xEventGroupCreate();
+    vf_load(inv);
+    inv->lut_rebuild = false; // no LUT built yet
+
+    if (cpu_cycles_per_update == 0) {
+        uint32_t cpu_hz = 0;
+        ESP_ERROR_CHECK(esp_clk_tree_src_get_freq_hz(SOC_MOD_CLK_CPU, ESP_CLK_TREE_SRC_FREQ_PRECISION_CACHED, &cpu_hz));
+        cpu_cycles_per_update = cpu_hz / SPWM_SAMPLE_RATE_HZ;
+        cpu_cycles_per_us = cpu_hz / 1000000UL;
+    }
     
 
     // -------------------------------------------------------
@@ -328,42 +1110,41 @@ void setup_mcpwm()
     // -------------------------------------------------------
     
     mcpwm_timer_config_t timer_config = {
-        .group_id = 0,
+        .group_id = instance,
         .clk_src = MCPWM_TIMER_CLK_SRC_DEFAULT,
         .resolution_hz = TIMER_RESOLUTION_HZ,
         .period_ticks = PEAK_TICKS * 2, 
         .count_mode = MCPWM_TIMER_COUNT_MODE_UP_DOWN,
+        .flags.update_period_on_empty = true, // phase trims take effect at TEZ
     };
-    ESP_ERROR_CHECK(mcpwm_new_timer(&timer_config, &timer));
+    ESP_ERROR_CHECK(mcpwm_new_timer(&timer_config, &inv->timer));
 
     // -------------------------------------------------------
     // 2. Operator Setup
     // -------------------------------------------------------
-    mcpwm_oper_handle_t oper_leg1 = NULL;
-    mcpwm_oper_handle_t oper_leg2 = NULL;
-    
-    mcpwm_operator_config_t operator_config = { .group_id = 0 };
+    mcpwm_operator_config_t operator_config = { .group_id = instance };
 
     // Operator for Leg 1 (HF SPWM)
-    ESP_ERROR_CHECK(mcpwm_new_operator(&operator_config, &oper_leg1));
-    ESP_ERROR_CHECK(mcpwm_operator_connect_timer(oper_leg1, timer));
+    ESP_ERROR_CHECK(mcpwm_new_operator(&operator_config, &inv->oper_leg1));
+    ESP_ERROR_CHECK(mcpwm_operator_connect_timer(inv->oper_leg1, inv->timer));
 
     // Operator for Leg 2 (Fundamental Square)
-    ESP_ERROR_CHECK(mcpwm_new_operator(&operator_config, &oper_leg2));
-    ESP_ERROR_CHECK(mcpwm_operator_connect_timer(oper_leg2, timer));
+    ESP_ERROR_CHECK(mcpwm_new_operator(&operator_config, &inv->oper_leg2));
+    ESP_ERROR_CHECK(mcpwm_operator_connect_timer(inv->oper_leg2, inv->timer));
 
     // -------------------------------------------------------
     // 3. Comparator Setup (Leg 1 only)
     // -------------------------------------------------------
     mcpwm_comparator_config_t comparator_config = {
         .flags.update_cmp_on_tez = true, 
+        .flags.update_cmp_on_tep = SPWM_DOUBLE_UPDATE, // down-count half takes the value written after TEZ
     };
-    ESP_ERROR_CHECK(mcpwm_new_comparator(oper_leg1, &comparator_config, &comparator_leg1));
-    ESP_ERROR_CHECK(mcpwm_comparator_set_compare_value(comparator_leg1, 0));
+    ESP_ERROR_CHECK(mcpwm_new_comparator(inv->oper_leg1, &comparator_config, &inv->comparator_leg1));
+    ESP_ERROR_CHECK(mcpwm_comparator_set_compare_value(inv->comparator_leg1, 0));
 
     // Leg 2 Comparator (NEW: Required for safe ISR control)
-    ESP_ERROR_CHECK(mcpwm_new_comparator(oper_leg2, &comparator_config, &comparator_leg2));
-    ESP_ERROR_CHECK(mcpwm_comparator_set_compare_value(comparator_leg2, 0));
+    ESP_ERROR_CHECK(mcpwm_new_comparator(inv->oper_leg2, &comparator_config, &inv->comparator_leg2));
+    ESP_ERROR_CHECK(mcpwm_comparator_set_compare_value(inv->comparator_leg2, 0));
 
     // -------------------------------------------------------
     // 4. Generator Setup
@@ -373,37 +1154,37 @@ void setup_mcpwm()
     mcpwm_generator_config_t gen_config = {};
 
     // -- LEG 1 Generators (SPWM) --
-    gen_config.gen_gpio_num = SPWM_LEG1_HIGH_PIN;
-    ESP_ERROR_CHECK(mcpwm_new_generator(oper_leg1, &gen_config, &gen_leg1_h));
-    gen_config.gen_gpio_num = SPWM_LEG1_LOW_PIN;
-    ESP_ERROR_CHECK(mcpwm_new_generator(oper_leg1, &gen_config, &gen_leg1_l));
+    gen_config.gen_gpio_num = pinout->leg1_high;
+    ESP_ERROR_CHECK(mcpwm_new_generator(inv->oper_leg1, &gen_config, &inv->gen_leg1_h));
+    gen_config.gen_gpio_num = pinout->leg1_low;
+    ESP_ERROR_CHECK(mcpwm_new_generator(inv->oper_leg1, &gen_config, &inv->gen_leg1_l));
 
     // -- LEG 2 Generators (Fundamental) --
-    gen_config.gen_gpio_num = SPWM_LEG2_HIGH_PIN;
-    ESP_ERROR_CHECK(mcpwm_new_generator(oper_leg2, &gen_config, &gen_leg2_h));
-    gen_config.gen_gpio_num = SPWM_LEG2_LOW_PIN;
-    ESP_ERROR_CHECK(mcpwm_new_generator(oper_leg2, &gen_config, &gen_leg2_l));
+    gen_config.gen_gpio_num = pinout->leg2_high;
+    ESP_ERROR_CHECK(mcpwm_new_generator(inv->oper_leg2, &gen_config, &inv->gen_leg2_h));
+    gen_config.gen_gpio_num = pinout->leg2_low;
+    ESP_ERROR_CHECK(mcpwm_new_generator(inv->oper_leg2, &gen_config, &inv->gen_leg2_l));
 
     // -------------------------------------------------------
     // 5. Generator Actions (Leg 1 Only)
     // Leg 2 actions are controlled via Force Level in ISR
     // -------------------------------------------------------
     ESP_ERROR_CHECK(mcpwm_generator_set_actions_on_compare_event(
-        gen_leg1_h, 
-        MCPWM_GEN_COMPARE_EVENT_ACTION(MCPWM_TIMER_DIRECTION_UP, comparator_leg1, MCPWM_GEN_ACTION_LOW),
-        MCPWM_GEN_COMPARE_EVENT_ACTION(MCPWM_TIMER_DIRECTION_DOWN, comparator_leg1, MCPWM_GEN_ACTION_HIGH),
+        inv->gen_leg1_h, 
+        MCPWM_GEN_COMPARE_EVENT_ACTION(MCPWM_TIMER_DIRECTION_UP, inv->comparator_leg1, MCPWM_GEN_ACTION_LOW),
+        MCPWM_GEN_COMPARE_EVENT_ACTION(MCPWM_TIMER_DIRECTION_DOWN, inv->comparator_leg1, MCPWM_GEN_ACTION_HIGH),
         MCPWM_GEN_COMPARE_EVENT_ACTION_END()
     ));
-    ESP_ERROR_CHECK(mcpwm_generator_set_actions_on_timer_event(gen_leg1_h,
+    ESP_ERROR_CHECK(mcpwm_generator_set_actions_on_timer_event(inv->gen_leg1_h,
         MCPWM_GEN_TIMER_EVENT_ACTION(MCPWM_TIMER_DIRECTION_UP, MCPWM_TIMER_EVENT_EMPTY, MCPWM_GEN_ACTION_HIGH),
         MCPWM_GEN_TIMER_EVENT_ACTION_END()
     ));
 
-    ESP_ERROR_CHECK(mcpwm_generator_set_actions_on_compare_event(gen_leg2_h, 
-        MCPWM_GEN_COMPARE_EVENT_ACTION(MCPWM_TIMER_DIRECTION_UP, comparator_leg2, MCPWM_GEN_ACTION_LOW),
-        MCPWM_GEN_COMPARE_EVENT_ACTION(MCPWM_TIMER_DIRECTION_DOWN, comparator_leg2, MCPWM_GEN_ACTION_HIGH),
+    ESP_ERROR_CHECK(mcpwm_generator_set_actions_on_compare_event(inv->gen_leg2_h, 
+        MCPWM_GEN_COMPARE_EVENT_ACTION(MCPWM_TIMER_DIRECTION_UP, inv->comparator_leg2, MCPWM_GEN_ACTION_LOW),
+        MCPWM_GEN_COMPARE_EVENT_ACTION(MCPWM_TIMER_DIRECTION_DOWN, inv->comparator_leg2, MCPWM_GEN_ACTION_HIGH),
         MCPWM_GEN_COMPARE_EVENT_ACTION_END()));
-    ESP_ERROR_CHECK(mcpwm_generator_set_actions_on_timer_event(gen_leg2_h,
+    ESP_ERROR_CHECK(mcpwm_generator_set_actions_on_timer_event(inv->gen_leg2_h,
         MCPWM_GEN_TIMER_EVENT_ACTION(MCPWM_TIMER_DIRECTION_UP, MCPWM_TIMER_EVENT_EMPTY, MCPWM_GEN_ACTION_HIGH),
         MCPWM_GEN_TIMER_EVENT_ACTION_END()));
 
@@ -418,39 +1199,97 @@ void setup_mcpwm()
     // -- LEG 1 DEAD TIME --
     // High side: standard delay
     mcpwm_dead_time_config_t dt_config_h = { .posedge_delay_ticks = dt_ticks };
-    ESP_ERROR_CHECK(mcpwm_generator_set_dead_time(gen_leg1_h, gen_leg1_h, &dt_config_h));
+    ESP_ERROR_CHECK(mcpwm_generator_set_dead_time(inv->gen_leg1_h, inv->gen_leg1_h, &dt_config_h));
     
     // Low side: Takes Gen1_H as input, Inverts it, Apply delay
     mcpwm_dead_time_config_t dt_config_l = { 
         .negedge_delay_ticks = dt_ticks,
         .flags.invert_output = true 
     };
-    ESP_ERROR_CHECK(mcpwm_generator_set_dead_time(gen_leg1_h, gen_leg1_l, &dt_config_l)); 
+    ESP_ERROR_CHECK(mcpwm_generator_set_dead_time(inv->gen_leg1_h, inv->gen_leg1_l, &dt_config_l)); 
 
-    ESP_LOGI(TAG, "Dead time: %lu", dt_ticks );
+    ESP_LOGI(TAG, "Dead time: %lu, compensation: %lu", dt_ticks, (uint32_t)DT_COMP_TICKS );
 
     // -- LEG 2 DEAD TIME --
     // Even though Leg 2 switches at 50Hz, Dead Time is required for the transition.
     // High side: Self-input
-    ESP_ERROR_CHECK(mcpwm_generator_set_dead_time(gen_leg2_h, gen_leg2_h, &dt_config_h));
+    ESP_ERROR_CHECK(mcpwm_generator_set_dead_time(inv->gen_leg2_h, inv->gen_leg2_h, &dt_config_h));
 
     // Low side: Takes Gen2_H as input, Inverts it.
     // This allows us to only force Gen2_H in the ISR, and Gen2_L follows automatically (inverted).
-    ESP_ERROR_CHECK(mcpwm_generator_set_dead_time(gen_leg2_h, gen_leg2_l, &dt_config_l));
+    ESP_ERROR_CHECK(mcpwm_generator_set_dead_time(inv->gen_leg2_h, inv->gen_leg2_l, &dt_config_l));
+
+    // -------------------------------------------------------
+    // 6b. Fault / Brake Setup
+    // GPIO trip input and software E-stop both latch the one-shot brake. The fault
+    // handler sits after the dead-time module, so all four pins are forced LOW in
+    // hardware, independent of the LUT pipeline and the ISR.
+    // -------------------------------------------------------
+    mcpwm_gpio_fault_config_t gpio_fault_config = {
+        .group_id = instance,
+        .gpio_num = pinout->fault,
+        .flags.active_level = SPWM_FAULT_ACTIVE_LEVEL,
+        .flags.pull_up = true,
+    };
+    ESP_ERROR_CHECK(mcpwm_new_gpio_fault(&gpio_fault_config, &inv->gpio_fault));
+
+    mcpwm_soft_fault_config_t soft_fault_config = {};
+    ESP_ERROR_CHECK(mcpwm_new_soft_fault(&soft_fault_config, &inv->soft_fault));
+
+    mcpwm_oper_handle_t opers[] = { inv->oper_leg1, inv->oper_leg2 };
+    mcpwm_fault_handle_t faults[] = { inv->gpio_fault, inv->soft_fault };
+    mcpwm_operator_event_callbacks_t oper_cbs = { .on_brake_ost = spwm_brake_ost_cb };
+
+    for (int o = 0; o < 2; o++) {
+        for (int f = 0; f < 2; f++) {
+            mcpwm_brake_config_t brake_config = {
+                .fault = faults[f],
+                .brake_mode = MCPWM_OPER_BRAKE_MODE_OST,
+            };
+            ESP_ERROR_CHECK(mcpwm_operator_set_brake_on_fault(opers[o], &brake_config));
+        }
+        ESP_ERROR_CHECK(mcpwm_operator_register_event_callbacks(opers[o], &oper_cbs, inv));
+    }
+
+    mcpwm_gen_handle_t gens[] = { inv->gen_leg1_h, inv->gen_leg1_l, inv->gen_leg2_h, inv->gen_leg2_l };
+    for (int g = 0; g < 4; g++) {
+        ESP_ERROR_CHECK(mcpwm_generator_set_actions_on_brake_event(gens[g],
+            MCPWM_GEN_BRAKE_EVENT_ACTION(MCPWM_TIMER_DIRECTION_UP, MCPWM_OPER_BRAKE_MODE_OST, MCPWM_GEN_ACTION_LOW),
+            MCPWM_GEN_BRAKE_EVENT_ACTION(MCPWM_TIMER_DIRECTION_DOWN, MCPWM_OPER_BRAKE_MODE_OST, MCPWM_GEN_ACTION_LOW),
+            MCPWM_GEN_BRAKE_EVENT_ACTION_END()));
+    }
+
+    mcpwm_fault_event_callbacks_t fault_cbs = { .on_fault_enter = spwm_gpio_fault_cb };
+    ESP_ERROR_CHECK(mcpwm_fault_register_event_callbacks(inv->gpio_fault, &fault_cbs, inv));
 
     // 7. Start
-    mcpwm_timer_event_callbacks_t cbs = { .on_empty = mcpwm_timer_event_cb };
-    ESP_ERROR_CHECK(mcpwm_timer_register_event_callbacks(timer, &cbs, NULL));
+    // The instance is the ISR context; each group gets its own interrupt
+    mcpwm_timer_event_callbacks_t cbs = {
+        .on_empty = spwm_timer_empty_cb,
+#if SPWM_DOUBLE_UPDATE
+        .on_full = spwm_timer_full_cb,      // separate entry points, so each call knows its event
+#endif
+    };
+    ESP_ERROR_CHECK(mcpwm_timer_register_event_callbacks(inv->timer, &cbs, inv));
 
-    ESP_ERROR_CHECK(mcpwm_timer_enable(timer));
-    ESP_ERROR_CHECK(mcpwm_timer_start_stop(timer, MCPWM_TIMER_START_NO_STOP));
+    // The timer is enabled and started by spwm_start(); until then no carrier ISR runs
+#if CONFIG_PM_ENABLE
+    ESP_ERROR_CHECK(esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "spwm", &inv->pm_lock));
+#endif
+    inv->idle_since_us = esp_timer_get_time();
 
-    mcpwm_generator_set_force_level(gen_leg1_h, 0, true);
-    mcpwm_generator_set_force_level(gen_leg1_l, 0, true);
-    mcpwm_generator_set_force_level(gen_leg2_h, 0, true);
-    mcpwm_generator_set_force_level(gen_leg2_l, 0, true);
+    mcpwm_generator_set_force_level(inv->gen_leg1_h, 0, true);
+    mcpwm_generator_set_force_level(inv->gen_leg1_l, 0, true);
+    mcpwm_generator_set_force_level(inv->gen_leg2_h, 0, true);
+    mcpwm_generator_set_force_level(inv->gen_leg2_l, 0, true);
+
+    inv->initialized = true;
     
-    xTaskCreatePinnedToCore(freq_update_task, "freq_task", 4096, NULL, 5, NULL, 1);
+    char task_name[configMAX_TASK_NAME_LEN];
+    snprintf(task_name, sizeof(task_name), "freq_task%d", instance);
+    xTaskCreatePinnedToCore(freq_update_task, task_name, 4096, inv, 5, &inv->freq_task, 1);
+
+    return inv;
 }
 
 
@@ -460,40 +1299,204 @@ void spwm_register_mqtt(TaskHandle_t handle)
 }
 
 
-//think about snapshoting the active & pending states before logic operations
-void spwm_start(int frequency)
+void spwm_emergency_stop(spwm_handle_t inv)
 {
+    uint32_t start = esp_cpu_get_cycle_count();
+    inv->estop_request_us = esp_timer_get_time();
+
+    // Hardware path first: the soft fault trips the OST brake on both operators
+    mcpwm_soft_fault_activate(inv->soft_fault);
+    inv->estop_sw_path_cycles = esp_cpu_get_cycle_count() - start;
+
+    taskENTER_CRITICAL(&inv->spwm_lock);
+    spwm_fault_latch(inv, SPWM_FAULT_ESTOP);
+    taskEXIT_CRITICAL(&inv->spwm_lock);
+
+    ESP_LOGE(TAG, "[%d] EMERGENCY STOP (brake engaged after %lu cycles)", inv->id, inv->estop_sw_path_cycles);
+
+    xEventGroupSetBits(inv->mqtt_dirty_flags, MQTT_UPDATE_STATUS_BIT);
+    if (mqtt_task_handle) {
+        xTaskNotify(mqtt_task_handle, NOTIFY_SOURCE_DRIVER, eSetBits);
+    }
+}
+
+
+// Caller holds api_mutex, so no start can un-force the pins in between
+static esp_err_t spwm_fault_clear_locked(spwm_handle_t inv)
+{
+    if (!inv->fault_latched) return ESP_OK;
+
+    // OST recovery is refused by the driver while the fault input is still asserted
+    esp_err_t err = mcpwm_operator_recover_from_fault(inv->oper_leg1, inv->gpio_fault);
+    if (err == ESP_OK) err = mcpwm_operator_recover_from_fault(inv->oper_leg2, inv->gpio_fault);
+    if (err == ESP_OK) err = mcpwm_operator_recover_from_fault(inv->oper_leg1, inv->soft_fault);
+    if (err == ESP_OK) err = mcpwm_operator_recover_from_fault(inv->oper_leg2, inv->soft_fault);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "[%d] Fault clear refused: %s", inv->id, esp_err_to_name(err));
+        return err;
+    }
+
+    // Come back in the same state as after boot: stopped, outputs forced low
+    mcpwm_generator_set_force_level(inv->gen_leg1_h, 0, true);
+    mcpwm_generator_set_force_level(inv->gen_leg1_l, 0, true);
+    mcpwm_generator_set_force_level(inv->gen_leg2_h, 0, true);
+    mcpwm_generator_set_force_level(inv->gen_leg2_l, 0, true);
+
+    taskENTER_CRITICAL(&inv->spwm_lock);
+    inv->fault_reasons = SPWM_FAULT_NONE;
+    inv->fault_latched = false;
+    taskEXIT_CRITICAL(&inv->spwm_lock);
+
+    ESP_LOGW(TAG, "[%d] Fault cleared, inverter stopped", inv->id);
+
+    xEventGroupSetBits(inv->mqtt_dirty_flags, MQTT_UPDATE_STATUS_BIT);
+    if (mqtt_task_handle) {
+        xTaskNotify(mqtt_task_handle, NOTIFY_SOURCE_DRIVER, eSetBits);
+    }
+    return ESP_OK;
+}
+
+
+esp_err_t spwm_fault_clear(spwm_handle_t inv)
+{
+    xSemaphoreTake(inv->api_mutex, portMAX_DELAY);
+    esp_err_t err = spwm_fault_clear_locked(inv);
+    xSemaphoreGive(inv->api_mutex);
+    return err;
+}
+
+
+void spwm_get_fault_status(spwm_handle_t inv, spwm_fault_status_t *out)
+{
+    taskENTER_CRITICAL(&inv->spwm_lock);
+    out->latched         = inv->fault_latched;
+    out->reasons         = inv->fault_reasons;
+    out->trip_count      = inv->fault_trip_count;
+    out->last_trip_us    = inv->fault_last_trip_us;
+    out->estop_sw_path_us = (float)inv->estop_sw_path_cycles / cpu_cycles_per_us;
+    out->estop_isr_us    = inv->estop_isr_latency_us;
+    taskEXIT_CRITICAL(&inv->spwm_lock);
+}
+
+
+// Caller holds lut_calc_mutex. Outputs stay forced low until spwm_start() releases them.
+static void spwm_carrier_resume(spwm_handle_t inv)
+{
+    if (inv->carrier_on) return;
+
+    if (inv->pm_lock) esp_pm_lock_acquire(inv->pm_lock); // ISR timing assumes the full CPU clock
 
+    inv->isr_resync = true;
+    inv->resume_request_us = esp_timer_get_time();
+    ESP_ERROR_CHECK(mcpwm_timer_enable(inv->timer));
+    ESP_ERROR_CHECK(mcpwm_timer_start_stop(inv->timer, MCPWM_TIMER_START_NO_STOP));
+
+    taskENTER_CRITICAL(&inv->spwm_lock);
+    inv->idle_total_us += esp_timer_get_time() - inv->idle_since_us;
+    inv->carrier_on = true;
+    taskEXIT_CRITICAL(&inv->spwm_lock);
+}
+
+
+// Ramp task: park the carrier once a stop has gone through the ISR. Not while a fault is
+// latched: the brake owns the pins until spwm_fault_clear(), the next pass parks it then.
+static void spwm_carrier_idle(spwm_handle_t inv)
+{
+    xSemaphoreTake(inv->lut_calc_mutex, portMAX_DELAY);
+
+    taskENTER_CRITICAL(&inv->spwm_lock);
+    bool idle = inv->carrier_on && !inv->active_state.enabled && !inv->fault_latched &&
+                !(inv->g_update_pending && inv->pending_state.enabled);
+    taskEXIT_CRITICAL(&inv->spwm_lock);
+
+    if (idle) {
+        mcpwm_generator_set_force_level(inv->gen_leg1_h, 0, true);
+        mcpwm_generator_set_force_level(inv->gen_leg1_l, 0, true);
+        mcpwm_generator_set_force_level(inv->gen_leg2_h, 0, true);
+        mcpwm_generator_set_force_level(inv->gen_leg2_l, 0, true);
+
+        // The ISR leaves period and compares alone while disabled; park them at a plain
+        // carrier period so a resume starts with one (SHE may have left a long slot)
+        mcpwm_timer_set_period(inv->timer, PEAK_TICKS * 2);
+        mcpwm_comparator_set_compare_value(inv->comparator_leg1, 0);
+        mcpwm_comparator_set_compare_value(inv->comparator_leg2, 0);
+        inv->phase_peak = PEAK_TICKS;
+
+        ESP_ERROR_CHECK(mcpwm_timer_start_stop(inv->timer, MCPWM_TIMER_STOP_EMPTY));
+        ESP_ERROR_CHECK(mcpwm_timer_disable(inv->timer));
+        if (inv->pm_lock) esp_pm_lock_release(inv->pm_lock);
+
+        taskENTER_CRITICAL(&inv->spwm_lock);
+        inv->idle_since_us = esp_timer_get_time();
+        inv->carrier_on = false;
+        taskEXIT_CRITICAL(&inv->spwm_lock);
+
+        ESP_LOGI(TAG, "[%d] Carrier stopped (idle)", inv->id);
+        if (mqtt_task_handle) xTaskNotify(mqtt_task_handle, NOTIFY_SOURCE_DRIVER, eSetBits);
+    }
+    xSemaphoreGive(inv->lut_calc_mutex);
+}
+
+
+static void spwm_set_target_locked(spwm_handle_t inv, int frequency, int64_t cmd_us);
+
+// Caller holds api_mutex: the enabled check, the LUT build and the swap are one step
+static void spwm_start_locked(spwm_handle_t inv, int frequency)
+{
+    if (inv->fault_latched) {
+        ESP_LOGE(TAG, "[%d] Start refused: fault latched, clear it first", inv->id);
+        return;
+    }
     
+    // A stop that has not reached its cycle boundary is withdrawn before the ISR swaps it in
+    taskENTER_CRITICAL(&inv->spwm_lock);
+    bool running = inv->active_state.enabled;
+    bool stopping = running && inv->g_update_pending && !inv->pending_state.enabled;
+    if (stopping) {
+        inv->pending_state.enabled = true;
+        inv->g_update_pending = false;
+    }
+    taskEXIT_CRITICAL(&inv->spwm_lock);
+
     // 1. Check if we are fully stopped
-    if (!active_state.enabled) {
+    if (!running) {
         // Standard Cold Start logic
-        ESP_LOGI(TAG, "Inverter STARTING.");
+        ESP_LOGI(TAG, "[%d] Inverter STARTING.", inv->id);
         
 
-        set_new_frequency(50); // Calc 50Hz LUT
+        // Build, resume and swap under one lut_calc_mutex hold. The carrier may still run
+        // (stopped, not parked yet), so the ISR must never see this build as a pending update:
+        // drop any stale request first and stage without arming
+        xSemaphoreTake(inv->lut_calc_mutex, portMAX_DELAY);
+        taskENTER_CRITICAL(&inv->spwm_lock);
+        inv->g_update_pending = false;
+        taskEXIT_CRITICAL(&inv->spwm_lock);
 
-        taskENTER_CRITICAL(&spwm_lock);
+        set_new_frequency_locked(inv, 50, false); // Calc 50Hz LUT
+        spwm_carrier_resume(inv);
+
+        taskENTER_CRITICAL(&inv->spwm_lock);
         // Reset to safe defaults
         
-        pending_state.enabled = true;
+        inv->pending_state.enabled = true;
         
-        // Safe Initial Swap (since hardware is off, no glitches possible)
-        swap_lut_pointers(&active_lut, &pending_lut);
+        // The only swap of this buffer (the ISR plays nothing while active is disabled)
+        swap_lut_pointers(&inv->active_lut, &inv->pending_lut);
         
-        active_state = pending_state;
+        inv->active_state = inv->pending_state;
         
-        // Un-force the pins (The ISR is likely running but doing nothing)
-        mcpwm_generator_set_force_level(gen_leg1_h, -1, true); 
-        mcpwm_generator_set_force_level(gen_leg1_l, -1, true);
-        mcpwm_generator_set_force_level(gen_leg2_h, -1, true);
-        mcpwm_generator_set_force_level(gen_leg2_l, -1, true);
+        // Un-force the pins; compares are still at rest until the first ISR call
+        mcpwm_generator_set_force_level(inv->gen_leg1_h, -1, true); 
+        mcpwm_generator_set_force_level(inv->gen_leg1_l, -1, true);
+        mcpwm_generator_set_force_level(inv->gen_leg2_h, -1, true);
+        mcpwm_generator_set_force_level(inv->gen_leg2_l, -1, true);
 
-        g_update_pending = false; 
+        inv->g_update_pending = false; 
 
-        taskEXIT_CRITICAL(&spwm_lock);
+        taskEXIT_CRITICAL(&inv->spwm_lock);
+        xSemaphoreGive(inv->lut_calc_mutex);
 
-        spwm_set_target_frequency(frequency);
+        spwm_set_target_locked(inv, frequency, 0);
 
         if (mqtt_task_handle) {
             xTaskNotify(mqtt_task_handle, NOTIFY_SOURCE_DRIVER, eSetBits);
@@ -502,47 +1505,49 @@ void spwm_start(int frequency)
         return;
     }
 
-    // 2. Check if we are in the "Stopping" state (The Zombie State)
-    // active is TRUE, but pending is FALSE.
-    if (g_update_pending && !pending_state.enabled) {
-        ESP_LOGI(TAG, "Inverter Stop ABORTED. Resuming operation.");
-        
-        set_new_frequency(frequency);
-        taskENTER_CRITICAL(&spwm_lock);
-        pending_state.enabled = true; // Cancel the stop
-        
-        // Optionally apply new frequency immediately if requested
-        
-        g_update_pending = true; // Ensure ISR picks up the "True" enabled state
-        taskEXIT_CRITICAL(&spwm_lock);
-        
-        target_freq = frequency;
+    // 2. Check if we were in the "Stopping" state (The Zombie State)
+    // active is TRUE, but pending was FALSE. The old LUT keeps playing; the ramp task stages
+    // the new target (building here could race the ISR swap of the pending buffer).
+    if (stopping) {
+        ESP_LOGI(TAG, "[%d] Inverter Stop ABORTED. Resuming operation.", inv->id);
+        spwm_set_target_locked(inv, frequency, 0);
+        xEventGroupSetBits(inv->mqtt_dirty_flags, MQTT_UPDATE_STATUS_BIT);
         return;
     }
 
     // 3. Otherwise, we are just running normally
-    ESP_LOGW(TAG, "Inverter start requested while already running.");
+    ESP_LOGW(TAG, "[%d] Inverter start requested while already running.", inv->id);
 }
 
 
+void spwm_start(spwm_handle_t inv, int frequency)
+{
+    xSemaphoreTake(inv->api_mutex, portMAX_DELAY);
+    spwm_start_locked(inv, frequency);
+    xSemaphoreGive(inv->api_mutex);
+}
 
 
-void spwm_stop(void)
-{
-    target_freq = 0;
-    taskENTER_CRITICAL(&spwm_lock);
-    pending_state.enabled = false;
-    pending_state.current_freq = 0;
-    pending_state.mod_index = 0.0f;
-    g_update_pending = true;
-    taskEXIT_CRITICAL(&spwm_lock);
-    ESP_LOGW(TAG, "Inverter STOP requested (Will halt at next zero-cross)");
 
-    if (mqtt_dirty_flags) 
+
+void spwm_stop(spwm_handle_t inv)
+{
+    xSemaphoreTake(inv->api_mutex, portMAX_DELAY);
+    taskENTER_CRITICAL(&inv->spwm_lock);
+    inv->target_freq = 0;
+    inv->pending_state.enabled = false;
+    inv->pending_state.current_freq = 0;
+    inv->pending_state.mod_index = 0.0f;
+    inv->g_update_pending = true;
+    taskEXIT_CRITICAL(&inv->spwm_lock);
+    xSemaphoreGive(inv->api_mutex);
+    ESP_LOGW(TAG, "[%d] Inverter STOP requested (Will halt at next zero-cross)", inv->id);
+
+    if (inv->mqtt_dirty_flags) 
     {
-        xEventGroupSetBits(mqtt_dirty_flags, MQTT_UPDATE_STATUS_BIT);
-        xEventGroupSetBits(mqtt_dirty_flags, MQTT_UPDATE_FREQ_BIT);
-        xEventGroupSetBits(mqtt_dirty_flags, MQTT_UPDATE_MOD_INDEX_BIT);
+        xEventGroupSetBits(inv->mqtt_dirty_flags, MQTT_UPDATE_STATUS_BIT);
+        xEventGroupSetBits(inv->mqtt_dirty_flags, MQTT_UPDATE_FREQ_BIT);
+        xEventGroupSetBits(inv->mqtt_dirty_flags, MQTT_UPDATE_MOD_INDEX_BIT);
     }
     return;
 }
@@ -550,50 +1555,88 @@ void spwm_stop(void)
 
 
 
-void spwm_set_target_frequency(int frequency)
+void spwm_set_target_frequency(spwm_handle_t inv, int frequency)
 {
-    if(!active_state.enabled)
+    spwm_set_target_frequency_traced(inv, frequency, 0);
+}
+
+
+// Caller holds api_mutex
+static void spwm_set_target_locked(spwm_handle_t inv, int frequency, int64_t cmd_us)
+{
+    if (inv->fault_latched) {
+        ESP_LOGE(TAG, "[%d] FREQ_CHNG ignored: fault latched", inv->id);
+        return;
+    }
+
+    if(!inv->active_state.enabled)
     {
-        ESP_LOGW(TAG, "Inverter FREQ_CHNG requested while not running. Starting.");
-        spwm_start(frequency);
+        ESP_LOGW(TAG, "[%d] Inverter FREQ_CHNG requested while not running. Starting.", inv->id);
+        spwm_start_locked(inv, frequency);
         return;
     }
 
     frequency = frequency < MAX_FREQ_HZ ? frequency : MAX_FREQ_HZ;
     frequency = frequency > MIN_FREQ_HZ ? frequency : MIN_FREQ_HZ;
 
-    if(target_freq != frequency) xEventGroupSetBits(mqtt_dirty_flags,MQTT_UPDATE_TARGT_BIT);
-    target_freq = frequency;    
+    if(inv->target_freq != frequency) xEventGroupSetBits(inv->mqtt_dirty_flags,MQTT_UPDATE_TARGT_BIT);
+
+    taskENTER_CRITICAL(&inv->spwm_lock);
+    inv->target_freq = frequency;
+    // Trace only what will actually move the waveform; a newer command replaces the old trace
+    if (cmd_us != 0 && frequency != inv->active_state.current_freq) {
+        inv->trace_cmd_us = cmd_us;
+        inv->trace_target_us = esp_timer_get_time();
+        inv->trace_first_done = false;
+        inv->trace_armed = false;
+        inv->trace_swap_us = 0;
+    }
+    taskEXIT_CRITICAL(&inv->spwm_lock);
+}
+
+
+void spwm_set_target_frequency_traced(spwm_handle_t inv, int frequency, int64_t cmd_us)
+{
+    xSemaphoreTake(inv->api_mutex, portMAX_DELAY);
+    spwm_set_target_locked(inv, frequency, cmd_us);
+    xSemaphoreGive(inv->api_mutex);
 }
 
 
 
 static void freq_update_task(void *pvParameters)
 {
+    spwm_handle_t inv = (spwm_handle_t)pvParameters;
+
     vTaskDelay(pdMS_TO_TICKS(500)); 
     while (1) {
+        spwm_carrier_idle(inv);
+        spwm_trace_collect(inv);
+        spwm_phase_sync_step(inv);
+
         if(
-            active_state.enabled && 
-            !g_update_pending && //no update requests so far, we are the only ones staging an update
+            inv->active_state.enabled && 
+            !inv->g_update_pending && //no update requests so far, we are the only ones staging an update
 //            pending_state.current_freq > 0 && 
-            target_freq != active_state.current_freq)
+            (inv->target_freq != inv->active_state.current_freq || inv->lut_rebuild || spwm_she_gain_moved(inv)))
         {
-            int diff = (target_freq  - active_state.current_freq );
+            int diff = (inv->target_freq  - inv->active_state.current_freq );
 
             int calc_freq = DEFAULT_FREQ_HZ;
 
             if( abs(diff) < DEFAULT_FREQ_STEP)
             {
-                calc_freq = target_freq;
+                calc_freq = inv->target_freq;
             }
             else
             {
                 int sign = diff > 0 ? 1 : -1;
-                calc_freq = active_state.current_freq + sign*DEFAULT_FREQ_STEP;
+                calc_freq = inv->active_state.current_freq + sign*DEFAULT_FREQ_STEP;
             }
 
-            set_new_frequency(calc_freq);
+            inv->lut_rebuild = false; // any LUT built from here on uses the new curve / mode
+            set_new_frequency(inv, calc_freq);
         }
-        vTaskDelay(pdMS_TO_TICKS(500));
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(500)); // the ISR cuts this short when a stop has landed
     }
-}
\ No newline at end of file
+}
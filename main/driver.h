@@ -3,13 +3,45 @@
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "soc/soc_caps.h"
+#include "esp_err.h"
+#include "spwm_lut.h"
 
 
 #define MIN_FREQ_HZ             30
 #define MAX_FREQ_HZ             60
 #define DEFAULT_FREQ_HZ         50
 #define NOMINAL_FREQ_HZ         ((float)DEFAULT_FREQ_HZ)
-#define MIN_VOLTAGE_BOOST        0.15f // 15% minimum voltage to prevent stalling
+#define MIN_VOLTAGE_BOOST        0.15f // 15% minimum voltage to prevent stalling, floor of every V/f curve
+
+#define CARRIER_FREQ_HZ         20000UL   // 20kHz switching frequency
+#define TIMER_RESOLUTION_HZ     10000000UL
+
+// Asymmetric regular sampling: compare values are reloaded at the timer peak (TEP) as well
+// as at zero (TEZ), each half of the up-down period getting its own LUT sample. Twice the
+// waveform resolution at the same switching losses, at twice the ISR rate.
+#ifndef SPWM_DOUBLE_UPDATE
+#define SPWM_DOUBLE_UPDATE      1
+#endif
+#define SPWM_UPDATES_PER_CARRIER (SPWM_DOUBLE_UPDATE ? 2 : 1)
+#define SPWM_SAMPLE_RATE_HZ     (CARRIER_FREQ_HZ * SPWM_UPDATES_PER_CARRIER)  // LUT samples (ISR calls) per second
+
+#define NOMINAL_VBUS_V          325.0f    // DC bus the LUT amplitude is computed for (230 Vac rectified)
+
+// Output gain register: Q15 fixed point (SPWM_GAIN_ONE in spwm_lut.h), applied to every
+// compare value by the ISR so that it scales the output voltage in both half cycles
+#define SPWM_GAIN_MIN           0.5f
+#define SPWM_GAIN_MAX           1.5f
+
+// DC-bus compensation (spwm_set_bus_voltage): tighter than the register, since a wrong reading
+// goes straight into the output voltage. Outside the band the reading is taken for a sensor
+// fault (divider not fitted, floating pin, brown-out) and the gain returns to unity.
+#define SPWM_VBUS_VALID_BAND    0.25f     // +-25 % of NOMINAL_VBUS_V
+#define SPWM_BUS_GAIN_MIN       0.85f
+#define SPWM_BUS_GAIN_MAX       1.15f
+
+// Every inverter owns a whole MCPWM group (1 timer, 2 operators), so the chip caps the count
+#define SPWM_MAX_INSTANCES      SOC_MCPWM_GROUPS
 
 
 #define NOTIFY_SOURCE_DRIVER    BIT0 //MQTT transmit task is notified with this bit set to 1
@@ -21,11 +53,134 @@
 #define MQTT_UPDATE_DIFFS_STEP_BIT  BIT4  // not needed for now?
 
 
-void setup_mcpwm();
+/**
+ * @brief Opaque per-inverter context. All driver state (LUTs, runtime state, MCPWM handles)
+ * lives here and is handed to the carrier ISR through user_ctx.
+ */
+typedef struct spwm_inverter_t *spwm_handle_t;
+
+/**
+ * @brief Bring up one inverter on MCPWM group `instance` (0 .. SPWM_MAX_INSTANCES-1).
+ * Pin mapping per instance is defined in driver.c. Returns NULL on an invalid or reused id.
+ */
+spwm_handle_t setup_mcpwm(int instance);
+
+/**
+ * @brief Idle power: the carrier only runs while the inverter does. Once spwm_stop() has
+ * reached its cycle boundary, the ramp task forces the outputs low and stops and disables
+ * the MCPWM timer, so the carrier ISR no longer fires. It also releases the inverter's
+ * CPU_FREQ_MAX power-management lock, which leaves DFS and light sleep to esp_pm.
+ * spwm_start() re-enables the timer and the first compare update latches within one
+ * carrier period. setup_mcpwm() leaves the carrier stopped.
+ * Start, stop, the target setters and spwm_fault_clear() may be called from any task; a
+ * per-inverter mutex runs them one at a time. spwm_emergency_stop() does not wait for it.
+ */
+void spwm_start(spwm_handle_t inv, int frequency);
+void spwm_stop(spwm_handle_t inv);
+void spwm_set_target_frequency(spwm_handle_t inv, int frequency);
+
+int spwm_get_instance_id(spwm_handle_t inv);
+
+
+/**
+ * @brief Amplitude correction applied on top of the LUT, without rebuilding it.
+ * A single word store; safe to call from any task at up to carrier rate. Clamped to
+ * [SPWM_GAIN_MIN, SPWM_GAIN_MAX]; the LUT safety clamps still apply after the gain.
+ */
+void spwm_set_output_gain(spwm_handle_t inv, float gain);
+float spwm_get_output_gain(spwm_handle_t inv);
+
+/**
+ * @brief DC-bus compensation: sets the gain to NOMINAL_VBUS_V / vbus, clamped to
+ * [SPWM_BUS_GAIN_MIN, SPWM_BUS_GAIN_MAX], so the output voltage holds under bus sag and ripple.
+ * A reading outside NOMINAL_VBUS_V +- SPWM_VBUS_VALID_BAND resets the gain to unity.
+ */
+void spwm_set_bus_voltage(spwm_handle_t inv, float vbus);
+
+
+/**
+ * @brief V/f curve: output voltage (fraction of full modulation) over frequency, given as
+ * breakpoints with linear interpolation in between and the end values held outside.
+ * It is evaluated once into a Q15 table per integer Hz (MIN_FREQ_HZ .. MAX_FREQ_HZ) that
+ * set_new_frequency() indexes, so a new curve costs one table build plus a LUT rebuild.
+ */
+#define SPWM_VF_MAX_POINTS      8
+
+typedef enum {
+    SPWM_VF_LINEAR = 0,     // constant V/f up to NOMINAL_FREQ_HZ (constant torque)
+    SPWM_VF_QUADRATIC,      // V ~ f^2 (fans, centrifugal pumps)
+    SPWM_VF_CUSTOM,
+} spwm_vf_preset_t;
+
+typedef struct {
+    float hz;
+    float v;                // 0 .. 1, floored at MIN_VOLTAGE_BOOST
+} spwm_vf_point_t;
+
+typedef struct {
+    uint16_t preset;        // spwm_vf_preset_t
+    uint16_t count;
+    spwm_vf_point_t points[SPWM_VF_MAX_POINTS]; // ascending hz, unused entries zero
+} spwm_vf_curve_t;
+
+esp_err_t spwm_vf_curve_preset(spwm_vf_preset_t preset, spwm_vf_curve_t *out);
+
+/**
+ * @brief Validate, apply (at the next ramp task pass when running) and store the curve in
+ * NVS; setup_mcpwm() restores it, so NVS must be initialised first.
+ * @return ESP_ERR_INVALID_ARG for an empty, unsorted or out-of-range curve
+ */
+esp_err_t spwm_set_vf_curve(spwm_handle_t inv, const spwm_vf_curve_t *curve);
+void spwm_get_vf_curve(spwm_handle_t inv, spwm_vf_curve_t *out);
+
+
+/**
+ * @brief Phase alignment: the start of every output cycle is pulled onto the wall-clock grid
+ * of the output period (phase_sync.h), so units sharing SNTP time run in phase. The ISR
+ * stamps each cycle start; the ramp task converts it to wall time and trims the first
+ * carrier periods of every cycle by one timer tick each way (peak +-1) via
+ * mcpwm_timer_set_period(). Trims pause while ramping.
+ */
+#define SPWM_PHASE_TRIM_US      (2.0f * 1e6f / TIMER_RESOLUTION_HZ)  // cycle change per trimmed carrier period
+
+typedef int64_t (*spwm_clock_fn_t)(void);   // wall clock in Unix us, <= 0 while not set
+
+typedef struct
+{
+    bool enabled;
+    bool clock_valid;
+    bool locked;
+    float error_us;             // positive = cycle starts late
+    float max_abs_error_us;     // worst while locked, since enabled
+    int32_t trim_periods;       // trimmed carrier periods per cycle, positive = longer
+    uint32_t updates;
+} spwm_phase_stats_t;
+
+/**
+ * @brief Wall clock for every instance; NULL restores gettimeofday() (valid once SNTP has set
+ * the time). A fake clock drives simulated instances on the host.
+ */
+void spwm_set_phase_clock(spwm_clock_fn_t clock);
+void spwm_set_phase_sync(spwm_handle_t inv, bool enable);
+void spwm_get_phase_stats(spwm_handle_t inv, spwm_phase_stats_t *out);
+
+
+/**
+ * @brief Modulation scheme. SHE (selective harmonic elimination) replaces the 20 kHz carrier
+ * with offline-solved switching angles (she.h, tools/she_gen.py): harmonics 3 .. 9 are
+ * removed, 11 and up remain, and leg 1 switches about 22 times per cycle instead of twice per
+ * carrier period. Meant for light load, where switching losses dominate; the carrier ISR
+ * runs once per slot instead of at SPWM_SAMPLE_RATE_HZ. Bus compensation follows the gain
+ * at the ramp task pace (slot rebuild) instead of every sample, and phase trims pause.
+ * A change is applied at the next ramp task pass, at a cycle boundary.
+ */
+typedef enum {
+    SPWM_MOD_SINE = 0,
+    SPWM_MOD_SHE,
+} spwm_modulation_t;
 
-void spwm_start(int frequency);
-void spwm_stop(void);
-void spwm_set_target_frequency(int frequency);
+void spwm_set_modulation(spwm_handle_t inv, spwm_modulation_t mode);
+spwm_modulation_t spwm_get_modulation(spwm_handle_t inv);
 
 
 /**
@@ -42,10 +197,131 @@ typedef struct
     bool fuzzy_en;
     bool silent;
     bool update_pending;
+    int samples_per_cycle; // carrier periods per fundamental cycle (0 before first start), also with SHE
 } spwm_runtime_state_t;
 
 void spwm_register_mqtt(TaskHandle_t handle);
-void spwm_get_state(spwm_runtime_state_t *out);
+void spwm_get_state(spwm_handle_t inv, spwm_runtime_state_t *out);
+
+
+/**
+ * @brief Fault handling. A GPIO trip input and the software E-stop both engage the MCPWM
+ * one-shot brake, which forces all four outputs LOW in hardware. The fault stays latched
+ * (start / frequency requests are refused) until spwm_fault_clear() succeeds.
+ */
+#define SPWM_FAULT_NONE         0
+#define SPWM_FAULT_GPIO         BIT0  // external trip input asserted
+#define SPWM_FAULT_ESTOP        BIT1  // spwm_emergency_stop()
+
+typedef struct
+{
+    bool latched;
+    uint32_t reasons;           // SPWM_FAULT_* bits seen since the last clear
+    uint32_t trip_count;
+    int64_t last_trip_us;       // esp_timer time of the last trip
+    float estop_sw_path_us;     // E-stop call -> brake register written (outputs safe)
+    uint32_t estop_isr_us;      // E-stop call -> brake event ISR confirmed the trip
+} spwm_fault_status_t;
+
+/**
+ * @brief Immediate stop, bypassing the LUT / cycle-boundary pipeline of spwm_stop().
+ */
+void spwm_emergency_stop(spwm_handle_t inv);
+
+/**
+ * @brief Release the brake. Fails with ESP_ERR_INVALID_STATE while the trip input is
+ * still asserted. The inverter stays stopped afterwards.
+ */
+esp_err_t spwm_fault_clear(spwm_handle_t inv);
+void spwm_get_fault_status(spwm_handle_t inv, spwm_fault_status_t *out);
+
+
+/**
+ * @brief Carrier ISR timing, measured in CPU cycles on the core servicing the interrupt.
+ * Jitter is the largest deviation of the ISR-to-ISR interval from one update period
+ * (half a carrier period with SPWM_DOUBLE_UPDATE); with several instances running it shows
+ * whether one inverter delays the other (not tracked with SHE, whose slots vary in length).
+ * Load and rate are the share of CPU time spent in the ISR and the calls per second over the
+ * caller's window (spwm_isr_window_t); the maxima run since boot.
+ */
+typedef struct
+{
+    uint32_t isr_count;
+    float max_exec_us;
+    float max_jitter_us;
+    float avg_exec_us;
+    float load_pct;
+    float rate_hz;
+    bool idle;                  // carrier stopped (inverter off)
+    float idle_pct;             // share of the window with the carrier stopped
+    uint32_t resume_us;         // last spwm_start() on a stopped carrier -> first carrier ISR
+    float watch_max_exec_us;    // worst case since spwm_isr_watch_start()
+    float watch_max_jitter_us;
+} spwm_isr_stats_t;
+
+/**
+ * @brief Caller-owned window for avg_exec_us, load_pct, rate_hz and idle_pct: each call reports
+ * the interval since the same window's previous call and moves it on, so every consumer
+ * (status/isr, status/diag, ...) sees its own interval. Zero-initialize; the first call covers
+ * the time since boot.
+ */
+typedef struct {
+    uint32_t calls;
+    uint64_t exec_total;
+    int64_t at_us;
+    int64_t idle_us;
+} spwm_isr_window_t;
+
+/**
+ * @brief `window` NULL when only the maxima are needed; the averaged figures are 0 then.
+ */
+void spwm_get_isr_stats(spwm_handle_t inv, spwm_isr_stats_t *out, spwm_isr_window_t *window);
+
+/**
+ * @brief Restart the watch maxima (watch_max_exec_us / watch_max_jitter_us), a second worst
+ * case for one operation (OTA) that leaves the periodic max_* telemetry alone.
+ */
+void spwm_isr_watch_start(spwm_handle_t inv);
+
+/**
+ * @brief Verify that the carrier and fault ISRs keep running while the flash cache is
+ * disabled (flash writes during OTA / NVS commits): build options plus a runtime check that
+ * every function they call is in IRAM and every object they read is in DRAM.
+ * @return ESP_OK, or ESP_ERR_NOT_SUPPORTED with the offending items logged
+ */
+esp_err_t spwm_check_isr_residency(spwm_handle_t inv);
+
+
+/**
+ * @brief Command-to-actuation latency, per stage. A traced frequency command is followed
+ * from its arrival to the LUT swap in the ISR: first for the first ramp step, then for the
+ * step that reaches the target. Only commands to a running inverter are traced; a newer
+ * command replaces the one in flight.
+ */
+typedef enum {
+    SPWM_LAT_DISPATCH = 0,  // arrival -> spwm_set_target_frequency_traced()
+    SPWM_LAT_RAMP_WAIT,     // target set -> freq task starts the first LUT
+    SPWM_LAT_LUT_CALC,      // LUT computation of the first step
+    SPWM_LAT_SWAP_WAIT,     // LUT staged -> swapped in by the ISR at the cycle boundary
+    SPWM_LAT_FIRST_EDGE,    // arrival -> first waveform change
+    SPWM_LAT_SETTLED,       // arrival -> waveform at the target frequency (whole ramp)
+    SPWM_LAT_STAGE_COUNT
+} spwm_latency_stage_t;
+
+#define SPWM_LAT_BUCKETS    8   // decades: <10 us, <100 us, ... <10 s, >= 10 s
+
+typedef struct
+{
+    uint32_t count;
+    uint32_t max_us;
+    uint32_t hist[SPWM_LAT_BUCKETS];
+} spwm_latency_hist_t;
+
+/**
+ * @brief spwm_set_target_frequency() for a command that arrived at `cmd_us` (esp_timer time)
+ */
+void spwm_set_target_frequency_traced(spwm_handle_t inv, int frequency, int64_t cmd_us);
+void spwm_get_latency_stats(spwm_handle_t inv, spwm_latency_hist_t out[SPWM_LAT_STAGE_COUNT], bool reset);
 
 
-#endif
\ No newline at end of file
+#endif
@@ -1,5 +1,9 @@
 #include "driver.h"
 #include "mqtt.h"
+#include "sense.h"
+#include "dlog.h"
+#include "ota.h"
+#include "udp_ctrl.h"
 
 
 #include <stdio.h>
@@ -11,17 +15,26 @@
 #include "esp_log.h"
 #include "esp_attr.h"
 #include "esp_clk_tree.h"
+#include "esp_pm.h"
 #include "nvs_flash.h"
 
 
 static const char *TAG = "MAIN";
 
+// Number of inverters driven by this board, one MCPWM group each (max SPWM_MAX_INSTANCES)
+#define INVERTER_COUNT 1
+
+// Dynamic frequency scaling floor while no inverter holds its PM lock (XTAL, APB stays at 40 MHz)
+#define PM_MIN_CPU_FREQ_MHZ 40
+
+static spwm_handle_t inverters[INVERTER_COUNT];
+
 
 void app_main(void)
 {
-    setup_mcpwm();
-    spwm_start(DEFAULT_FREQ_HZ);
+    ESP_ERROR_CHECK(dlog_init());
 
+    // Before the inverters: setup_mcpwm() restores the stored V/f curve
     esp_err_t ret = nvs_flash_init();
     if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
       ESP_ERROR_CHECK(nvs_flash_erase());
@@ -29,9 +42,32 @@ void app_main(void)
     }
     ESP_ERROR_CHECK(ret);
 
+    for (int i = 0; i < INVERTER_COUNT; i++) {
+        inverters[i] = setup_mcpwm(i);
+        spwm_start(inverters[i], DEFAULT_FREQ_HZ);
+    }
+
+#if CONFIG_PM_ENABLE
+    // After the inverters: a running carrier holds CPU_FREQ_MAX, a stopped one lets the CPU
+    // drop to the floor and, with tickless idle, into light sleep between Wi-Fi beacons
+    esp_pm_config_t pm_cfg = {
+        .max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+        .min_freq_mhz = PM_MIN_CPU_FREQ_MHZ,
+#if CONFIG_FREERTOS_USE_TICKLESS_IDLE
+        .light_sleep_enable = true,
+#endif
+    };
+    ESP_ERROR_CHECK(esp_pm_configure(&pm_cfg));
+#endif
+    sense_init(inverters, INVERTER_COUNT);
+
     wifi_init();
     init_time_sync();
-    mqtt_init();
+    mqtt_init(inverters, INVERTER_COUNT);
+    udp_ctrl_init(inverters, INVERTER_COUNT); // optional, needs UDP_CTRL_KEY
+
+    // Network is up: a freshly updated image has proven itself
+    ota_mark_running_valid();
 
     
 
@@ -1,14 +1,18 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
+#include "freertos/semphr.h"
 
 #include "esp_event.h"
 #include "esp_log.h"
 #include "esp_system.h"
 #include "nvs_flash.h"
+#include "nvs.h"
 
 #include "esp_sntp.h"
 #include "esp_netif.h"
@@ -17,9 +21,17 @@
 
 
 #include "esp_wifi.h"
+#include "esp_timer.h"
+#include "esp_random.h"
+#include "esp_attr.h"
 #include "mqtt_client.h"
 
 #include "driver.h"
+#include "sense.h"
+#include "diag.h"
+#include "dlog.h"
+#include "ota.h"
+#include "udp_ctrl.h"
 
 
 #include "credentials.h"
@@ -28,10 +40,24 @@
 static const char *TAG = "MQTT";
 
 #define DEVICE_ID "faninv001"
+#define DEVICE_ID_2 "faninv002" // second inverter on the same board, if enabled
+
+#define TOPIC_ROOT "home/inverter/"
+#define MQTT_TOPIC_LEN 96
 
 #define MQTT_FULL_URI MQTT_SCHEME "://" MQTT_BROKER_URI
 
 #define NOTIFY_SOURCE_MQTT_CONNECTED  BIT1
+#define NOTIFY_SOURCE_DIAG            BIT3
+
+// MQTT 5 (CONFIG_MQTT_PROTOCOL_5): status topics are sent once in full, then by alias
+#define MQTT5_TOPIC_ALIAS_MAX       16      // client side table; a broker allowing fewer disables aliases
+#define MQTT5_USER_PROP_MAX         4       // user properties read from a command
+#define MQTT_CORR_ID_LEN            32
+
+// Setpoints stamped ("ts" user property, Unix ms) longer ago than this are dropped
+#define FREQ_CMD_MAX_AGE_MS         5000
+#define SNTP_VALID_EPOCH_S          1704067200  // 2024-01-01, clock not set before this
 
 
 void init_time_sync(void)
@@ -68,13 +94,111 @@ void init_time_sync(void)
 
 
 
-typedef void (*topic_handler_fn)(const char *data, int len);
+typedef void (*topic_handler_fn)(spwm_handle_t inv, const char *data, int len);
+
+// Home Assistant component an entity is announced as
+typedef enum {
+    ENTITY_INTERNAL = 0,    // status topic only, no discovery
+    ENTITY_SWITCH,
+    ENTITY_NUMBER,
+    ENTITY_BUTTON,
+    ENTITY_SENSOR,
+    ENTITY_BINARY_SENSOR,
+} mqtt_entity_type_t;
 
-// Structure to map a topic to a function
+// One row per exposed entity; discovery, subscriptions, dispatch and status publishing
+// are all derived from this (see `entities` below)
 typedef struct {
-    const char *topic;
+    const char *object_id;      // discovery topic homeassistant/<component>/<device_id>/<object_id>/config
+    const char *uniq_id;        // suffix of the HA unique id, kept stable across firmware versions
+    const char *name;
+    mqtt_entity_type_t type;
+    const char *command;        // leaf below .../control/, NULL = read-only
+    const char *status;         // leaf below .../status/, NULL = write-only
     topic_handler_fn handler;
-} mqtt_topic_map_t;
+    bool retain;                // status retained on the broker
+    int min;                    // ENTITY_NUMBER limits
+    int max;
+    const char *unit;
+    const char *device_class;
+    const char *value_template;
+} mqtt_entity_t;
+
+
+// One topic tree per inverter instance: home/inverter/<device_id>/...
+typedef struct {
+    spwm_handle_t inverter;
+    const char *device_id;
+    char control_prefix[MQTT_TOPIC_LEN];
+    char status_prefix[MQTT_TOPIC_LEN];
+    spwm_runtime_state_t last_state;
+    spwm_isr_stats_t last_isr_stats;
+    spwm_isr_window_t isr_window;   // status/isr: averages since its previous message
+    spwm_isr_window_t diag_isr;     // status/diag: averages since the previous snapshot
+    spwm_fault_status_t last_fault;
+    spwm_vf_curve_t last_vf_curve;
+    uint32_t last_phase_updates;
+    bool last_phase_enabled;
+    spwm_modulation_t last_modulation;
+    diag_cpu_window_t diag_cpu;     // CPU load of this node's diag snapshots covers its own interval
+} mqtt_inverter_node_t;
+
+// Latest-value cache for status topics while the broker is unreachable. Publishing QoS1
+// while disconnected would queue every ramp step in the esp-mqtt outbox; instead each
+// status topic keeps only its newest payload and is flushed once on reconnect.
+#define STATUS_PAYLOAD_LEN      192
+#define MQTT_OUTBOX_LIMIT_BYTES 4096  // caps what esp-mqtt may hold for in-flight QoS1 messages
+
+typedef struct {
+    const void *node;       // owning mqtt_inverter_node_t
+    const char *leaf;       // status leaf (string literal), together with node the cache key
+    char payload[STATUS_PAYLOAD_LEN];
+    int retain;
+    bool pending;
+} status_cache_slot_t;
+
+static volatile bool mqtt_connected = false;
+static bool status_cache_collecting = false; // reconnect pass: gather, then flush once
+
+static uint32_t status_cache_superseded = 0;  // stale values overwritten before reaching the broker
+static uint32_t status_cache_flushed = 0;
+static uint32_t status_cache_dropped = 0;     // no free slot (should stay 0)
+
+static const char *const device_ids[SPWM_MAX_INSTANCES] = { DEVICE_ID, DEVICE_ID_2 };
+
+static mqtt_inverter_node_t inverter_nodes[SPWM_MAX_INSTANCES];
+static int inverter_node_count = 0;
+
+// Runtime statistics on demand: one bit per instance id that asked for a snapshot
+static volatile uint32_t diag_once_mask = 0;
+static volatile uint32_t diag_periodic_mask = 0;
+static esp_timer_handle_t diag_timer = NULL;
+
+static int64_t mqtt_rx_us = 0;  // arrival (esp_timer) of the message being dispatched
+
+// MQTT 5 properties of the message being dispatched, zeroed for 3.1.1
+typedef struct {
+    char id[MQTT_CORR_ID_LEN + 1];  // user property "id", else correlation data
+    int64_t ts_ms;                  // user property "ts": sender wall clock in Unix ms, 0 = none
+} mqtt_rx_props_t;
+
+static mqtt_rx_props_t mqtt_rx_props;
+static uint32_t mqtt_stale_dropped = 0;
+
+#ifdef CONFIG_MQTT_PROTOCOL_5
+// Alias n + 1 belongs to slot n for the lifetime of the firmware; announced is per connection
+typedef struct {
+    const void *node;
+    const char *leaf;
+    bool announced;
+} topic_alias_slot_t;
+
+static topic_alias_slot_t topic_aliases[MQTT5_TOPIC_ALIAS_MAX];
+static bool topic_alias_refused = false;    // broker's Topic Alias Maximum is below ours, this connection
+static uint32_t topic_alias_hits = 0;
+static uint32_t topic_alias_bytes_saved = 0;
+#endif
+static long diag_timer_period_s = 0;
 
 
 
@@ -82,13 +206,106 @@ typedef struct {
 
 static EventGroupHandle_t wifi_event_group;
 #define WIFI_CONNECTED_BIT BIT0
+static bool wifi_ps_running = true; // WIFI_PS_MODE in effect, else WIFI_PS_IDLE_MODE
+
+// WIFI_PS_NONE: the radio stays awake, commands are not held back until the next DTIM
+// beacon (~100-300 ms with WIFI_PS_MIN_MODEM) at the cost of ~100 mA
+#define WIFI_PS_MODE                WIFI_PS_NONE
+// With every inverter off the carrier is parked; modem sleep lets esp_pm enter light sleep
+// between beacons. A start command may then wait for the next DTIM.
+#define WIFI_PS_IDLE_MODE           WIFI_PS_MIN_MODEM
+
+#define WIFI_BACKOFF_BASE_MS        250
+#define WIFI_BACKOFF_MAX_MS         30000
+#define WIFI_CACHED_AP_MAX_FAILS    2       // then forget channel/BSSID and scan all channels
+#define WIFI_CACHE_MAGIC            0x57494649UL
+
+// Last AP we were associated with. RTC_NOINIT survives software resets (OTA, panic) and
+// deep sleep, not power-on, hence magic + SSID hash.
+typedef struct {
+    uint32_t magic;
+    uint32_t ssid_hash;
+    uint8_t bssid[6];
+    uint8_t channel;
+} wifi_ap_cache_t;
+
+static RTC_NOINIT_ATTR wifi_ap_cache_t wifi_ap_cache;
+
+static esp_timer_handle_t wifi_retry_timer = NULL;
+static int wifi_retry_count = 0;            // consecutive failed attempts in this outage
+static bool wifi_using_cache = false;
+static int64_t wifi_down_since_us = 0;      // 0 while connected
+
+// Time-to-reconnect, from the disconnect event (or wifi_init) to an IP address
+static uint32_t wifi_reconnects = 0;
+static uint32_t wifi_last_reconnect_ms = 0;
+static uint32_t wifi_max_reconnect_ms = 0;
 
 static esp_mqtt_client_handle_t mqtt_client;
+static esp_mqtt_client_config_t mqtt_cfg;
+static bool mqtt_v5 = false;                // false when built for 3.1.1 or after a fallback
+static SemaphoreHandle_t mqtt_pub_lock;     // publish properties are per client: set + publish as one
 
 TaskHandle_t mqtt_task_handle = NULL;
 
 /* ===================== WIFI ===================== */
 
+static uint32_t fnv1a(uint32_t hash, const char *data, size_t len);
+
+static uint32_t wifi_ssid_hash(void)
+{
+    return fnv1a(2166136261UL, WIFI_SSID, strlen(WIFI_SSID));
+}
+
+
+static bool wifi_ap_cache_valid(void)
+{
+    return wifi_ap_cache.magic == WIFI_CACHE_MAGIC && wifi_ap_cache.ssid_hash == wifi_ssid_hash() &&
+           wifi_ap_cache.channel >= 1 && wifi_ap_cache.channel <= 14;
+}
+
+
+// Target the cached AP directly (one channel, no full scan) or go back to a full scan
+static void wifi_apply_ap_cache(bool use)
+{
+    wifi_config_t cfg;
+    esp_wifi_get_config(WIFI_IF_STA, &cfg);
+
+    wifi_using_cache = use && wifi_ap_cache_valid();
+    if (wifi_using_cache) {
+        memcpy(cfg.sta.bssid, wifi_ap_cache.bssid, sizeof(cfg.sta.bssid));
+        cfg.sta.bssid_set = true;
+        cfg.sta.channel = wifi_ap_cache.channel;
+        cfg.sta.scan_method = WIFI_FAST_SCAN;
+    } else {
+        cfg.sta.bssid_set = false;
+        cfg.sta.channel = 0;
+        cfg.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+    }
+    esp_wifi_set_config(WIFI_IF_STA, &cfg);
+}
+
+
+static void wifi_retry_cb(void *arg)
+{
+    esp_wifi_connect();
+}
+
+
+// 0 for the first retry, then base * 2^n capped, with +-50% jitter so a fleet does not
+// hammer a rebooted AP in lockstep
+static uint32_t wifi_backoff_ms(int attempt)
+{
+    if (attempt == 0) return 0;
+
+    uint32_t ms = WIFI_BACKOFF_BASE_MS;
+    for (int i = 1; i < attempt && ms < WIFI_BACKOFF_MAX_MS; i++) ms *= 2;
+    if (ms > WIFI_BACKOFF_MAX_MS) ms = WIFI_BACKOFF_MAX_MS;
+
+    return ms / 2 + esp_random() % (ms + 1);
+}
+
+
 static void wifi_event_handler(void *arg,
                                esp_event_base_t event_base,
                                int32_t event_id,
@@ -96,13 +313,46 @@ static void wifi_event_handler(void *arg,
 {
     if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
         esp_wifi_connect();
+    } else if (event_base == WIFI_EVENT &&
+               event_id == WIFI_EVENT_STA_CONNECTED) {
+        const wifi_event_sta_connected_t *ev = event_data;
+        wifi_ap_cache.magic = WIFI_CACHE_MAGIC;
+        wifi_ap_cache.ssid_hash = wifi_ssid_hash();
+        memcpy(wifi_ap_cache.bssid, ev->bssid, sizeof(wifi_ap_cache.bssid));
+        wifi_ap_cache.channel = ev->channel;
     } else if (event_base == WIFI_EVENT &&
                event_id == WIFI_EVENT_STA_DISCONNECTED) {
-        ESP_LOGI(TAG, "WiFi disconnected, retrying...");
-        esp_wifi_connect();
+        if (wifi_down_since_us == 0) wifi_down_since_us = esp_timer_get_time();
+
+        // New outage: go straight for the AP we just lost (config is not touched while associated)
+        if (wifi_retry_count == 0 && !wifi_using_cache) {
+            wifi_apply_ap_cache(true);
+        } else if (wifi_using_cache && wifi_retry_count >= WIFI_CACHED_AP_MAX_FAILS) {
+            // The AP may have moved channel or been replaced: stop insisting on it
+            ESP_LOGW(TAG, "Cached AP unreachable, falling back to a full scan");
+            wifi_apply_ap_cache(false);
+        }
+
+        uint32_t delay_ms = wifi_backoff_ms(wifi_retry_count++);
+        ESP_LOGI(TAG, "WiFi disconnected (reason %d), retry %d in %lu ms",
+                 ((const wifi_event_sta_disconnected_t *)event_data)->reason, wifi_retry_count, delay_ms);
+        if (delay_ms == 0) {
+            esp_wifi_connect();
+        } else {
+            esp_timer_stop(wifi_retry_timer);
+            esp_timer_start_once(wifi_retry_timer, (uint64_t)delay_ms * 1000);
+        }
     } else if (event_base == IP_EVENT &&
                event_id == IP_EVENT_STA_GOT_IP) {
-        ESP_LOGI(TAG, "WiFi connected");
+        if (wifi_down_since_us != 0) {
+            wifi_last_reconnect_ms = (uint32_t)((esp_timer_get_time() - wifi_down_since_us) / 1000);
+            if (wifi_last_reconnect_ms > wifi_max_reconnect_ms) wifi_max_reconnect_ms = wifi_last_reconnect_ms;
+            wifi_reconnects++;
+            wifi_down_since_us = 0;
+        }
+        ESP_LOGI(TAG, "WiFi connected in %lu ms (%s, %d retries)", wifi_last_reconnect_ms,
+                 wifi_using_cache ? "cached AP" : "full scan", wifi_retry_count);
+        wifi_retry_count = 0;
         xEventGroupSetBits(wifi_event_group, WIFI_CONNECTED_BIT);
     }
 }
@@ -118,6 +368,12 @@ void wifi_init(void)
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     ESP_ERROR_CHECK(esp_wifi_init(&cfg));
 
+    esp_timer_create_args_t retry_timer_args = {
+        .callback = wifi_retry_cb,
+        .name = "wifi_retry",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&retry_timer_args, &wifi_retry_timer));
+
     ESP_ERROR_CHECK(esp_event_handler_register(
         WIFI_EVENT, ESP_EVENT_ANY_ID, &wifi_event_handler, NULL));
     ESP_ERROR_CHECK(esp_event_handler_register(
@@ -133,8 +389,11 @@ void wifi_init(void)
 
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
     ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
+    wifi_apply_ap_cache(true);
+
+    wifi_down_since_us = esp_timer_get_time(); // boot connect counts as the first reconnect
     ESP_ERROR_CHECK(esp_wifi_start());
-    ESP_ERROR_CHECK(esp_wifi_set_ps(WIFI_PS_MIN_MODEM));
+    ESP_ERROR_CHECK(esp_wifi_set_ps(WIFI_PS_MODE));
 
     xEventGroupWaitBits(wifi_event_group, WIFI_CONNECTED_BIT, pdFALSE, pdTRUE, portMAX_DELAY);
     ESP_LOGI(TAG, "WiFi init done");
@@ -148,21 +407,57 @@ void wifi_init(void)
 
 
 
-void handle_state(const char* data, int len) {
+void handle_state(spwm_handle_t inv, const char* data, int len) {
 
     //placeholder
     if (strncmp(data, "ON", len) == 0) {
-        ESP_LOGI(TAG, "Inverter -> ON");
-        spwm_start(DEFAULT_FREQ_HZ);
+        ESP_LOGI(TAG, "Inverter %d -> ON", spwm_get_instance_id(inv));
+        spwm_start(inv, DEFAULT_FREQ_HZ);
     } else {
-        ESP_LOGI(TAG, "Inverter -> OFF");
-        spwm_stop();
+        ESP_LOGI(TAG, "Inverter %d -> OFF", spwm_get_instance_id(inv));
+        spwm_stop(inv);
     }
 }
 
 
-void handle_frequency(const char* data, int len) {
-    char buf[16] = {0};
+static const mqtt_inverter_node_t *node_for(spwm_handle_t inv)
+{
+    for (int n = 0; n < inverter_node_count; n++) {
+        if (inverter_nodes[n].inverter == inv) return &inverter_nodes[n];
+    }
+    return NULL;
+}
+
+static void publish_ack(const mqtt_inverter_node_t *node, const char *id, long freq, bool stale);
+static int mqtt_publish_plain(const char *topic, const char *data, int len, int retain);
+
+
+static bool corr_id_valid(const char *id)
+{
+    int len = strspn(id, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_-");
+    return len > 0 && len <= MQTT_CORR_ID_LEN && id[len] == '\0';
+}
+
+
+// True when the command carries a "ts" older than max_age_ms. Without SNTP time there is
+// nothing to compare against and the command is applied.
+static bool mqtt_rx_stale(int64_t max_age_ms)
+{
+    struct timeval now;
+
+    if (mqtt_rx_props.ts_ms == 0) return false;
+    gettimeofday(&now, NULL);
+    if (now.tv_sec < SNTP_VALID_EPOCH_S) return false;
+    return (int64_t)now.tv_sec * 1000 + now.tv_usec / 1000 - mqtt_rx_props.ts_ms > max_age_ms;
+}
+
+
+// "<hz>" or "<hz>,<correlation id>"; the id (with MQTT 5 preferably the "id" user property or
+// the correlation data) is echoed on status/ack right away so the sender can measure the
+// broker round trip next to the latency stages in diag. A setpoint that sat in the broker
+// for longer than FREQ_CMD_MAX_AGE_MS ("ts" user property) is acked but not applied.
+void handle_frequency(spwm_handle_t inv, const char* data, int len) {
+    char buf[48] = {0};
     int copy_len = (len < sizeof(buf) - 1) ? len : sizeof(buf) - 1;
     memcpy(buf, data, copy_len);
 
@@ -175,66 +470,932 @@ void handle_frequency(const char* data, int len) {
         return;
     }
 
-    ESP_LOGI(TAG, "Frequency request of %ld Hz", freq);
+    const char *id = mqtt_rx_props.id[0] ? mqtt_rx_props.id : (*endptr == ',' ? endptr + 1 : NULL);
+    if (id != NULL && !corr_id_valid(id)) id = NULL;
+
+    bool stale = mqtt_rx_stale(FREQ_CMD_MAX_AGE_MS);
+    if (stale) {
+        mqtt_stale_dropped++;
+        DLOGW(TAG, "Inverter %d stale frequency request of %ld Hz dropped", spwm_get_instance_id(inv), freq);
+    } else {
+        DLOGI(TAG, "Inverter %d frequency request of %ld Hz", spwm_get_instance_id(inv), freq);
+        spwm_set_target_frequency_traced(inv, (int)freq, mqtt_rx_us);
+    }
+
+    const mqtt_inverter_node_t *node = node_for(inv);
+    if (id != NULL && node != NULL) publish_ack(node, id, freq, stale);
+}
+
+
+
+void handle_estop(spwm_handle_t inv, const char* data, int len) {
+    // Any payload trips; there is no "un-stop" here, use fault_reset
+    spwm_emergency_stop(inv);
+}
+
+
+void handle_fault_reset(spwm_handle_t inv, const char* data, int len) {
+    if (spwm_fault_clear(inv) != ESP_OK) {
+        ESP_LOGW(TAG, "Inverter %d fault reset refused (trip input still active?)", spwm_get_instance_id(inv));
+    }
+}
+
 
-    spwm_set_target_frequency((int)freq);
+static void diag_timer_cb(void *arg)
+{
+    if (mqtt_task_handle != NULL) xTaskNotify(mqtt_task_handle, NOTIFY_SOURCE_DIAG, eSetBits);
 }
 
 
+// "" / "ONCE": one snapshot, "<N>": every N seconds, "0" / "OFF": stop periodic mode.
+// The period is shared by all instances; only the requesting ones publish.
+void handle_diag(spwm_handle_t inv, const char* data, int len) {
+    char buf[16] = {0};
+    int copy_len = (len < sizeof(buf) - 1) ? len : sizeof(buf) - 1;
+    memcpy(buf, data, copy_len);
+    uint32_t bit = BIT(spwm_get_instance_id(inv));
+
+    if (copy_len == 0 || strcmp(buf, "ONCE") == 0) {
+        diag_once_mask |= bit;
+        diag_timer_cb(NULL);
+        return;
+    }
+
+    long period_s = (strcmp(buf, "OFF") == 0) ? 0 : strtol(buf, NULL, 10);
+    esp_timer_stop(diag_timer); // ESP_ERR_INVALID_STATE when not running, harmless
 
-static const mqtt_topic_map_t listen_topics[] = {
-    { "home/inverter/" DEVICE_ID "/control/state", handle_state },
-    { "home/inverter/" DEVICE_ID "/control/frequency",  handle_frequency }
+    if (period_s <= 0) {
+        diag_periodic_mask &= ~bit;
+        if (diag_periodic_mask != 0) esp_timer_start_periodic(diag_timer, (uint64_t)diag_timer_period_s * 1000000ULL);
+        ESP_LOGI(TAG, "Inverter %d diag periodic mode off", spwm_get_instance_id(inv));
+        return;
+    }
+
+    if (period_s < DIAG_MIN_PERIOD_S) period_s = DIAG_MIN_PERIOD_S;
+    diag_timer_period_s = period_s;
+    diag_periodic_mask |= bit;
+    diag_once_mask |= bit;
+    esp_timer_start_periodic(diag_timer, (uint64_t)period_s * 1000000ULL);
+    diag_timer_cb(NULL);
+    ESP_LOGI(TAG, "Inverter %d diag every %ld s", spwm_get_instance_id(inv), period_s);
+}
+
+
+// "<url>" or "<url>,<safe Hz>"; the update covers the whole board, the URL policy is ota_start()'s
+void handle_ota(spwm_handle_t inv, const char* data, int len) {
+    char buf[160] = {0};
+    int copy_len = (len < (int)sizeof(buf) - 1) ? len : (int)sizeof(buf) - 1;
+    memcpy(buf, data, copy_len);
+
+    int safe_hz = 0;
+    char *comma = strrchr(buf, ',');
+    if (comma != NULL) {
+        safe_hz = (int)strtol(comma + 1, NULL, 10);
+        *comma = '\0';
+    }
+
+    spwm_handle_t all[SPWM_MAX_INSTANCES];
+    for (int n = 0; n < inverter_node_count; n++) all[n] = inverter_nodes[n].inverter;
+
+    esp_err_t err = ota_start(all, inverter_node_count, buf, safe_hz);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "OTA request refused: %s", esp_err_to_name(err));
+    }
+}
+
+// "linear", "quadratic" or "<hz>:<v>,<hz>:<v>,..." with v the fraction of full output voltage
+static esp_err_t vf_curve_parse(const char *text, spwm_vf_curve_t *out)
+{
+    if (strcmp(text, "linear") == 0) return spwm_vf_curve_preset(SPWM_VF_LINEAR, out);
+    if (strcmp(text, "quadratic") == 0) return spwm_vf_curve_preset(SPWM_VF_QUADRATIC, out);
+
+    memset(out, 0, sizeof(*out));
+    out->preset = SPWM_VF_CUSTOM;
+    const char *p = text;
+    while (*p) {
+        char *end;
+        if (out->count == SPWM_VF_MAX_POINTS) return ESP_ERR_INVALID_SIZE;
+        spwm_vf_point_t *pt = &out->points[out->count++];
+
+        pt->hz = strtof(p, &end);
+        if (end == p || *end != ':') return ESP_ERR_INVALID_ARG;
+        p = end + 1;
+        pt->v = strtof(p, &end);
+        if (end == p || (*end != ',' && *end != '\0')) return ESP_ERR_INVALID_ARG;
+        p = (*end == ',') ? end + 1 : end;
+    }
+    return ESP_OK; // range and ordering are checked by the driver
+}
+
+
+void handle_phase_sync(spwm_handle_t inv, const char* data, int len) {
+    spwm_set_phase_sync(inv, len >= 2 && strncmp(data, "ON", 2) == 0);
+}
+
+
+void handle_modulation(spwm_handle_t inv, const char* data, int len) {
+    if (len == 3 && strncmp(data, "SHE", 3) == 0) {
+        spwm_set_modulation(inv, SPWM_MOD_SHE);
+    } else if (len == 4 && strncmp(data, "SPWM", 4) == 0) {
+        spwm_set_modulation(inv, SPWM_MOD_SINE);
+    } else {
+        ESP_LOGE(TAG, "Inverter %d unknown modulation: %.*s", spwm_get_instance_id(inv), len, data);
+    }
+}
+
+
+// Curve is applied at the next ramp step and kept in NVS; status/vf_curve echoes it
+void handle_vf_curve(spwm_handle_t inv, const char* data, int len) {
+    char buf[STATUS_PAYLOAD_LEN] = {0};
+    int copy_len = (len < sizeof(buf) - 1) ? len : sizeof(buf) - 1;
+    memcpy(buf, data, copy_len);
+
+    spwm_vf_curve_t curve;
+    if (vf_curve_parse(buf, &curve) != ESP_OK || spwm_set_vf_curve(inv, &curve) != ESP_OK) {
+        ESP_LOGE(TAG, "Inverter %d invalid V/f curve: %s", spwm_get_instance_id(inv), buf);
+    }
+}
+
+
+
+typedef enum {
+    ENT_POWER = 0,
+    ENT_FREQUENCY,
+    ENT_ESTOP,
+    ENT_FAULT_RESET,
+    ENT_FAULT,
+    ENT_CURRENT_RMS,
+    ENT_CURRENT_PEAK,
+    ENT_VBUS,
+    ENT_ISR,
+    ENT_DIAG,
+    ENT_OTA,
+    ENT_VF_CURVE,
+    ENT_PHASE,
+    ENT_MODULATION,
+    ENT_COUNT
+} mqtt_entity_id_t;
+
+static const mqtt_entity_t entities[ENT_COUNT] = {
+    [ENT_POWER] = {
+        .object_id = "power", .uniq_id = "pwr", .name = "Inverter Power", .type = ENTITY_SWITCH,
+        .command = "state", .status = "state", .handler = handle_state, .retain = true,
+    },
+    [ENT_FREQUENCY] = {
+        .object_id = "frequency", .uniq_id = "hz", .name = "Target Frequency", .type = ENTITY_NUMBER,
+        .command = "frequency", .status = "frequency", .handler = handle_frequency,
+        .min = MIN_FREQ_HZ, .max = MAX_FREQ_HZ, .unit = "Hz", .device_class = "frequency",
+    },
+    [ENT_ESTOP] = {
+        .object_id = "estop", .uniq_id = "estop", .name = "Emergency Stop", .type = ENTITY_BUTTON,
+        .command = "estop", .handler = handle_estop,
+    },
+    [ENT_FAULT_RESET] = {
+        .object_id = "fault_reset", .uniq_id = "frst", .name = "Fault Reset", .type = ENTITY_BUTTON,
+        .command = "fault_reset", .handler = handle_fault_reset,
+    },
+    [ENT_FAULT] = {
+        .object_id = "fault", .uniq_id = "flt", .name = "Fault", .type = ENTITY_BINARY_SENSOR,
+        .status = "fault", .retain = true, .device_class = "problem",
+        .value_template = "{{ 'ON' if value_json.latched else 'OFF' }}",
+    },
+    [ENT_CURRENT_RMS] = {
+        .object_id = "current_rms", .uniq_id = "irms", .name = "Load Current", .type = ENTITY_SENSOR,
+        .status = "current_rms", .unit = "A", .device_class = "current",
+    },
+    [ENT_CURRENT_PEAK] = {
+        .object_id = "current_peak", .uniq_id = "ipk", .name = "Load Current Peak", .type = ENTITY_SENSOR,
+        .status = "current_peak", .unit = "A", .device_class = "current",
+    },
+    [ENT_VBUS] = {
+        .object_id = "vbus", .uniq_id = "vbus", .name = "DC Bus Voltage", .type = ENTITY_SENSOR,
+        .status = "vbus", .unit = "V", .device_class = "voltage",
+    },
+    [ENT_ISR] = {
+        .object_id = "isr", .type = ENTITY_INTERNAL, .status = "isr",
+    },
+    [ENT_DIAG] = {
+        .object_id = "diag", .type = ENTITY_INTERNAL, .command = "diag", .status = "diag", .handler = handle_diag,
+    },
+    [ENT_OTA] = {
+        .object_id = "ota", .type = ENTITY_INTERNAL, .command = "ota", .status = "ota", .handler = handle_ota,
+    },
+    [ENT_VF_CURVE] = {
+        .object_id = "vf_curve", .type = ENTITY_INTERNAL, .command = "vf_curve", .status = "vf_curve",
+        .handler = handle_vf_curve, .retain = true,
+    },
+    [ENT_PHASE] = {
+        .object_id = "phase", .type = ENTITY_INTERNAL, .command = "phase_sync", .status = "phase",
+        .handler = handle_phase_sync,
+    },
+    [ENT_MODULATION] = {
+        .object_id = "modulation", .type = ENTITY_INTERNAL, .command = "modulation", .status = "modulation",
+        .handler = handle_modulation, .retain = true,
+    },
+};
+
+static const char *const entity_components[] = {
+    [ENTITY_INTERNAL] = NULL,
+    [ENTITY_SWITCH] = "switch",
+    [ENTITY_NUMBER] = "number",
+    [ENTITY_BUTTON] = "button",
+    [ENTITY_SENSOR] = "sensor",
+    [ENTITY_BINARY_SENSOR] = "binary_sensor",
 };
 
+// Cached topics are entity status leaves (publish_entity), so one slot per entity and
+// inverter always suffices; command-only entities leave theirs unused
+#define STATUS_CACHE_SLOTS      (ENT_COUNT * SPWM_MAX_INSTANCES)
 
-#define LISTEN_TOPICS_COUNT (sizeof(listen_topics) / sizeof(listen_topics[0]))
+static status_cache_slot_t status_cache[STATUS_CACHE_SLOTS];
 
 
 /* ================== HA AUTO DISCOVERY ================== */
-static void publish_ha_discovery(esp_mqtt_client_handle_t client)
-{
-    // 1. Configure the Power Switch
-    // Topic: homeassistant/switch/<device_id>/power/config
-    const char *switch_config = 
-        "{"
-        "\"name\": \"Inverter Power\"," 
-        "\"uniq_id\": \"" DEVICE_ID "_pwr\","
-        "\"cmd_t\": \"home/inverter/" DEVICE_ID "/control/state\","
-        "\"stat_t\": \"home/inverter/" DEVICE_ID "/status/state\","
-        "\"pl_on\": \"ON\","
-        "\"pl_off\": \"OFF\","
-        "\"dev\": {"
-            "\"ids\": [\"" DEVICE_ID "\"],"
-            "\"name\": \"Inverter " DEVICE_ID "\","
-            "\"mdl\": \"ESP32-SPWM\","
-            "\"mf\": \"Custom\""
-        "}"
-        "}";
-
-    esp_mqtt_client_publish(client, 
-        "homeassistant/switch/" DEVICE_ID "/power/config", 
-        switch_config, 0, 1, 1); // Retained = 1
-
-    // 2. Configure the Frequency Slider (Number)
-    // Topic: homeassistant/number/<device_id>/frequency/config
-    const char *freq_config = 
-        "{"
-        "\"name\": \"Target Frequency\"," 
-        "\"uniq_id\": \"" DEVICE_ID "_hz\","
-        "\"cmd_t\": \"home/inverter/" DEVICE_ID "/control/frequency\","
-        "\"stat_t\": \"home/inverter/" DEVICE_ID "/status/frequency\","
-        "\"min\": 30,"
-        "\"max\": 60," // Adjust max frequency as needed
-        "\"unit_of_meas\": \"Hz\","
-        "\"dev\": {\"ids\": [\"" DEVICE_ID "\"]}"
-        "}";
-
-    esp_mqtt_client_publish(client, 
-        "homeassistant/number/" DEVICE_ID "/frequency/config", 
-        freq_config, 0, 1, 1); // Retained = 1
-        
-    ESP_LOGI(TAG, "Sent Home Assistant Auto Discovery payloads");
+#define DISCOVERY_PAYLOAD_LEN 512
+#define DISCOVERY_NVS_NAMESPACE "mqtt"
+#define DISCOVERY_READBACK_MS   3000    // retained configs arrive right after the subscription
+
+// Inverse of vf_curve_parse(): preset name, or the breakpoints of a custom curve
+static void vf_curve_format(const spwm_vf_curve_t *curve, char *buf, size_t len)
+{
+    static const char *const preset_names[] = { "linear", "quadratic" };
+
+    if (curve->preset < SPWM_VF_CUSTOM) {
+        snprintf(buf, len, "%s", preset_names[curve->preset]);
+        return;
+    }
+    int n = 0;
+    buf[0] = '\0';
+    for (int i = 0; i < curve->count; i++) {
+        n = json_append(buf, len, n, "%s%g:%.3f", i ? "," : "", curve->points[i].hz, curve->points[i].v);
+    }
+}
+
+
+// Returns payload length, or -1 when the entity is not announced / does not fit
+static int build_discovery(const mqtt_inverter_node_t *node, const mqtt_entity_t *e, bool full_device,
+                           char *topic, size_t topic_len, char *buf, size_t len)
+{
+    const char *component = entity_components[e->type];
+    const char *id = node->device_id;
+    if (component == NULL) return -1;
+
+    snprintf(topic, topic_len, "homeassistant/%s/%s/%s/config", component, id, e->object_id);
+
+    int n = json_append(buf, len, 0, "{\"name\":\"%s\",\"uniq_id\":\"%s_%s\"", e->name, id, e->uniq_id);
+    if (e->command)        n = json_append(buf, len, n, ",\"cmd_t\":\"%s%s\"", node->control_prefix, e->command);
+    if (e->status)         n = json_append(buf, len, n, ",\"stat_t\":\"%s%s\"", node->status_prefix, e->status);
+    if (e->type == ENTITY_SWITCH) n = json_append(buf, len, n, ",\"pl_on\":\"ON\",\"pl_off\":\"OFF\"");
+    if (e->type == ENTITY_NUMBER) n = json_append(buf, len, n, ",\"min\":%d,\"max\":%d", e->min, e->max);
+    if (e->unit)           n = json_append(buf, len, n, ",\"unit_of_meas\":\"%s\"", e->unit);
+    if (e->device_class)   n = json_append(buf, len, n, ",\"dev_cla\":\"%s\"", e->device_class);
+    if (e->value_template) n = json_append(buf, len, n, ",\"val_tpl\":\"%s\"", e->value_template);
+
+    // Full device block once per device; the rest only reference it by id
+    if (full_device) {
+        n = json_append(buf, len, n, ",\"dev\":{\"ids\":[\"%s\"],\"name\":\"Inverter %s\","
+                                     "\"mdl\":\"ESP32-SPWM\",\"mf\":\"Custom\"}}", id, id);
+    } else {
+        n = json_append(buf, len, n, ",\"dev\":{\"ids\":[\"%s\"]}}", id);
+    }
+
+    if (n < 0 || (size_t)n >= len) {
+        ESP_LOGE(TAG, "Discovery payload for %s/%s truncated", id, e->object_id);
+        return -1;
+    }
+    return n;
+}
+
+
+static uint32_t fnv1a(uint32_t hash, const char *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)data[i];
+        hash *= 16777619UL;
+    }
+    return hash;
+}
+
+
+// Retained configs only need re-publishing when the broker no longer holds them as built.
+// The hash of the last fully acked set is kept in NVS per device: when it differs the set
+// goes out right away. When it matches, the device compares what the broker retained under
+// its own config topics; a missing (broker restarted without persistence, configs cleared)
+// or different config gets the set republished. In both cases the read-back clears retained
+// configs the device no longer builds (entities removed or renamed). The hash is stored only
+// once the broker has acked every config of the set.
+// All of it runs on the MQTT task, the read-back timeout included (MQTT_USER_EVENT), so a
+// config's msg_id is recorded before its PUBACK can be handled.
+typedef struct {
+    uint32_t hash;              // of the set built for this connection
+    uint32_t announced;         // entity bits that have a discovery config
+    uint32_t confirmed;         // read back from the broker as built
+    bool reading;               // subscribed to its own retained configs until the window ends
+    bool checking;              // comparing them against the built set
+    int acks_pending;
+    bool publish_failed;        // a config was not queued, hash is not stored
+    int msg_ids[ENT_COUNT];     // in-flight config publishes, 0 = acked
+} discovery_state_t;
+
+_Static_assert(ENT_COUNT <= 32, "discovery bit masks hold one bit per entity");
+
+static discovery_state_t discovery_states[SPWM_MAX_INSTANCES];
+static esp_timer_handle_t discovery_timer = NULL;
+
+
+static void discovery_topic_filter(const mqtt_inverter_node_t *node, char *buf, size_t len)
+{
+    snprintf(buf, len, "homeassistant/+/%s/+/config", node->device_id);
+}
+
+
+// topic matches discovery_topic_filter() of this node
+static bool discovery_topic_is_node(const mqtt_inverter_node_t *node, const char *topic, int len)
+{
+    static const char prefix[] = "homeassistant/", suffix[] = "/config";
+    int id_len = strlen(node->device_id);
+    int at = sizeof(prefix) - 1;
+
+    if (len <= at + (int)sizeof(suffix) - 1 || strncmp(topic, prefix, at) != 0) return false;
+    if (strncmp(topic + len - (sizeof(suffix) - 1), suffix, sizeof(suffix) - 1) != 0) return false;
+    while (at < len && topic[at] != '/') at++; // component
+    at++;
+    if (at + id_len >= len || strncmp(topic + at, node->device_id, id_len) != 0 || topic[at + id_len] != '/') {
+        return false;
+    }
+    // exactly one object_id level before /config
+    const char *object_id = topic + at + id_len + 1;
+    return memchr(object_id, '/', topic + len - object_id) == topic + len - (sizeof(suffix) - 1);
+}
+
+
+static void discovery_nvs_key(const mqtt_inverter_node_t *node, char *key, size_t len)
+{
+    snprintf(key, len, "disc_%.10s", node->device_id);
+}
+
+
+static uint32_t discovery_hash(const mqtt_inverter_node_t *node, uint32_t *announced)
+{
+    char topic[MQTT_TOPIC_LEN];
+    char config[DISCOVERY_PAYLOAD_LEN];
+    uint32_t hash = 2166136261UL;
+    bool first = true;
+
+    *announced = 0;
+    for (int i = 0; i < ENT_COUNT; i++) {
+        int len = build_discovery(node, &entities[i], first, topic, sizeof(topic), config, sizeof(config));
+        if (len < 0) continue;
+        hash = fnv1a(hash, topic, strlen(topic));
+        hash = fnv1a(hash, config, len);
+        *announced |= 1UL << i;
+        first = false;
+    }
+    return hash;
+}
+
+
+// MQTT task
+static void discovery_publish(int n)
+{
+    const mqtt_inverter_node_t *node = &inverter_nodes[n];
+    discovery_state_t *ds = &discovery_states[n];
+    char topic[MQTT_TOPIC_LEN];
+    char config[DISCOVERY_PAYLOAD_LEN];
+    bool first = true;
+
+    ds->acks_pending = 0;
+    ds->publish_failed = false;
+    memset(ds->msg_ids, 0, sizeof(ds->msg_ids));
+
+    for (int i = 0; i < ENT_COUNT; i++) {
+        int len = build_discovery(node, &entities[i], first, topic, sizeof(topic), config, sizeof(config));
+        if (len < 0) continue;
+        int msg_id = mqtt_publish_plain(topic, config, len, 1); // Retained = 1
+        first = false;
+
+        if (msg_id > 0) {
+            ds->msg_ids[i] = msg_id;
+            ds->acks_pending++;
+        } else {
+            ds->publish_failed = true;
+        }
+    }
+
+    ESP_LOGI(TAG, "Sent Home Assistant Auto Discovery payloads for %s (hash %08lx)", node->device_id, ds->hash);
+}
+
+
+// MQTT task, on connect: publish when the set changed, otherwise check what the broker
+// retained; read back either way for stale configs
+static void discovery_begin(esp_mqtt_client_handle_t client, int n)
+{
+    const mqtt_inverter_node_t *node = &inverter_nodes[n];
+    discovery_state_t *ds = &discovery_states[n];
+    char key[16];
+    uint32_t stored_hash = 0;
+    uint32_t announced;
+    uint32_t hash = discovery_hash(node, &announced);
+
+    discovery_nvs_key(node, key, sizeof(key));
+    nvs_handle_t nvs;
+    bool stored = false;
+    if (nvs_open(DISCOVERY_NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK) {
+        stored = nvs_get_u32(nvs, key, &stored_hash) == ESP_OK;
+        nvs_close(nvs);
+    }
+    bool unchanged = stored && stored_hash == hash;
+
+    ds->hash = hash;
+    ds->announced = announced;
+    ds->confirmed = 0;
+    ds->acks_pending = 0;
+
+    char filter[MQTT_TOPIC_LEN];
+    discovery_topic_filter(node, filter, sizeof(filter));
+    ds->reading = esp_mqtt_client_subscribe(client, filter, 1) != -1;
+    ds->checking = ds->reading && unchanged;
+    if (ds->reading) {
+        esp_timer_stop(discovery_timer); // ESP_ERR_INVALID_STATE when not running, harmless
+        esp_timer_start_once(discovery_timer, (uint64_t)DISCOVERY_READBACK_MS * 1000);
+    }
+
+    if (!ds->checking) {
+        discovery_publish(n);
+        return;
+    }
+    ESP_LOGI(TAG, "Discovery for %s unchanged (hash %08lx), checking retained configs", node->device_id, hash);
+}
+
+
+// MQTT task: a retained config of one of our devices. Returns false for other topics.
+static bool discovery_readback(esp_mqtt_client_handle_t client, const esp_mqtt_event_t *event)
+{
+    static const char prefix[] = "homeassistant/";
+    if (event->topic_len <= (int)sizeof(prefix) - 1 || strncmp(event->topic, prefix, sizeof(prefix) - 1) != 0) {
+        return false;
+    }
+
+    char topic[MQTT_TOPIC_LEN];
+    char config[DISCOVERY_PAYLOAD_LEN];
+
+    for (int n = 0; n < inverter_node_count; n++) {
+        const mqtt_inverter_node_t *node = &inverter_nodes[n];
+        discovery_state_t *ds = &discovery_states[n];
+        if (!ds->reading || !discovery_topic_is_node(node, event->topic, event->topic_len)) continue;
+
+        bool first = true;
+        for (int i = 0; i < ENT_COUNT; i++) {
+            int len = build_discovery(node, &entities[i], first, topic, sizeof(topic), config, sizeof(config));
+            if (len < 0) continue;
+            first = false;
+            if ((int)strlen(topic) != event->topic_len || strncmp(topic, event->topic, event->topic_len) != 0) continue;
+            if (!ds->checking) return true; // our own publish coming back
+
+            bool same = event->current_data_offset == 0 && event->total_data_len == len &&
+                        event->data_len == len && memcmp(event->data, config, len) == 0;
+            if (same) ds->confirmed |= 1UL << i;
+            if (same && ds->confirmed != ds->announced) return true;
+
+            ds->checking = false;
+            if (same) {
+                ESP_LOGI(TAG, "Retained discovery for %s confirmed", node->device_id);
+            } else {
+                ESP_LOGW(TAG, "Retained discovery %s differs, republishing", topic);
+                discovery_publish(n);
+            }
+            return true;
+        }
+
+        // Not built any more. The empty retained message that clears it comes back empty.
+        if (event->current_data_offset != 0 || event->total_data_len == 0 || event->topic_len >= (int)sizeof(topic)) {
+            return true;
+        }
+        snprintf(topic, sizeof(topic), "%.*s", event->topic_len, event->topic);
+        ESP_LOGW(TAG, "Clearing stale retained discovery %s", topic);
+        mqtt_publish_plain(topic, "", 0, 1);
+        return true;
+    }
+    return true; // someone else's config: nothing to dispatch
+}
+
+
+// MQTT task: PUBACK of a discovery config; the hash is stored with the last one
+static void discovery_acked(int msg_id)
+{
+    for (int n = 0; n < inverter_node_count; n++) {
+        discovery_state_t *ds = &discovery_states[n];
+        bool complete = false;
+
+        for (int i = 0; i < ENT_COUNT; i++) {
+            if (ds->msg_ids[i] != msg_id) continue;
+            ds->msg_ids[i] = 0;
+            complete = --ds->acks_pending == 0 && !ds->publish_failed;
+            break;
+        }
+        if (!complete) continue;
+
+        char key[16];
+        nvs_handle_t nvs;
+        discovery_nvs_key(&inverter_nodes[n], key, sizeof(key));
+        if (nvs_open(DISCOVERY_NVS_NAMESPACE, NVS_READWRITE, &nvs) == ESP_OK) {
+            nvs_set_u32(nvs, key, ds->hash);
+            nvs_commit(nvs);
+            nvs_close(nvs);
+        }
+        ESP_LOGI(TAG, "Discovery for %s acked, hash %08lx stored", inverter_nodes[n].device_id, ds->hash);
+        return;
+    }
+}
+
+
+// MQTT task, connection lost: unacked configs may be gone, nothing is stored
+static void discovery_abort(void)
+{
+    esp_timer_stop(discovery_timer);
+    for (int n = 0; n < inverter_node_count; n++) {
+        discovery_states[n].reading = false;
+        discovery_states[n].checking = false;
+        discovery_states[n].acks_pending = 0;
+        memset(discovery_states[n].msg_ids, 0, sizeof(discovery_states[n].msg_ids));
+    }
+}
+
+
+// Hands the timeout to the MQTT task as MQTT_USER_EVENT
+static void discovery_timer_cb(void *arg)
+{
+    esp_mqtt_event_t event = { .event_id = MQTT_USER_EVENT, .client = mqtt_client };
+    if (esp_mqtt_dispatch_custom_event(mqtt_client, &event) != ESP_OK) {
+        ESP_LOGW(TAG, "Discovery read-back timeout not dispatched");
+    }
+}
+
+
+// MQTT task: read-back window over, whatever was not confirmed is missing on the broker
+static void discovery_check_timeout(esp_mqtt_client_handle_t client)
+{
+    for (int n = 0; n < inverter_node_count; n++) {
+        discovery_state_t *ds = &discovery_states[n];
+        bool missing = ds->checking && ds->confirmed != ds->announced;
+
+        if (ds->reading) {
+            char filter[MQTT_TOPIC_LEN];
+            discovery_topic_filter(&inverter_nodes[n], filter, sizeof(filter));
+            esp_mqtt_client_unsubscribe(client, filter);
+        }
+        ds->reading = false;
+        ds->checking = false;
+        if (!missing) continue;
+
+        ESP_LOGW(TAG, "Retained discovery for %s missing on the broker, republishing", inverter_nodes[n].device_id);
+        discovery_publish(n);
+    }
+}
+
+
+#ifdef CONFIG_MQTT_PROTOCOL_5
+
+// Aliases are per connection: announce every topic again after a reconnect
+static void topic_alias_reset(void)
+{
+    for (int i = 0; i < MQTT5_TOPIC_ALIAS_MAX; i++) topic_aliases[i].announced = false;
+    topic_alias_refused = false;
+}
+
+
+static uint16_t topic_alias_for(const void *node, const char *leaf)
+{
+    for (int i = 0; i < MQTT5_TOPIC_ALIAS_MAX; i++) {
+        topic_alias_slot_t *slot = &topic_aliases[i];
+        if (slot->node == node && slot->leaf == leaf) return i + 1;
+        if (slot->node == NULL) {
+            slot->node = node;
+            slot->leaf = leaf;
+            slot->announced = false;
+            return i + 1;
+        }
+    }
+    return 0; // table full: this topic always goes out in full
+}
+
+
+// Publish properties are client state, applied by a second API call. The publish task holds
+// mqtt_pub_lock across the pair. The MQTT task (event handler) already sits inside the
+// client's API lock and must not wait for the publish task, so if it finds the pair open it
+// puts the publish task's property back after its own publish.
+static esp_mqtt5_publish_property_config_t mqtt5_task_prop;
+
+static int mqtt5_publish(const char *topic, const char *data, int len, int qos, int retain,
+                         const esp_mqtt5_publish_property_config_t *prop)
+{
+    int msg_id = -1;
+
+    if (xTaskGetCurrentTaskHandle() == mqtt_task_handle) {
+        xSemaphoreTake(mqtt_pub_lock, portMAX_DELAY);
+        mqtt5_task_prop = *prop;
+        mqtt5_task_prop.user_property = NULL;
+        // Fails for an alias above the broker's Topic Alias Maximum
+        if (esp_mqtt5_client_set_publish_property(mqtt_client, prop) == ESP_OK) {
+            msg_id = esp_mqtt_client_publish(mqtt_client, topic, data, len, qos, retain);
+        }
+        xSemaphoreGive(mqtt_pub_lock);
+        return msg_id;
+    }
+
+    bool pair_open = xSemaphoreTake(mqtt_pub_lock, 0) != pdTRUE;
+    if (esp_mqtt5_client_set_publish_property(mqtt_client, prop) == ESP_OK) {
+        msg_id = esp_mqtt_client_publish(mqtt_client, topic, data, len, qos, retain);
+    }
+    if (pair_open) {
+        esp_mqtt5_client_set_publish_property(mqtt_client, &mqtt5_task_prop);
+    } else {
+        xSemaphoreGive(mqtt_pub_lock);
+    }
+    return msg_id;
+}
+
+
+// Status topics from the publish task go by alias once announced. An alias-only publish is
+// QoS 0: a retransmission must never reach the next connection, where the alias is not
+// defined, and every status topic is refreshed on reconnect anyway.
+static void mqtt5_publish_status(const mqtt_inverter_node_t *node, const char *leaf, const char *topic,
+                                 const char *payload, int retain, const char *corr_id)
+{
+    esp_mqtt5_publish_property_config_t prop = { 0 };
+    esp_mqtt5_user_property_item_t id_prop = { "id", corr_id };
+
+    if (corr_id != NULL) {
+        esp_mqtt5_client_set_user_property(&prop.user_property, &id_prop, 1);
+        prop.correlation_data = corr_id;
+        prop.correlation_data_len = strlen(corr_id);
+    }
+    if (xTaskGetCurrentTaskHandle() == mqtt_task_handle && !topic_alias_refused) {
+        prop.topic_alias = topic_alias_for(node, leaf);
+    }
+
+    topic_alias_slot_t *slot = prop.topic_alias ? &topic_aliases[prop.topic_alias - 1] : NULL;
+    bool by_alias = slot != NULL && slot->announced;
+
+    int msg_id = mqtt5_publish(by_alias ? "" : topic, payload, 0, by_alias ? 0 : 1, retain, &prop);
+    if (msg_id == -1 && slot != NULL) {
+        ESP_LOGW(TAG, "Broker refused topic alias %u, publishing full topics", prop.topic_alias);
+        topic_alias_refused = true;
+        prop.topic_alias = 0;
+        mqtt5_publish(topic, payload, 0, 1, retain, &prop);
+    } else if (msg_id != -1 && slot != NULL) {
+        if (by_alias) {
+            topic_alias_hits++;
+            topic_alias_bytes_saved += strlen(topic);
+        }
+        slot->announced = true;
+    }
+
+    if (prop.user_property) esp_mqtt5_client_delete_user_property(prop.user_property);
+}
+
+#endif
+
+
+// Full topic, no properties (discovery)
+static int mqtt_publish_plain(const char *topic, const char *data, int len, int retain)
+{
+#ifdef CONFIG_MQTT_PROTOCOL_5
+    if (mqtt_v5) {
+        esp_mqtt5_publish_property_config_t prop = { 0 };
+        return mqtt5_publish(topic, data, len, 1, retain, &prop);
+    }
+#endif
+    return esp_mqtt_client_publish(mqtt_client, topic, data, len, 1, retain);
+}
+
+
+// corr_id is sent as the "id" user property and as correlation data (MQTT 5 only)
+static void publish_status_ex(const mqtt_inverter_node_t *node, const char *leaf, const char *payload,
+                              int retain, const char *corr_id)
+{
+    char topic[MQTT_TOPIC_LEN];
+    snprintf(topic, sizeof(topic), "%s%s", node->status_prefix, leaf);
+#ifdef CONFIG_MQTT_PROTOCOL_5
+    if (mqtt_v5) {
+        mqtt5_publish_status(node, leaf, topic, payload, retain, corr_id);
+        return;
+    }
+#endif
+    esp_mqtt_client_publish(mqtt_client, topic, payload, 0, 1, retain);
+}
+
+
+static void publish_status_now(const mqtt_inverter_node_t *node, const char *leaf, const char *payload, int retain)
+{
+    publish_status_ex(node, leaf, payload, retain, NULL);
+}
+
+
+// Not cached: only useful now
+static void publish_ack(const mqtt_inverter_node_t *node, const char *id, long freq, bool stale)
+{
+    char ack[96];
+    snprintf(ack, sizeof(ack), "{\"id\":\"%s\",\"hz\":%ld%s}", id, freq, stale ? ",\"dropped\":\"stale\"" : "");
+    publish_status_ex(node, "ack", ack, 0, id);
+}
+
+
+static void status_cache_store(const mqtt_inverter_node_t *node, const char *leaf, const char *payload, int retain)
+{
+    status_cache_slot_t *free_slot = NULL;
+
+    for (int i = 0; i < STATUS_CACHE_SLOTS; i++) {
+        status_cache_slot_t *slot = &status_cache[i];
+        if (slot->node == node && slot->leaf == leaf) {
+            if (slot->pending) status_cache_superseded++;
+            free_slot = slot;
+            break;
+        }
+        if (free_slot == NULL && slot->node == NULL) free_slot = &status_cache[i];
+    }
+
+    if (free_slot == NULL) {
+        status_cache_dropped++;
+        return;
+    }
+
+    free_slot->node = node;
+    free_slot->leaf = leaf;
+    snprintf(free_slot->payload, sizeof(free_slot->payload), "%s", payload);
+    free_slot->retain = retain;
+    free_slot->pending = true;
+}
+
+
+static void status_cache_flush(void)
+{
+    int flushed = 0;
+    for (int i = 0; i < STATUS_CACHE_SLOTS; i++) {
+        status_cache_slot_t *slot = &status_cache[i];
+        if (!slot->pending) continue;
+
+        publish_status_now(slot->node, slot->leaf, slot->payload, slot->retain);
+        slot->pending = false;
+        flushed++;
+    }
+    status_cache_flushed += flushed;
+
+    ESP_LOGI(TAG, "Status cache flushed %d topics (superseded %lu, dropped %lu since boot)",
+             flushed, status_cache_superseded, status_cache_dropped);
+}
+
+
+// Status topics are "latest value wins": never queue them behind a dead connection
+static void publish_status(const mqtt_inverter_node_t *node, const char *leaf, const char *payload, int retain)
+{
+    if (!mqtt_connected || status_cache_collecting) {
+        status_cache_store(node, leaf, payload, retain);
+        return;
+    }
+
+    // Reconnected but not flushed yet: this fresher value replaces the cached one
+    for (int i = 0; i < STATUS_CACHE_SLOTS; i++) {
+        if (status_cache[i].pending && status_cache[i].node == node && status_cache[i].leaf == leaf) {
+            status_cache[i].pending = false;
+            status_cache_superseded++;
+        }
+    }
+    publish_status_now(node, leaf, payload, retain);
+}
+
+
+static void publish_entity(const mqtt_inverter_node_t *node, mqtt_entity_id_t id, const char *payload)
+{
+    publish_status(node, entities[id].status, payload, entities[id].retain);
+}
+
+
+// Runtime statistics snapshot. Too large for the status cache and only meaningful now,
+// so it is sent directly and skipped while the broker is unreachable.
+static void publish_diag(mqtt_inverter_node_t *node)
+{
+    static char diag_payload[DIAG_PAYLOAD_LEN];
+    static const char *const stage_names[SPWM_LAT_STAGE_COUNT] = {
+        "dispatch", "ramp_wait", "lut_calc", "swap_wait", "first_edge", "settled",
+    };
+    spwm_isr_stats_t isr_stats;
+    spwm_latency_hist_t latency[SPWM_LAT_STAGE_COUNT];
+    udp_ctrl_stats_t udp;
+    size_t len = sizeof(diag_payload);
+
+    if (!mqtt_connected) return;
+
+    int n = json_append(diag_payload, len, 0, "{");
+    n = diag_append_system(diag_payload, len, n, &node->diag_cpu);
+
+    spwm_get_isr_stats(node->inverter, &isr_stats, &node->diag_isr);
+    udp_ctrl_get_stats(&udp);
+    n = json_append(diag_payload, len, n,
+                    ",\"outbox\":%d,\"log_dropped\":%lu,\"cache\":{\"superseded\":%lu,\"flushed\":%lu,\"dropped\":%lu}"
+                    ",\"isr\":{\"count\":%lu,\"max_exec_us\":%.2f,\"max_jitter_us\":%.2f,\"load_pct\":%.2f,\"rate_hz\":%.0f,\"idle_pct\":%.1f}"
+                    ",\"wifi\":{\"reconnects\":%lu,\"last_ms\":%lu,\"max_ms\":%lu,\"cached_ap\":%s}"
+                    ",\"udp\":{\"rx\":%lu,\"ok\":%lu,\"bad_mac\":%lu,\"rejected\":%lu}"
+                    ",\"mqtt\":{\"v5\":%s,\"stale_dropped\":%lu",
+                    esp_mqtt_client_get_outbox_size(mqtt_client), dlog_get_dropped(),
+                    status_cache_superseded, status_cache_flushed, status_cache_dropped,
+                    isr_stats.isr_count, isr_stats.max_exec_us, isr_stats.max_jitter_us, isr_stats.load_pct,
+                    isr_stats.rate_hz, isr_stats.idle_pct, wifi_reconnects, wifi_last_reconnect_ms, wifi_max_reconnect_ms,
+                    wifi_using_cache ? "true" : "false",
+                    udp.rx, udp.accepted, udp.bad_mac, udp.rejected,
+                    mqtt_v5 ? "true" : "false", mqtt_stale_dropped);
+#ifdef CONFIG_MQTT_PROTOCOL_5
+    n = json_append(diag_payload, len, n, ",\"alias_hits\":%lu,\"alias_bytes_saved\":%lu",
+                    topic_alias_hits, topic_alias_bytes_saved);
+#endif
+    n = json_append(diag_payload, len, n, "}");
+
+    // Command latency per stage: count, worst case, decade histogram (<10 us ... >=10 s)
+    spwm_get_latency_stats(node->inverter, latency, false);
+    n = json_append(diag_payload, len, n, ",\"latency_us\":{");
+    for (int s = 0; s < SPWM_LAT_STAGE_COUNT; s++) {
+        n = json_append(diag_payload, len, n, "%s\"%s\":{\"n\":%lu,\"max\":%lu,\"h\":[",
+                        s ? "," : "", stage_names[s], latency[s].count, latency[s].max_us);
+        for (int b = 0; b < SPWM_LAT_BUCKETS; b++) {
+            n = json_append(diag_payload, len, n, "%s%lu", b ? "," : "", latency[s].hist[b]);
+        }
+        n = json_append(diag_payload, len, n, "]}");
+    }
+    n = json_append(diag_payload, len, n, "}}");
+
+    if (n < 0 || (size_t)n >= len) {
+        ESP_LOGE(TAG, "Diag payload for %s truncated", node->device_id);
+        return;
+    }
+    publish_status_now(node, entities[ENT_DIAG].status, diag_payload, 0);
+}
+
+
+// Resolve "home/inverter/<device_id>/control/<leaf>" to an instance and a handler
+static bool dispatch_control(const char *topic, int topic_len, const char *data, int data_len)
+{
+    for (int n = 0; n < inverter_node_count; n++) {
+        const mqtt_inverter_node_t *node = &inverter_nodes[n];
+        int prefix_len = strlen(node->control_prefix);
+
+        if (topic_len <= prefix_len || strncmp(topic, node->control_prefix, prefix_len) != 0) continue;
+
+        const char *leaf = topic + prefix_len;
+        int leaf_len = topic_len - prefix_len;
+
+        for (int i = 0; i < ENT_COUNT; i++) {
+            const mqtt_entity_t *e = &entities[i];
+
+            // Ensure length matches and strings match
+            if (e->command && strlen(e->command) == leaf_len &&
+                strncmp(leaf, e->command, leaf_len) == 0) {
+                
+                if(!e->handler)
+                {
+                    ESP_LOGE(TAG, "Topic match found but Handler is NULL!");
+                    return false;
+                }
+
+                // Execute the associated handler
+                DLOGD(TAG, "Data on %s/control/%s (%d bytes)", DLOG_STR(node->device_id), DLOG_STR(e->command), data_len);
+                e->handler(node->inverter, data, data_len);
+                return true;
+            }
+        }
+        return false;
+    }
+    return false;
+}
+
+
+// "id" and "ts" user properties and the correlation data of an incoming command
+static void mqtt_rx_props_parse(const esp_mqtt_event_t *event)
+{
+    memset(&mqtt_rx_props, 0, sizeof(mqtt_rx_props));
+#ifdef CONFIG_MQTT_PROTOCOL_5
+    const esp_mqtt5_event_property_t *prop = event->property;
+    if (!mqtt_v5 || prop == NULL) return;
+
+    if (prop->correlation_data_len > 0 && prop->correlation_data_len <= MQTT_CORR_ID_LEN) {
+        memcpy(mqtt_rx_props.id, prop->correlation_data, prop->correlation_data_len);
+    }
+
+    esp_mqtt5_user_property_item_t items[MQTT5_USER_PROP_MAX];
+    uint8_t count = esp_mqtt5_client_get_user_property_count(prop->user_property);
+    if (count == 0 || count > MQTT5_USER_PROP_MAX ||
+        esp_mqtt5_client_get_user_property(prop->user_property, items, &count) != ESP_OK) return;
+
+    // Key and value strings are allocated for the caller
+    for (int i = 0; i < count; i++) {
+        if (strcmp(items[i].key, "id") == 0) {
+            snprintf(mqtt_rx_props.id, sizeof(mqtt_rx_props.id), "%s", items[i].value);
+        } else if (strcmp(items[i].key, "ts") == 0) {
+            mqtt_rx_props.ts_ms = strtoll(items[i].value, NULL, 10);
+        }
+        free((void *)items[i].key);
+        free((void *)items[i].value);
+    }
+#endif
 }
 
 
@@ -247,18 +1408,31 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
     switch ((esp_mqtt_event_id_t)event_id) {
         
         case MQTT_EVENT_CONNECTED:
-            ESP_LOGI(TAG, "MQTT Connected to %s", MQTT_FULL_URI);
+#ifdef CONFIG_MQTT_PROTOCOL_5
+            topic_alias_reset();
+#endif
+            mqtt_connected = true;
+            ESP_LOGI(TAG, "MQTT Connected to %s (%s)", MQTT_FULL_URI, mqtt_v5 ? "MQTT 5" : "MQTT 3.1.1");
             ESP_LOGI(TAG, "Session present: %d", event->session_present);
 
-            publish_ha_discovery(client);
+            for (int n = 0; n < inverter_node_count; n++) {
+                const mqtt_inverter_node_t *node = &inverter_nodes[n];
+
+                discovery_begin(client, n);
             
-            // Loop through the array and subscribe to everything
-            for (int i = 0; i < LISTEN_TOPICS_COUNT; i++) {
-                int msg_id = esp_mqtt_client_subscribe(client, listen_topics[i].topic, 1); // QoS 1
-                if (msg_id == -1) {
-                    ESP_LOGE(TAG, "Failed to subscribe to: %s", listen_topics[i].topic);
-                } else {
-                    ESP_LOGI(TAG, "Subscribing to: %s (Msg ID: %d)", listen_topics[i].topic, msg_id);
+                // Loop through the entities and subscribe to every command topic
+                for (int i = 0; i < ENT_COUNT; i++) {
+                    if (entities[i].command == NULL) continue;
+
+                    char topic[MQTT_TOPIC_LEN];
+                    snprintf(topic, sizeof(topic), "%s%s", node->control_prefix, entities[i].command);
+
+                    int msg_id = esp_mqtt_client_subscribe(client, topic, 1); // QoS 1
+                    if (msg_id == -1) {
+                        ESP_LOGE(TAG, "Failed to subscribe to: %s", topic);
+                    } else {
+                        ESP_LOGI(TAG, "Subscribing to: %s (Msg ID: %d)", topic, msg_id);
+                    }
                 }
             }
             if (mqtt_task_handle != NULL) {
@@ -279,36 +1453,29 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
 
         case MQTT_EVENT_PUBLISHED:
              ESP_LOGD(TAG, "Publish ACK received, msg_id=%d", event->msg_id);
+             discovery_acked(event->msg_id);
              break;
 
+        case MQTT_USER_EVENT:
+            discovery_check_timeout(client);
+            break;
+
         case MQTT_EVENT_DATA:
-            ESP_LOGI(TAG, "Data on %.*s", event->topic_len, event->topic);
-            
-            // Generic Dispatcher: Find the matching topic in our array
-            bool handled = false;
-            for (int i = 0; i < LISTEN_TOPICS_COUNT; i++) {
-                // Ensure length matches and strings match
-                if (strlen(listen_topics[i].topic) == event->topic_len &&
-                    strncmp(event->topic, listen_topics[i].topic, event->topic_len) == 0) {
-                    
-                    if(!listen_topics[i].handler)
-                    {
-                        ESP_LOGE(TAG, "Topic match found but Handler is NULL!");
-                        break;
-                    }
+            mqtt_rx_us = esp_timer_get_time(); // start of the command latency trace
+            mqtt_rx_props_parse(event);
 
-                    // Execute the associated handler
-                    listen_topics[i].handler(event->data, event->data_len);
-                    handled = true;
-                    break; 
-                }
-            }
+            if (discovery_readback(client, event)) break;
+
+            // Generic Dispatcher: Find the matching instance and topic in our arrays
+            bool handled = dispatch_control(event->topic, event->topic_len, event->data, event->data_len);
             
             if (!handled) {
                 ESP_LOGW(TAG, "No handler found for topic: %.*s", event->topic_len, event->topic);
             }
             break;
         case MQTT_EVENT_DISCONNECTED:
+            mqtt_connected = false;
+            discovery_abort();
             ESP_LOGW(TAG, "MQTT Disconnected. Waiting for auto-reconnect...");
             break;
 
@@ -321,6 +1488,17 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
                 ESP_LOGE(TAG, "TLS/SSL Stack Error: 0x%x", event->error_handle->esp_tls_stack_err);
                 ESP_LOGE(TAG, "Last ESP-TLS Error: 0x%x", event->error_handle->esp_tls_last_esp_err);
             } else if (event->error_handle->error_type == MQTT_ERROR_TYPE_CONNECTION_REFUSED) {
+#ifdef CONFIG_MQTT_PROTOCOL_5
+                // A 3.1.1 broker answers a v5 CONNECT with "unacceptable protocol version"
+                int rc = event->error_handle->connect_return_code;
+                if (mqtt_v5 && (rc == MQTT_CONNECTION_REFUSE_PROTOCOL || rc == MQTT5_UNSUPPORTED_PROTOCOL_VER)) {
+                    ESP_LOGW(TAG, "Broker does not speak MQTT 5, falling back to 3.1.1");
+                    mqtt_v5 = false;
+                    mqtt_cfg.session.protocol_ver = MQTT_PROTOCOL_V_3_1_1;
+                    esp_mqtt_set_config(client, &mqtt_cfg);
+                    break;
+                }
+#endif
                  ESP_LOGE(TAG, "Connection Refused! (Check Username/Password/ClientID)");
             } else {
                  ESP_LOGE(TAG, "Unknown Error Type: %d", event->error_handle->error_type);
@@ -339,12 +1517,17 @@ void mqtt_publish_task(void *pvParameters)
     // Register self
     mqtt_task_handle = xTaskGetCurrentTaskHandle();
     spwm_register_mqtt(mqtt_task_handle);
+    sense_register_mqtt(mqtt_task_handle);
+    ota_register_mqtt(mqtt_task_handle);
 
-    char payload[32];
+    char payload[STATUS_PAYLOAD_LEN];
     spwm_runtime_state_t current_state; 
-    
-    // "Last Known" state (Initialize to impossible values to force first update)
-    spwm_runtime_state_t last_state = { .current_frequency = 0, .mod_index =0., .target_frequency = 0, .running = false };
+    spwm_isr_stats_t isr_stats;
+    sense_measurements_t meas;
+    spwm_fault_status_t fault;
+    ota_status_t ota;
+    spwm_vf_curve_t vf_curve;
+    spwm_phase_stats_t phase;
 
     uint32_t notification_value = 0; //ignored for now
 
@@ -357,31 +1540,141 @@ void mqtt_publish_task(void *pvParameters)
         if (notification_value & NOTIFY_SOURCE_MQTT_CONNECTED) {
             ESP_LOGI(TAG, "MQTT Ready: Forcing full state refresh");
             force_update = true;
+            // Merge the refresh into the outage cache so every topic goes out exactly once
+            status_cache_collecting = true;
         }
 
-        // 2. Snapshot current system state
-        spwm_get_state(&current_state);
+        // The driver notification does not say which inverter changed; diff them all
+        for (int n = 0; n < inverter_node_count; n++) {
+            mqtt_inverter_node_t *node = &inverter_nodes[n];
+            // "Last Known" state lives in the node (zero-initialised, first pass is forced on connect)
+            spwm_runtime_state_t *last_state = &node->last_state;
+
+            // 2. Snapshot current system state
+            spwm_get_state(node->inverter, &current_state);
+
+            // 3. Diff & Publish - FREQUENCY
+            if (current_state.current_frequency != last_state->current_frequency || force_update) {
+                snprintf(payload, sizeof(payload), "%d", current_state.current_frequency);
+                publish_entity(node, ENT_FREQUENCY, payload);
+                
+                last_state->current_frequency = current_state.current_frequency; // Update last known
+                DLOGI(TAG, "MQTT: %s freq updated to %d", DLOG_STR(node->device_id), last_state->current_frequency);
+            }
+
+            // 4. Diff & Publish - STATUS (ON/OFF)
+            if (current_state.running != last_state->running || force_update) {
+                const char* state_str = current_state.running ? "ON" : "OFF";
+                publish_entity(node, ENT_POWER, state_str);
+                
+                last_state->running = current_state.running; // Update last known
+                DLOGI(TAG, "MQTT: %s state updated to %s", DLOG_STR(node->device_id), DLOG_STR(state_str));
+            }
 
-        // 3. Diff & Publish - FREQUENCY
-        if (current_state.current_frequency != last_state.current_frequency || force_update) {
-            snprintf(payload, sizeof(payload), "%d", current_state.current_frequency);
-            esp_mqtt_client_publish(mqtt_client, 
-                                    "home/inverter/" DEVICE_ID "/status/frequency", 
-                                    payload, 0, 1, 0);
-            
-            last_state.current_frequency = current_state.current_frequency; // Update last known
-            ESP_LOGI(TAG, "MQTT: Freq updated to %d", last_state.current_frequency);
+            // 5. Fault latch; retained so a dashboard sees a trip that happened while it was away
+            spwm_get_fault_status(node->inverter, &fault);
+            if (fault.latched != node->last_fault.latched || fault.reasons != node->last_fault.reasons ||
+                fault.trip_count != node->last_fault.trip_count || force_update) {
+                snprintf(payload, sizeof(payload),
+                         "{\"latched\":%s,\"gpio\":%s,\"estop\":%s,\"trips\":%lu,\"estop_sw_us\":%.2f,\"estop_isr_us\":%lu}",
+                         fault.latched ? "true" : "false",
+                         (fault.reasons & SPWM_FAULT_GPIO) ? "true" : "false",
+                         (fault.reasons & SPWM_FAULT_ESTOP) ? "true" : "false",
+                         fault.trip_count, fault.estop_sw_path_us, fault.estop_isr_us);
+                publish_entity(node, ENT_FAULT, payload);
+                node->last_fault = fault;
+                if (fault.latched) ESP_LOGE(TAG, "MQTT: %s fault %s", node->device_id, payload);
+            }
+
+            // 5a. V/f curve, retained so a dashboard shows the stored one
+            spwm_get_vf_curve(node->inverter, &vf_curve);
+            if (memcmp(&vf_curve, &node->last_vf_curve, sizeof(vf_curve)) != 0 || force_update) {
+                vf_curve_format(&vf_curve, payload, sizeof(payload));
+                publish_entity(node, ENT_VF_CURVE, payload);
+                node->last_vf_curve = vf_curve;
+            }
+
+            // 5b. Phase alignment, after every controller update (ramp task pace)
+            spwm_get_phase_stats(node->inverter, &phase);
+            if (phase.updates != node->last_phase_updates || phase.enabled != node->last_phase_enabled || force_update) {
+                snprintf(payload, sizeof(payload),
+                         "{\"enabled\":%s,\"clock\":%s,\"locked\":%s,\"error_us\":%.1f,\"max_error_us\":%.1f,\"trim\":%ld}",
+                         phase.enabled ? "true" : "false", phase.clock_valid ? "true" : "false",
+                         phase.locked ? "true" : "false", phase.error_us, phase.max_abs_error_us,
+                         (long)phase.trim_periods);
+                publish_entity(node, ENT_PHASE, payload);
+                node->last_phase_updates = phase.updates;
+                node->last_phase_enabled = phase.enabled;
+            }
+
+            // 5c. Modulation scheme, retained like the V/f curve
+            spwm_modulation_t modulation = spwm_get_modulation(node->inverter);
+            if (modulation != node->last_modulation || force_update) {
+                publish_entity(node, ENT_MODULATION, modulation == SPWM_MOD_SHE ? "SHE" : "SPWM");
+                node->last_modulation = modulation;
+            }
+
+            // 5d. Carrier ISR timing; only worth a message when a new worst case shows up
+            spwm_get_isr_stats(node->inverter, &isr_stats, NULL);
+            if (isr_stats.max_exec_us > node->last_isr_stats.max_exec_us ||
+                isr_stats.max_jitter_us > node->last_isr_stats.max_jitter_us ||
+                isr_stats.idle != node->last_isr_stats.idle || force_update) {
+                spwm_get_isr_stats(node->inverter, &isr_stats, &node->isr_window); // averages since the last message
+                snprintf(payload, sizeof(payload),
+                         "{\"max_exec_us\":%.2f,\"max_jitter_us\":%.2f,\"avg_exec_us\":%.2f,\"load_pct\":%.2f,\"rate_hz\":%.0f,"
+                         "\"idle\":%s,\"idle_pct\":%.1f,\"resume_us\":%lu}",
+                         isr_stats.max_exec_us, isr_stats.max_jitter_us, isr_stats.avg_exec_us, isr_stats.load_pct,
+                         isr_stats.rate_hz, isr_stats.idle ? "true" : "false", isr_stats.idle_pct,
+                         (unsigned long)isr_stats.resume_us);
+                publish_entity(node, ENT_ISR, payload);
+                node->last_isr_stats = isr_stats;
+            }
+
+            // 6. Telemetry - sent at the sense task's pace, not on every driver event
+            if (notification_value & NOTIFY_SOURCE_SENSE) {
+                sense_get_measurements(node->inverter, &meas);
+                if (meas.cycle_count != 0) {
+                    snprintf(payload, sizeof(payload), "%.2f", meas.current.rms);
+                    publish_entity(node, ENT_CURRENT_RMS, payload);
+                    snprintf(payload, sizeof(payload), "%.2f", meas.current.peak);
+                    publish_entity(node, ENT_CURRENT_PEAK, payload);
+                    snprintf(payload, sizeof(payload), "%.1f", meas.vbus.avg);
+                    publish_entity(node, ENT_VBUS, payload);
+                }
+            }
+
+            // 6b. Firmware update progress; same for every node, the update covers the board
+            if (notification_value & NOTIFY_SOURCE_OTA) {
+                static const char *const ota_states[] = { "idle", "ramping", "downloading", "done", "failed" };
+                ota_get_status(&ota);
+                snprintf(payload, sizeof(payload),
+                         "{\"state\":\"%s\",\"error\":\"%s\",\"bytes\":%lu,\"size\":%lu,"
+                         "\"max_isr_exec_us\":%.2f,\"max_isr_jitter_us\":%.2f}",
+                         ota_states[ota.state], esp_err_to_name(ota.error), ota.bytes, ota.image_size,
+                         ota.max_isr_exec_us, ota.max_isr_jitter_us);
+                publish_entity(node, ENT_OTA, payload);
+            }
+
+            // 7. Runtime statistics, on request or at the periodic diag rate
+            uint32_t diag_bit = BIT(spwm_get_instance_id(node->inverter));
+            if ((notification_value & NOTIFY_SOURCE_DIAG) && ((diag_once_mask | diag_periodic_mask) & diag_bit)) {
+                diag_once_mask &= ~diag_bit;
+                publish_diag(node);
+            }
         }
 
-        // 4. Diff & Publish - STATUS (ON/OFF)
-        if (current_state.running != last_state.running || force_update) {
-            const char* state_str = current_state.running ? "ON" : "OFF";
-            esp_mqtt_client_publish(mqtt_client, 
-                                    "home/inverter/" DEVICE_ID "/status/state", 
-                                    state_str, 0, 1, 1);
-            
-            last_state.running = current_state.running; // Update last known
-            ESP_LOGI(TAG, "MQTT: State updated to %s", state_str);
+        if (status_cache_collecting) {
+            status_cache_collecting = false;
+            status_cache_flush();
+        }
+
+        // Radio power save follows the inverters (wifi_init() starts with WIFI_PS_MODE)
+        bool any_running = false;
+        for (int n = 0; n < inverter_node_count; n++) any_running |= inverter_nodes[n].last_state.running;
+        if (any_running != wifi_ps_running) {
+            esp_wifi_set_ps(any_running ? WIFI_PS_MODE : WIFI_PS_IDLE_MODE);
+            wifi_ps_running = any_running;
+            ESP_LOGI(TAG, "WiFi power save: %s", any_running ? "off (running)" : "modem sleep (idle)");
         }
 
         // Throttle updates slightly to prevent WiFi congestion during fast ramping
@@ -390,9 +1683,19 @@ void mqtt_publish_task(void *pvParameters)
 }
 
 
-void mqtt_init(void)
+void mqtt_init(const spwm_handle_t *inverters, int count)
 {
-    esp_mqtt_client_config_t mqtt_cfg = {
+    for (int i = 0; i < count && inverter_node_count < SPWM_MAX_INSTANCES; i++) {
+        if (inverters[i] == NULL) continue;
+
+        mqtt_inverter_node_t *node = &inverter_nodes[inverter_node_count++];
+        node->inverter = inverters[i];
+        node->device_id = device_ids[spwm_get_instance_id(inverters[i])];
+        snprintf(node->control_prefix, sizeof(node->control_prefix), TOPIC_ROOT "%s/control/", node->device_id);
+        snprintf(node->status_prefix, sizeof(node->status_prefix), TOPIC_ROOT "%s/status/", node->device_id);
+    }
+
+    mqtt_cfg = (esp_mqtt_client_config_t){
         .broker.address.uri = MQTT_FULL_URI,
         .broker.address.port = MQTT_PORT,
 
@@ -406,11 +1709,31 @@ void mqtt_init(void)
         //.broker.verification.certificate_len = strlen(CACERTPEM),
         //#endif
         .broker.verification.skip_cert_common_name_check = true,
+
+        .outbox.limit = MQTT_OUTBOX_LIMIT_BYTES,
         
     };
 
+#ifdef CONFIG_MQTT_PROTOCOL_5
+    mqtt_cfg.session.protocol_ver = MQTT_PROTOCOL_V_5;
+    mqtt_v5 = true;
+#endif
+    mqtt_pub_lock = xSemaphoreCreateMutex();
+
     mqtt_client = esp_mqtt_client_init(&mqtt_cfg);
 
+    esp_timer_create_args_t diag_timer_args = {
+        .callback = diag_timer_cb,
+        .name = "mqtt_diag",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&diag_timer_args, &diag_timer));
+
+    esp_timer_create_args_t discovery_timer_args = {
+        .callback = discovery_timer_cb,
+        .name = "mqtt_disc",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&discovery_timer_args, &discovery_timer));
+
     /* The modern way to register events in ESP-IDF */
     esp_mqtt_client_register_event(mqtt_client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
     esp_mqtt_client_start(mqtt_client);
@@ -1,10 +1,12 @@
 #ifndef MQTT_H
 #define MQTT_H
 
+#include "driver.h"
+
 
 
 void wifi_init(void);
 void init_time_sync(void);
-void mqtt_init(void);
+void mqtt_init(const spwm_handle_t *inverters, int count);
 
 #endif
\ No newline at end of file
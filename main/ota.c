@@ -0,0 +1,334 @@
+/*
+ * Firmware update over local HTTP(S) without disturbing the SPWM output
+ *
+ * Flash writes disable the cache on both cores; only IRAM code and DRAM data keep running.
+ * The update is therefore refused unless the carrier ISR path is resident (driver check),
+ * the image is streamed through a fixed OTA_CHUNK_BYTES buffer, and the partition is erased
+ * sector by sector as it is written (OTA_WITH_SEQUENTIAL_WRITES) instead of in one long
+ * erase up front. The worst ISR execution time and jitter during the update are reported.
+ *
+ * Anyone able to publish control/ota chooses the image, so the source is pinned in
+ * credentials.h: only hosts in OTA_ALLOWED_HOSTS are fetched from (no list, no OTA), redirects
+ * are not followed, and with OTA_CERT_PEM defined only https:// against that certificate.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_ota_ops.h"
+#include "esp_http_client.h"
+
+#include "ota.h"
+
+#include "credentials.h"
+//see the README.md
+
+
+#define OTA_TASK_PRIO           3       // below freq_task and mqtt_pub_task
+#define OTA_URL_LEN             128
+#define OTA_RAMP_TIMEOUT_MS     30000
+#define OTA_HTTP_TIMEOUT_MS     5000
+#define OTA_PROGRESS_BYTES      (64 * 1024)
+#define OTA_RESTART_DELAY_MS    1000    // lets the final status reach the broker
+
+#ifdef OTA_CERT_PEM
+#define OTA_URL_SCHEME          "https://"
+#else
+#define OTA_URL_SCHEME          "http://"
+#endif
+
+static const char *TAG = "OTA";
+
+
+typedef struct {
+    spwm_handle_t inverters[SPWM_MAX_INSTANCES];
+    int count;
+    int prev_target[SPWM_MAX_INSTANCES];
+    char url[OTA_URL_LEN];
+    int safe_freq_hz;
+} ota_job_t;
+
+static ota_job_t ota_job;
+static ota_status_t ota_status;
+static volatile bool ota_busy = false;
+static portMUX_TYPE ota_lock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t mqtt_task_handle = NULL;
+
+
+
+static void ota_set_state(ota_state_t state, esp_err_t error)
+{
+    taskENTER_CRITICAL(&ota_lock);
+    ota_status.state = state;
+    ota_status.error = error;
+    taskEXIT_CRITICAL(&ota_lock);
+
+    if (mqtt_task_handle) xTaskNotify(mqtt_task_handle, NOTIFY_SOURCE_OTA, eSetBits);
+}
+
+
+static void ota_update_isr_stats(void)
+{
+    spwm_isr_stats_t stats;
+    float exec = 0.f, jitter = 0.f;
+
+    for (int i = 0; i < ota_job.count; i++) {
+        spwm_get_isr_stats(ota_job.inverters[i], &stats, NULL);
+        if (stats.watch_max_exec_us > exec) exec = stats.watch_max_exec_us;
+        if (stats.watch_max_jitter_us > jitter) jitter = stats.watch_max_jitter_us;
+    }
+
+    taskENTER_CRITICAL(&ota_lock);
+    ota_status.max_isr_exec_us = exec;
+    ota_status.max_isr_jitter_us = jitter;
+    taskEXIT_CRITICAL(&ota_lock);
+}
+
+
+static esp_err_t ota_ramp_to_safe(void)
+{
+    spwm_runtime_state_t state;
+
+    for (int i = 0; i < ota_job.count; i++) {
+        spwm_get_state(ota_job.inverters[i], &state);
+        ota_job.prev_target[i] = state.running ? state.target_frequency : 0;
+        if (state.running) spwm_set_target_frequency(ota_job.inverters[i], ota_job.safe_freq_hz);
+    }
+
+    TickType_t start = xTaskGetTickCount();
+    while (xTaskGetTickCount() - start < pdMS_TO_TICKS(OTA_RAMP_TIMEOUT_MS)) {
+        bool settled = true;
+        for (int i = 0; i < ota_job.count; i++) {
+            spwm_get_state(ota_job.inverters[i], &state);
+            if (state.running && state.current_frequency != state.target_frequency) settled = false;
+        }
+        if (settled) return ESP_OK;
+        vTaskDelay(pdMS_TO_TICKS(100));
+    }
+    return ESP_ERR_TIMEOUT;
+}
+
+
+static void ota_restore_targets(void)
+{
+    for (int i = 0; i < ota_job.count; i++) {
+        if (ota_job.prev_target[i] > 0) spwm_set_target_frequency(ota_job.inverters[i], ota_job.prev_target[i]);
+    }
+}
+
+
+static esp_err_t ota_download(void)
+{
+    static char chunk[OTA_CHUNK_BYTES];
+    esp_ota_handle_t ota_handle = 0;
+    esp_err_t err;
+
+    const esp_partition_t *partition = esp_ota_get_next_update_partition(NULL);
+    if (partition == NULL) {
+        ESP_LOGE(TAG, "No OTA partition (see partitions.csv)");
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    esp_http_client_config_t http_cfg = {
+        .url = ota_job.url,
+        .timeout_ms = OTA_HTTP_TIMEOUT_MS,
+        .buffer_size = OTA_CHUNK_BYTES,
+        .disable_auto_redirect = true,  // a redirect would leave the allow-list
+#ifdef OTA_CERT_PEM
+        .cert_pem = OTA_CERT_PEM,
+#endif
+    };
+    esp_http_client_handle_t client = esp_http_client_init(&http_cfg);
+    if (client == NULL) return ESP_ERR_NO_MEM;
+
+    err = esp_http_client_open(client, 0);
+    if (err != ESP_OK) goto cleanup;
+
+    int64_t content_length = esp_http_client_fetch_headers(client);
+    if (esp_http_client_get_status_code(client) != 200) {
+        ESP_LOGE(TAG, "HTTP status %d", esp_http_client_get_status_code(client));
+        err = ESP_ERR_INVALID_RESPONSE;
+        goto close;
+    }
+    taskENTER_CRITICAL(&ota_lock);
+    ota_status.image_size = content_length > 0 ? (uint32_t)content_length : 0;
+    taskEXIT_CRITICAL(&ota_lock);
+
+    err = esp_ota_begin(partition, OTA_WITH_SEQUENTIAL_WRITES, &ota_handle);
+    if (err != ESP_OK) goto close;
+
+    uint32_t next_progress = OTA_PROGRESS_BYTES;
+    while (1) {
+        int n = esp_http_client_read(client, chunk, sizeof(chunk));
+        if (n < 0) {
+            err = ESP_FAIL;
+            break;
+        }
+        if (n == 0) {
+            err = esp_http_client_is_complete_data_received(client) ? ESP_OK : ESP_ERR_INVALID_SIZE;
+            break;
+        }
+
+        err = esp_ota_write(ota_handle, chunk, n);
+        if (err != ESP_OK) break;
+
+        taskENTER_CRITICAL(&ota_lock);
+        ota_status.bytes += n;
+        uint32_t bytes = ota_status.bytes;
+        taskEXIT_CRITICAL(&ota_lock);
+        if (bytes >= next_progress) {
+            next_progress += OTA_PROGRESS_BYTES;
+            ota_update_isr_stats();
+            if (mqtt_task_handle) xTaskNotify(mqtt_task_handle, NOTIFY_SOURCE_OTA, eSetBits);
+        }
+    }
+
+    if (err == ESP_OK) {
+        err = esp_ota_end(ota_handle); // validates the image
+        if (err == ESP_OK) err = esp_ota_set_boot_partition(partition);
+    } else {
+        esp_ota_abort(ota_handle);
+    }
+
+close:
+    esp_http_client_close(client);
+cleanup:
+    esp_http_client_cleanup(client);
+    return err;
+}
+
+
+static void ota_task(void *pvParameters)
+{
+    esp_err_t err = ESP_OK;
+
+    // Worst case is measured from here on, apart from the status/isr maxima
+    for (int i = 0; i < ota_job.count; i++) spwm_isr_watch_start(ota_job.inverters[i]);
+
+    if (ota_job.safe_freq_hz > 0) {
+        ota_set_state(OTA_STATE_RAMPING, ESP_OK);
+        err = ota_ramp_to_safe();
+        if (err != ESP_OK) ESP_LOGW(TAG, "Safe setpoint not reached, updating anyway");
+    }
+
+    ota_set_state(OTA_STATE_DOWNLOADING, ESP_OK);
+    ESP_LOGI(TAG, "Downloading %s", ota_job.url);
+    err = ota_download();
+    ota_update_isr_stats();
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Update failed after %lu bytes: %s", ota_status.bytes, esp_err_to_name(err));
+        ota_restore_targets();
+        ota_set_state(OTA_STATE_FAILED, err);
+        ota_busy = false;
+        vTaskDelete(NULL);
+        return;
+    }
+
+    ESP_LOGI(TAG, "Update done, %lu bytes, worst ISR exec %.2f us, jitter %.2f us",
+             ota_status.bytes, ota_status.max_isr_exec_us, ota_status.max_isr_jitter_us);
+    ota_set_state(OTA_STATE_DONE, ESP_OK);
+
+    // Never reset with the bridge switching
+    for (int i = 0; i < ota_job.count; i++) spwm_stop(ota_job.inverters[i]);
+    vTaskDelay(pdMS_TO_TICKS(OTA_RESTART_DELAY_MS));
+    esp_restart();
+}
+
+
+
+// Scheme and host of `url` against the build-time policy; no user info, host names compared exactly
+static esp_err_t ota_check_url(const char *url)
+{
+#ifndef OTA_ALLOWED_HOSTS
+    ESP_LOGE(TAG, "No OTA_ALLOWED_HOSTS in credentials.h, OTA disabled");
+    return ESP_ERR_NOT_SUPPORTED;
+#else
+    const size_t scheme_len = strlen(OTA_URL_SCHEME);
+    if (strncmp(url, OTA_URL_SCHEME, scheme_len) != 0 || strlen(url) >= OTA_URL_LEN) {
+        ESP_LOGE(TAG, "Only " OTA_URL_SCHEME " URLs up to %d chars are accepted", OTA_URL_LEN - 1);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    const char *host = url + scheme_len;
+    size_t host_len = strcspn(host, ":/?#@");
+    if (host_len == 0 || host[host_len] == '@') {
+        ESP_LOGE(TAG, "Malformed OTA URL");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // OTA_ALLOWED_HOSTS: comma separated, e.g. "192.168.1.10,nas.lan"
+    const char *entry = OTA_ALLOWED_HOSTS;
+    while (*entry) {
+        size_t entry_len = strcspn(entry, ",");
+        if (entry_len == host_len && strncasecmp(entry, host, host_len) == 0) return ESP_OK;
+        entry += entry_len;
+        if (*entry == ',') entry++;
+    }
+
+    ESP_LOGE(TAG, "OTA host %.*s is not in OTA_ALLOWED_HOSTS", (int)host_len, host);
+    return ESP_ERR_NOT_ALLOWED;
+#endif
+}
+
+
+
+esp_err_t ota_start(const spwm_handle_t *inverters, int count, const char *url, int safe_freq_hz)
+{
+    esp_err_t err = ota_check_url(url);
+    if (err != ESP_OK) return err;
+    if (count > SPWM_MAX_INSTANCES) count = SPWM_MAX_INSTANCES;
+
+    taskENTER_CRITICAL(&ota_lock);
+    bool busy = ota_busy;
+    ota_busy = true;
+    taskEXIT_CRITICAL(&ota_lock);
+    if (busy) return ESP_ERR_INVALID_STATE;
+
+    for (int i = 0; i < count; i++) {
+        if (spwm_check_isr_residency(inverters[i]) != ESP_OK) {
+            ESP_LOGE(TAG, "Update refused: inverter output would stall during flash writes");
+            ota_busy = false;
+            return ESP_ERR_NOT_SUPPORTED;
+        }
+    }
+
+    memcpy(ota_job.inverters, inverters, count * sizeof(spwm_handle_t));
+    ota_job.count = count;
+    ota_job.safe_freq_hz = safe_freq_hz;
+    snprintf(ota_job.url, sizeof(ota_job.url), "%s", url);
+    memset(&ota_status, 0, sizeof(ota_status));
+
+    if (xTaskCreatePinnedToCore(ota_task, "ota_task", 4096, NULL, OTA_TASK_PRIO, NULL, 0) != pdPASS) {
+        ota_busy = false;
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+
+void ota_register_mqtt(TaskHandle_t handle)
+{
+    mqtt_task_handle = handle;
+}
+
+
+void ota_get_status(ota_status_t *out)
+{
+    taskENTER_CRITICAL(&ota_lock);
+    *out = ota_status;
+    taskEXIT_CRITICAL(&ota_lock);
+}
+
+
+void ota_mark_running_valid(void)
+{
+    esp_ota_img_states_t state;
+    if (esp_ota_get_state_partition(esp_ota_get_running_partition(), &state) == ESP_OK &&
+        state == ESP_OTA_IMG_PENDING_VERIFY) {
+        esp_ota_mark_app_valid_cancel_rollback();
+        ESP_LOGI(TAG, "New firmware confirmed, rollback cancelled");
+    }
+}
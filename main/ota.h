@@ -0,0 +1,52 @@
+#ifndef OTA_H
+#define OTA_H
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "driver.h"
+
+
+#define NOTIFY_SOURCE_OTA       BIT4    // progress / result, see ota_get_status()
+
+#define OTA_CHUNK_BYTES         1024    // RAM bound of the download path (plus esp_http_client's own buffer)
+
+
+typedef enum {
+    OTA_STATE_IDLE = 0,
+    OTA_STATE_RAMPING,      // moving the inverters to the safe setpoint
+    OTA_STATE_DOWNLOADING,
+    OTA_STATE_DONE,         // image verified and selected, restart follows
+    OTA_STATE_FAILED,
+} ota_state_t;
+
+typedef struct {
+    ota_state_t state;
+    esp_err_t error;
+    uint32_t bytes;
+    uint32_t image_size;        // from Content-Length, 0 when unknown
+    float max_isr_exec_us;      // worst carrier ISR over all inverters since the update started
+    float max_isr_jitter_us;
+} ota_status_t;
+
+/**
+ * @brief Update from an HTTP(S) URL on the local network, in a background task.
+ * Refused unless the URL passes the credentials.h policy (host in OTA_ALLOWED_HOSTS,
+ * https:// when OTA_CERT_PEM is pinned) and every inverter's ISR path passes
+ * spwm_check_isr_residency(). With
+ * `safe_freq_hz` > 0 running inverters are ramped there first; a failed update restores
+ * their previous targets. On success the inverters are stopped and the board restarts.
+ */
+esp_err_t ota_start(const spwm_handle_t *inverters, int count, const char *url, int safe_freq_hz);
+
+void ota_register_mqtt(TaskHandle_t handle);
+void ota_get_status(ota_status_t *out);
+
+/**
+ * @brief Confirm a freshly updated image once the network is up, cancelling the rollback
+ */
+void ota_mark_running_valid(void);
+
+#endif
@@ -0,0 +1,58 @@
+/*
+ * Phase alignment controller (see phase_sync.h)
+ *
+ * Phase-locked loop with a frequency actuator: the trim sets how much every cycle is
+ * lengthened until the next update, so a proportional term on phase removes PHASE_SYNC_KP
+ * of the error per update and the integral absorbs the local clock error. The known slip
+ * of an untrimmed cycle (sample count rounding) is fed forward.
+ */
+
+#include <math.h>
+
+#include "phase_sync.h"
+
+
+
+void phase_sync_reset(phase_sync_t *ps)
+{
+    *ps = (phase_sync_t){ 0 };
+}
+
+
+float phase_sync_error_us(int64_t cycle_start_wall_us, int freq_hz)
+{
+    // t * f / 1e6 cycles since the epoch; its fractional part is the phase
+    int64_t frac = (cycle_start_wall_us * freq_hz) % 1000000;
+    if (frac < 0) frac += 1000000;
+    if (frac >= 500000) frac -= 1000000;
+    return (float)frac / freq_hz;
+}
+
+
+int32_t phase_sync_update(phase_sync_t *ps, int64_t cycle_start_wall_us, int freq_hz, float cycle_us,
+                          uint32_t cycles, float us_per_step, int32_t max_steps)
+{
+    float e = phase_sync_error_us(cycle_start_wall_us, freq_hz);
+    float n = cycles > 0 ? (float)cycles : 1.0f;
+    float feed_forward = 1e6f / freq_hz - cycle_us;
+
+    float slip = feed_forward + ps->integral_us - PHASE_SYNC_KP * e / n;
+    int32_t steps = (int32_t)lroundf(slip / us_per_step);
+
+    bool saturated = true;
+    if (steps > max_steps) {
+        steps = max_steps;
+    } else if (steps < -max_steps) {
+        steps = -max_steps;
+    } else {
+        saturated = false;
+    }
+    if (!saturated) ps->integral_us -= PHASE_SYNC_KI * e / n; // no windup during pull-in
+
+    ps->error_us = e;
+    ps->locked = fabsf(e) < PHASE_SYNC_LOCK_US;
+    if (ps->locked && fabsf(e) > ps->max_abs_error_us) ps->max_abs_error_us = fabsf(e);
+    ps->trim_steps = steps;
+    ps->updates++;
+    return steps;
+}
@@ -0,0 +1,50 @@
+#ifndef PHASE_SYNC_H
+#define PHASE_SYNC_H
+
+/*
+ * Phase alignment of the fundamental to a wall-clock epoch
+ *
+ * Each unit places the start of its output cycle (sample index 0) on whole multiples of the
+ * period counted from the Unix epoch, so inverters with SNTP time run in phase with no link
+ * between them. The controller gets one cycle-start timestamp per update and returns a
+ * per-cycle period trim. It has no hardware or RTOS dependency, so it also runs in
+ * tools/phase_sync_sim.c against simulated instances and a fake clock.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+#define PHASE_SYNC_KP           0.5f    // share of the phase error removed per update
+#define PHASE_SYNC_KI           0.05f   // integral gain; the integral settles on the clock error
+#define PHASE_SYNC_LOCK_US      20.0f   // |error| below this counts as locked
+
+typedef struct {
+    float integral_us;          // slip per cycle that cancels the local clock error
+    float error_us;             // last measured error, positive = cycle starts late
+    float max_abs_error_us;     // worst |error| while locked
+    int32_t trim_steps;         // last output
+    uint32_t updates;
+    bool locked;
+} phase_sync_t;
+
+void phase_sync_reset(phase_sync_t *ps);
+
+/**
+ * @brief Error of a cycle start against the epoch grid of freq_hz: wall time modulo the
+ * period, wrapped to +-half a period. Exact integer arithmetic for integer frequencies.
+ */
+float phase_sync_error_us(int64_t cycle_start_wall_us, int freq_hz);
+
+/**
+ * @param cycle_start_wall_us wall-clock time of the latest cycle start
+ * @param cycle_us     untrimmed length of one output cycle (samples / sample rate)
+ * @param cycles       cycles since the previous update, i.e. how long the last trim acted
+ * @param us_per_step  cycle lengthening per trim step
+ * @param max_steps    output limit per cycle
+ * @return trim steps per cycle until the next update; positive lengthens the cycle
+ */
+int32_t phase_sync_update(phase_sync_t *ps, int64_t cycle_start_wall_us, int freq_hz, float cycle_us,
+                          uint32_t cycles, float us_per_step, int32_t max_steps);
+
+#endif
@@ -0,0 +1,186 @@
+/*
+ * Current / DC-bus measurement pipeline
+ *
+ * Samples arrive in DMA frames (sense_backend_*), so the processing task wakes once per
+ * frame, never per sample. Running sums are cut into fundamental cycles (sense_cycle.c)
+ * using the driver's samples-per-cycle. The ADC pattern rate matches the carrier (one
+ * conversion per channel per carrier period) but runs from its own timer, so the cut is
+ * accurate to the rate tolerance and the sampling point drifts within the carrier period.
+ * The current samples therefore see the switching ripple at every phase: current peak and
+ * rms include it (aliased), they are not the fundamental alone.
+ */
+
+#include <string.h>
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "sense.h"
+#include "sense_backend.h"
+
+
+// ----------------------------------------------------------------------------------
+// CONFIGURATION
+// ----------------------------------------------------------------------------------
+// ADC1 channels per inverter instance (GPIO34..39 are input-only, free for sensing)
+#define SENSE_CURRENT_CH        6   // GPIO34
+#define SENSE_VBUS_CH           7   // GPIO35
+#define SENSE_B_CURRENT_CH      0   // GPIO36
+#define SENSE_B_VBUS_CH         3   // GPIO39
+
+#define SENSE_VBUS_COMPENSATION 0        // feed the filtered bus voltage into the driver gain register; enable once the divider is calibrated
+
+#define SENSE_TASK_PRIO         2        // below freq_task and mqtt_pub_task
+#define SENSE_READ_CHUNK        256
+#define SENSE_IDLE_POLL_MS      100      // state poll while acquisition is paused (every inverter off)
+
+static const char *TAG = "SENSE";
+
+
+typedef struct {
+    spwm_handle_t inverter;
+    uint8_t channel[SENSE_QTY_COUNT];
+
+    sense_cycle_t cycle;  // window refreshed once per frame
+
+    sense_measurements_t latest;
+} sense_node_t;
+
+static const uint8_t sense_channels[SPWM_MAX_INSTANCES][SENSE_QTY_COUNT] = {
+    { SENSE_CURRENT_CH,   SENSE_VBUS_CH },
+    { SENSE_B_CURRENT_CH, SENSE_B_VBUS_CH },
+};
+
+static sense_node_t sense_nodes[SPWM_MAX_INSTANCES];
+static int sense_node_count = 0;
+
+// ADC channel -> (node, quantity), 0xFF when unused
+static uint8_t channel_node[SOC_ADC_MAX_CHANNEL_NUM];
+static uint8_t channel_qty[SOC_ADC_MAX_CHANNEL_NUM];
+
+static portMUX_TYPE sense_lock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t mqtt_task_handle = NULL;
+
+
+
+static void sense_finish_cycle(sense_node_t *node, const sense_stats_t *stats)
+{
+    taskENTER_CRITICAL(&sense_lock);
+    node->latest.current = stats[SENSE_QTY_CURRENT];
+    node->latest.vbus = stats[SENSE_QTY_VBUS];
+    node->latest.cycle_count++;
+    taskEXIT_CRITICAL(&sense_lock);
+}
+
+
+static void sense_task(void *pvParameters)
+{
+    static sense_sample_t samples[SENSE_READ_CHUNK];
+    spwm_runtime_state_t state;
+    sense_stats_t stats[SENSE_QTY_COUNT];
+    TickType_t last_publish = xTaskGetTickCount();
+    bool paused = false;
+
+    while (1) {
+        bool any_running = false;
+        for (int i = 0; i < sense_node_count; i++) {
+            spwm_get_state(sense_nodes[i].inverter, &state);
+            sense_nodes[i].cycle.window = state.samples_per_cycle > 0 ? state.samples_per_cycle
+                                                                      : (int)(CARRIER_FREQ_HZ / DEFAULT_FREQ_HZ);
+            any_running |= state.running;
+        }
+
+        // Nothing to measure with every bridge off; the last cycle stays in sense_get_measurements()
+        if (any_running == paused) {
+            paused = !any_running;
+            if (sense_backend_pause(paused) != ESP_OK) ESP_LOGW(TAG, "Acquisition %s failed", paused ? "pause" : "resume");
+            for (int i = 0; i < sense_node_count; i++) sense_cycle_reset(&sense_nodes[i].cycle);
+        }
+        if (paused) {
+            vTaskDelay(pdMS_TO_TICKS(SENSE_IDLE_POLL_MS));
+            continue;
+        }
+
+        int n = sense_backend_read(samples, SENSE_READ_CHUNK, pdMS_TO_TICKS(100));
+
+        for (int i = 0; i < n; i++) {
+            uint8_t ch = samples[i].channel;
+            if (ch >= SOC_ADC_MAX_CHANNEL_NUM || channel_node[ch] == 0xFF) continue;
+
+            sense_node_t *node = &sense_nodes[channel_node[ch]];
+            sense_qty_t qty = channel_qty[ch];
+            int mv = sense_backend_raw_to_mv(ch, samples[i].raw);
+
+            if (sense_cycle_add(&node->cycle, qty, mv, stats)) sense_finish_cycle(node, stats);
+        }
+
+#if SENSE_VBUS_COMPENSATION
+        // Once per frame: the gain register tracks sag and ripple without touching the LUT
+        for (int i = 0; i < sense_node_count; i++) {
+            spwm_set_bus_voltage(sense_nodes[i].inverter, sense_nodes[i].cycle.vbus_filtered);
+        }
+#endif
+
+        if (mqtt_task_handle && xTaskGetTickCount() - last_publish >= pdMS_TO_TICKS(SENSE_PUBLISH_PERIOD_MS)) {
+            last_publish = xTaskGetTickCount();
+            xTaskNotify(mqtt_task_handle, NOTIFY_SOURCE_SENSE, eSetBits);
+        }
+    }
+}
+
+
+
+esp_err_t sense_init(const spwm_handle_t *inverters, int count)
+{
+    uint8_t channels[SPWM_MAX_INSTANCES * SENSE_QTY_COUNT];
+    int channel_count = 0;
+
+    memset(channel_node, 0xFF, sizeof(channel_node));
+
+    for (int i = 0; i < count && sense_node_count < SPWM_MAX_INSTANCES; i++) {
+        if (inverters[i] == NULL) continue;
+
+        int id = spwm_get_instance_id(inverters[i]);
+        sense_node_t *node = &sense_nodes[sense_node_count];
+        node->inverter = inverters[i];
+
+        for (int q = 0; q < SENSE_QTY_COUNT; q++) {
+            uint8_t ch = sense_channels[id][q];
+            node->channel[q] = ch;
+            channel_node[ch] = sense_node_count;
+            channel_qty[ch] = q;
+            channels[channel_count++] = ch;
+        }
+        sense_node_count++;
+    }
+
+    // One conversion per channel per carrier period
+    esp_err_t err = sense_backend_start(channels, channel_count, CARRIER_FREQ_HZ * channel_count);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Sampling backend failed: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    xTaskCreatePinnedToCore(sense_task, "sense_task", 4096, NULL, SENSE_TASK_PRIO, NULL, 0);
+    return ESP_OK;
+}
+
+
+void sense_register_mqtt(TaskHandle_t handle)
+{
+    mqtt_task_handle = handle;
+}
+
+
+void sense_get_measurements(spwm_handle_t inv, sense_measurements_t *out)
+{
+    for (int i = 0; i < sense_node_count; i++) {
+        if (sense_nodes[i].inverter != inv) continue;
+
+        taskENTER_CRITICAL(&sense_lock);
+        *out = sense_nodes[i].latest;
+        taskEXIT_CRITICAL(&sense_lock);
+        return;
+    }
+    memset(out, 0, sizeof(*out));
+}
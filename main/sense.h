@@ -0,0 +1,33 @@
+#ifndef SENSE_H
+#define SENSE_H
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "driver.h"
+#include "sense_cycle.h"
+
+
+#define NOTIFY_SOURCE_SENSE     BIT2 //MQTT transmit task: fresh telemetry available
+
+#define SENSE_PUBLISH_PERIOD_MS 1000 //telemetry rate towards MQTT; the API always holds the last cycle
+
+
+typedef struct
+{
+    sense_stats_t current;  // A, load current of leg 1; peak and rms include aliased switching ripple
+    sense_stats_t vbus;     // V, DC bus
+    uint32_t cycle_count;   // completed cycles since boot, 0 = nothing measured yet
+} sense_measurements_t;
+
+
+/**
+ * @brief Start sampling current and DC-bus voltage of every inverter.
+ * One sample per channel per carrier period; statistics are cut at fundamental cycle boundaries.
+ */
+esp_err_t sense_init(const spwm_handle_t *inverters, int count);
+
+void sense_register_mqtt(TaskHandle_t handle);
+void sense_get_measurements(spwm_handle_t inv, sense_measurements_t *out);
+
+
+#endif
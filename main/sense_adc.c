@@ -0,0 +1,116 @@
+/*
+ * ADC continuous (DMA) backend for sense.c
+ *
+ * The ESP32 digital ADC controller is clocked by its own pattern timer; it cannot be
+ * triggered from an MCPWM event. The pattern rate is therefore set to match the carrier
+ * (one conversion per channel per carrier period); it is not locked to it, so the sampling
+ * point drifts in phase against the carrier instead of sitting at mid-period.
+ */
+
+#include <string.h>
+#include "esp_log.h"
+#include "esp_adc/adc_continuous.h"
+#include "esp_adc/adc_cali.h"
+#include "esp_adc/adc_cali_scheme.h"
+
+#include "sense_backend.h"
+
+
+#define SENSE_ADC_ATTEN         ADC_ATTEN_DB_12
+#define SENSE_FRAME_SAMPLES     40   // samples per DMA frame; one task wakeup per frame (1 ms with 2 channels)
+#define SENSE_FRAME_BYTES       (SENSE_FRAME_SAMPLES * SOC_ADC_DIGI_RESULT_BYTES)
+
+static const char *TAG = "SENSE_ADC";
+
+static adc_continuous_handle_t adc_handle = NULL;
+static adc_cali_handle_t cali_handle = NULL;
+static uint8_t frame_buf[SENSE_FRAME_BYTES];
+static bool adc_paused = false;
+
+
+
+esp_err_t sense_backend_start(const uint8_t *channels, int channel_count, uint32_t sample_freq_hz)
+{
+    if (channel_count <= 0 || channel_count > SOC_ADC_PATT_LEN_MAX) return ESP_ERR_INVALID_ARG;
+    if (sample_freq_hz < SOC_ADC_SAMPLE_FREQ_THRES_LOW || sample_freq_hz > SOC_ADC_SAMPLE_FREQ_THRES_HIGH) {
+        ESP_LOGE(TAG, "Sample rate %lu Hz out of ADC range", sample_freq_hz);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    adc_continuous_handle_cfg_t handle_cfg = {
+        .max_store_buf_size = SENSE_FRAME_BYTES * 4,
+        .conv_frame_size = SENSE_FRAME_BYTES,
+    };
+    ESP_ERROR_CHECK(adc_continuous_new_handle(&handle_cfg, &adc_handle));
+
+    adc_digi_pattern_config_t pattern[SOC_ADC_PATT_LEN_MAX] = {0};
+    for (int i = 0; i < channel_count; i++) {
+        pattern[i].atten = SENSE_ADC_ATTEN;
+        pattern[i].channel = channels[i];
+        pattern[i].unit = ADC_UNIT_1;   // ADC2 is unusable while Wi-Fi is up
+        pattern[i].bit_width = SOC_ADC_DIGI_MAX_BITWIDTH;
+    }
+
+    adc_continuous_config_t dig_cfg = {
+        .pattern_num = channel_count,
+        .adc_pattern = pattern,
+        .sample_freq_hz = sample_freq_hz,
+        .conv_mode = ADC_CONV_SINGLE_UNIT_1,
+        .format = ADC_DIGI_OUTPUT_FORMAT_TYPE1,
+    };
+    ESP_ERROR_CHECK(adc_continuous_config(adc_handle, &dig_cfg));
+
+    adc_cali_line_fitting_config_t cali_cfg = {
+        .unit_id = ADC_UNIT_1,
+        .atten = SENSE_ADC_ATTEN,
+        .bitwidth = ADC_BITWIDTH_DEFAULT,
+    };
+    if (adc_cali_create_scheme_line_fitting(&cali_cfg, &cali_handle) != ESP_OK) {
+        ESP_LOGW(TAG, "No eFuse calibration, using nominal scale");
+        cali_handle = NULL;
+    }
+
+    ESP_LOGI(TAG, "ADC DMA: %d channels at %lu Hz, %d samples/frame", channel_count, sample_freq_hz, SENSE_FRAME_SAMPLES);
+    return adc_continuous_start(adc_handle);
+}
+
+
+int sense_backend_read(sense_sample_t *out, int max_samples, TickType_t timeout)
+{
+    uint32_t len = 0;
+    uint32_t want = max_samples * SOC_ADC_DIGI_RESULT_BYTES;
+    if (want > sizeof(frame_buf)) want = sizeof(frame_buf);
+
+    if (adc_continuous_read(adc_handle, frame_buf, want, &len, pdTICKS_TO_MS(timeout)) != ESP_OK) return 0;
+
+    int n = 0;
+    for (uint32_t i = 0; i + SOC_ADC_DIGI_RESULT_BYTES <= len; i += SOC_ADC_DIGI_RESULT_BYTES) {
+        const adc_digi_output_data_t *p = (const adc_digi_output_data_t *)&frame_buf[i];
+        out[n].channel = p->type1.channel;
+        out[n].raw = p->type1.data;
+        n++;
+    }
+    return n;
+}
+
+
+int sense_backend_raw_to_mv(uint8_t channel, int raw)
+{
+    int mv = 0;
+    if (cali_handle && adc_cali_raw_to_voltage(cali_handle, raw, &mv) == ESP_OK) return mv;
+    return raw * 3100 / 4095; // nominal full scale at 12 dB
+}
+
+
+esp_err_t sense_backend_pause(bool pause)
+{
+    if (adc_handle == NULL || pause == adc_paused) return ESP_OK;
+
+    esp_err_t err = pause ? adc_continuous_stop(adc_handle) : adc_continuous_start(adc_handle);
+    if (err != ESP_OK) return err;
+    if (pause) adc_continuous_flush_pool(adc_handle);
+
+    adc_paused = pause;
+    ESP_LOGI(TAG, "ADC DMA %s", pause ? "paused" : "resumed");
+    return ESP_OK;
+}
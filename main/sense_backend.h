@@ -0,0 +1,37 @@
+#ifndef SENSE_BACKEND_H
+#define SENSE_BACKEND_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+/*
+ * Sample source for sense.c: ADC1 streamed through DMA (sense_adc.c). Recorded streams are
+ * replayed on the host by tools/sense_replay.c against sense_cycle.c instead.
+ */
+
+typedef struct
+{
+    uint8_t channel;  // ADC1 channel number
+    uint16_t raw;
+} sense_sample_t;
+
+
+esp_err_t sense_backend_start(const uint8_t *channels, int channel_count, uint32_t sample_freq_hz);
+
+/**
+ * @brief Block until a DMA frame is available, then copy it out.
+ * @return number of samples written to `out`, 0 on timeout
+ */
+int sense_backend_read(sense_sample_t *out, int max_samples, TickType_t timeout);
+
+int sense_backend_raw_to_mv(uint8_t channel, int raw);
+
+/**
+ * @brief Stop / restart acquisition while no inverter is running. The running ADC holds a
+ * power management lock (no DFS, no light sleep). Samples queued before the pause are dropped.
+ */
+esp_err_t sense_backend_pause(bool pause);
+
+#endif
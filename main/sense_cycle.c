@@ -0,0 +1,63 @@
+/*
+ * Per-cycle statistics of the sense pipeline (see sense_cycle.h)
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "sense_cycle.h"
+
+
+
+float sense_to_unit(sense_qty_t qty, int mv)
+{
+    if (qty == SENSE_QTY_CURRENT) return ((float)mv - SENSE_CURRENT_ZERO_MV) / SENSE_CURRENT_MV_PER_A;
+    return (float)mv * SENSE_VBUS_V_PER_MV;
+}
+
+
+bool sense_cycle_add(sense_cycle_t *c, sense_qty_t qty, int mv, sense_stats_t out[SENSE_QTY_COUNT])
+{
+    sense_acc_t *acc = &c->acc[qty];
+    if (mv >= SENSE_ADC_CLIP_MV) {
+        acc->clipped++;
+    } else {
+        float v = sense_to_unit(qty, mv);
+        acc->sum += v;
+        acc->sum_sq += v * v;
+        if (fabsf(v) > acc->peak) acc->peak = fabsf(v);
+        acc->n++;
+
+        if (qty == SENSE_QTY_VBUS) {
+            c->vbus_filtered += (v - c->vbus_filtered) / (1 << SENSE_VBUS_FILTER_SHIFT);
+        }
+    }
+
+    // The current channel paces the cycle; vbus comes right behind it in the pattern
+    if (qty != SENSE_QTY_CURRENT) return false;
+    if (++c->acc_samples < c->window) return false;
+
+    for (int q = 0; q < SENSE_QTY_COUNT; q++) {
+        acc = &c->acc[q];
+        out[q].clipped = acc->clipped;
+        if (acc->n == 0 && acc->clipped > 0) {
+            float limit = fabsf(sense_to_unit(q, SENSE_ADC_CLIP_MV));
+            out[q].avg = out[q].rms = out[q].peak = limit;
+        } else {
+            int n = acc->n > 0 ? acc->n : 1;
+            out[q].avg = acc->sum / n;
+            out[q].rms = sqrtf(acc->sum_sq / n);
+            out[q].peak = acc->peak;
+        }
+        memset(acc, 0, sizeof(*acc));
+    }
+    c->acc_samples = 0;
+    return true;
+}
+
+
+void sense_cycle_reset(sense_cycle_t *c)
+{
+    memset(c->acc, 0, sizeof(c->acc));
+    c->acc_samples = 0;
+}
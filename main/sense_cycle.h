@@ -0,0 +1,75 @@
+#ifndef SENSE_CYCLE_H
+#define SENSE_CYCLE_H
+
+/*
+ * Per-cycle statistics of the sense pipeline (sense.c)
+ *
+ * Running sums of every quantity are cut into fundamental cycles; the current channel paces
+ * the cut. No hardware or RTOS dependency; tools/sense_replay.c runs exactly this code on a
+ * recorded sample stream on the host.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+// Sensor scaling
+#define SENSE_CURRENT_ZERO_MV   1650.0f  // hall sensor output at 0 A
+#define SENSE_CURRENT_MV_PER_A  100.0f
+#define SENSE_VBUS_V_PER_MV     0.15f    // divider: 450 V bus -> 3.0 V at the pin, headroom above the 325 V nominal
+
+// At 12 dB the ADC saturates near 3100 mV; samples from here on are clipped and left out
+#define SENSE_ADC_CLIP_MV       3050
+
+#define SENSE_VBUS_FILTER_SHIFT 2        // 1st order IIR, alpha = 1/4 (~0.2 ms at the carrier rate)
+
+
+/**
+ * @brief Statistics of one quantity over the last complete fundamental cycle.
+ */
+typedef struct
+{
+    float rms;
+    float peak;   // largest absolute value
+    float avg;
+    uint32_t clipped;   // samples at the ADC limit, not part of rms / peak / avg
+} sense_stats_t;
+
+typedef enum {
+    SENSE_QTY_CURRENT = 0,
+    SENSE_QTY_VBUS,
+    SENSE_QTY_COUNT
+} sense_qty_t;
+
+typedef struct {
+    float sum;
+    float sum_sq;
+    float peak;
+    int n;      // the quantities are cut together but need not have the same count
+    int clipped;
+} sense_acc_t;
+
+typedef struct {
+    sense_acc_t acc[SENSE_QTY_COUNT];
+    int acc_samples;      // samples of the current quantity accumulated this cycle
+    int window;           // samples per fundamental cycle, set by the caller
+    float vbus_filtered;  // short-term bus voltage for ripple compensation
+} sense_cycle_t;
+
+
+float sense_to_unit(sense_qty_t qty, int mv);
+
+/**
+ * @brief Add one sample (pin voltage in mV). Clipped samples only count in `clipped` and
+ * stay out of the statistics and the bus filter; a cycle with nothing but clipped samples
+ * reports the clip level, a lower bound.
+ * @return true when it completed a cycle; `out` then holds that cycle's statistics
+ */
+bool sense_cycle_add(sense_cycle_t *c, sense_qty_t qty, int mv, sense_stats_t out[SENSE_QTY_COUNT]);
+
+/**
+ * @brief Drop the partial cycle (acquisition gap); window and filter state are kept.
+ */
+void sense_cycle_reset(sense_cycle_t *c);
+
+#endif
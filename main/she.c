@@ -0,0 +1,89 @@
+/*
+ * SHE slot tables (see she.h)
+ *
+ * Quarter-wave symmetric unipolar waveform: in each half cycle the output is zero until
+ * a1, active until a2, ... and mirrored about the quarter point. Leg 2 is high in the first
+ * half and low in the second, as in SPWM; leg 1 is high when the output is zero in the first
+ * half and when it is active in the second, i.e. leg1 = active XOR leg2.
+ */
+
+#include <stdbool.h>
+
+#include "she.h"
+#include "she_table.h"
+
+
+#define SHE_QUARTER             SHE_ANGLE_ONE
+#define SHE_EDGES               (2 * SHE_ANGLES + 2)  // per half cycle, both ends included
+
+
+void she_m_range(float *m_min, float *m_max)
+{
+    *m_min = SHE_TABLE_M_MIN;
+    *m_max = SHE_TABLE_M_MIN + (SHE_TABLE_LEN - 1) * SHE_TABLE_M_STEP;
+}
+
+
+// Linear interpolation between neighbouring rows (same solution family, see she_gen.py)
+static void she_angles(float m, uint32_t *angles)
+{
+    float pos = (m - SHE_TABLE_M_MIN) / SHE_TABLE_M_STEP;
+    if (pos < 0.0f) pos = 0.0f;
+    if (pos > SHE_TABLE_LEN - 1) pos = SHE_TABLE_LEN - 1;
+
+    int row = (int)pos;
+    if (row > SHE_TABLE_LEN - 2) row = SHE_TABLE_LEN > 1 ? SHE_TABLE_LEN - 2 : 0;
+    float frac = SHE_TABLE_LEN > 1 ? pos - row : 0.0f;
+
+    for (int k = 0; k < SHE_ANGLES; k++) {
+        float a0 = she_angle_table[row][k];
+        float a1 = she_angle_table[SHE_TABLE_LEN > 1 ? row + 1 : row][k];
+        angles[k] = (uint32_t)(a0 + (a1 - a0) * frac + 0.5f);
+    }
+}
+
+
+int she_build_cycle(float m, uint32_t cycle_ticks, uint32_t min_peak, uint32_t max_peak,
+                    she_slot_t *slots, int max_slots)
+{
+    uint32_t angles[SHE_ANGLES];
+    uint32_t edge[SHE_EDGES];
+    she_angles(m, angles);
+
+    // Half-cycle boundaries in quarter-cycle units: 0, a1 .. aN, 2Q - aN .. 2Q - a1, 2Q
+    edge[0] = 0;
+    for (int k = 0; k < SHE_ANGLES; k++) {
+        edge[1 + k] = angles[k];
+        edge[SHE_EDGES - 2 - k] = 2 * SHE_QUARTER - angles[k];
+    }
+    edge[SHE_EDGES - 1] = 2 * SHE_QUARTER;
+
+    // Positions in peaks (half ticks); a slot of peak p lasts 2p ticks
+    uint64_t cycle_peaks = (cycle_ticks + 1) / 2;
+    uint32_t prev = 0;
+    int count = 0;
+
+    for (int half = 0; half < 2; half++) {
+        bool leg2_high = half == 0;
+
+        for (int s = 0; s < SHE_EDGES - 1; s++) {
+            uint64_t q = (uint64_t)half * 2 * SHE_QUARTER + edge[s + 1];
+            uint32_t end = (uint32_t)((q * cycle_peaks + 2 * SHE_QUARTER) / (4 * SHE_QUARTER));
+            if (end < prev + min_peak) end = prev + min_peak;
+
+            uint32_t len = end - prev;
+            uint32_t parts = (len + max_peak - 1) / max_peak;
+            bool active = s & 1;
+            uint16_t level = (leg2_high ? SHE_LEG2_HIGH : 0) | (active != leg2_high ? SHE_LEG1_HIGH : 0);
+
+            for (uint32_t p = 0; p < parts; p++) {
+                if (count == max_slots) return -1;
+                slots[count].peak = len / parts + (p < len % parts ? 1 : 0);
+                slots[count].level = level;
+                count++;
+            }
+            prev = end;
+        }
+    }
+    return count;
+}
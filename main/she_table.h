@@ -0,0 +1,109 @@
+// Generated by tools/she_gen.py -n 5 --m-min 0.05 --m-max 1.15 --m-step 0.01, do not edit
+#ifndef SHE_TABLE_H
+#define SHE_TABLE_H
+
+#include <stdint.h>
+
+#define SHE_ANGLES          5      // per quarter cycle; harmonics 3 .. 9 eliminated
+#define SHE_TABLE_LEN       93
+#define SHE_TABLE_M_MIN     0.1000f  // modulation index (fundamental / DC bus) of row 0
+#define SHE_TABLE_M_STEP    0.0100f
+#define SHE_ANGLE_ONE       65536U  // angles in Q16 of a quarter cycle (90 deg)
+
+static const uint16_t she_angle_table[SHE_TABLE_LEN][SHE_ANGLES] = {
+    { 21287, 22378, 42732, 44624, 64443 },  // M 0.10
+    { 21230, 22430, 42635, 44716, 64333 },  // M 0.11
+    { 21173, 22482, 42537, 44808, 64223 },  // M 0.12
+    { 21116, 22533, 42439, 44900, 64114 },  // M 0.13
+    { 21058, 22583, 42341, 44991, 64004 },  // M 0.14
+    { 21000, 22634, 42243, 45082, 63894 },  // M 0.15
+    { 20942, 22684, 42144, 45173, 63784 },  // M 0.16
+    { 20884, 22734, 42045, 45263, 63674 },  // M 0.17
+    { 20826, 22783, 41946, 45354, 63563 },  // M 0.18
+    { 20767, 22833, 41846, 45444, 63453 },  // M 0.19
+    { 20708, 22881, 41746, 45534, 63342 },  // M 0.20
+    { 20649, 22930, 41646, 45623, 63232 },  // M 0.21
+    { 20590, 22978, 41545, 45712, 63121 },  // M 0.22
+    { 20531, 23026, 41444, 45801, 63010 },  // M 0.23
+    { 20471, 23073, 41343, 45890, 62898 },  // M 0.24
+    { 20412, 23120, 41242, 45979, 62787 },  // M 0.25
+    { 20352, 23166, 41140, 46067, 62675 },  // M 0.26
+    { 20292, 23212, 41037, 46155, 62564 },  // M 0.27
+    { 20231, 23258, 40935, 46242, 62452 },  // M 0.28
+    { 20171, 23303, 40832, 46330, 62339 },  // M 0.29
+    { 20110, 23348, 40729, 46417, 62227 },  // M 0.30
+    { 20049, 23392, 40625, 46503, 62114 },  // M 0.31
+    { 19988, 23436, 40521, 46590, 62001 },  // M 0.32
+    { 19927, 23479, 40416, 46676, 61888 },  // M 0.33
+    { 19866, 23522, 40311, 46762, 61774 },  // M 0.34
+    { 19805, 23564, 40206, 46847, 61661 },  // M 0.35
+    { 19743, 23606, 40100, 46932, 61546 },  // M 0.36
+    { 19681, 23647, 39994, 47017, 61432 },  // M 0.37
+    { 19619, 23688, 39887, 47101, 61317 },  // M 0.38
+    { 19557, 23728, 39780, 47185, 61202 },  // M 0.39
+    { 19495, 23767, 39672, 47269, 61086 },  // M 0.40
+    { 19432, 23806, 39564, 47352, 60970 },  // M 0.41
+    { 19369, 23845, 39456, 47435, 60854 },  // M 0.42
+    { 19307, 23882, 39347, 47517, 60737 },  // M 0.43
+    { 19244, 23919, 39237, 47599, 60620 },  // M 0.44
+    { 19180, 23956, 39127, 47680, 60502 },  // M 0.45
+    { 19117, 23991, 39016, 47761, 60384 },  // M 0.46
+    { 19053, 24026, 38905, 47841, 60265 },  // M 0.47
+    { 18990, 24061, 38793, 47921, 60145 },  // M 0.48
+    { 18926, 24094, 38681, 48000, 60025 },  // M 0.49
+    { 18862, 24127, 38568, 48079, 59905 },  // M 0.50
+    { 18797, 24159, 38454, 48157, 59783 },  // M 0.51
+    { 18733, 24190, 38340, 48235, 59662 },  // M 0.52
+    { 18668, 24220, 38224, 48311, 59539 },  // M 0.53
+    { 18603, 24250, 38109, 48387, 59415 },  // M 0.54
+    { 18538, 24278, 37992, 48463, 59291 },  // M 0.55
+    { 18473, 24306, 37875, 48537, 59166 },  // M 0.56
+    { 18407, 24332, 37757, 48611, 59040 },  // M 0.57
+    { 18341, 24358, 37638, 48684, 58913 },  // M 0.58
+    { 18276, 24382, 37519, 48756, 58785 },  // M 0.59
+    { 18209, 24406, 37398, 48827, 58656 },  // M 0.60
+    { 18143, 24428, 37277, 48896, 58526 },  // M 0.61
+    { 18076, 24449, 37155, 48965, 58395 },  // M 0.62
+    { 18009, 24469, 37031, 49033, 58262 },  // M 0.63
+    { 17942, 24488, 36907, 49099, 58128 },  // M 0.64
+    { 17875, 24505, 36782, 49164, 57993 },  // M 0.65
+    { 17807, 24521, 36656, 49227, 57856 },  // M 0.66
+    { 17739, 24536, 36528, 49289, 57717 },  // M 0.67
+    { 17671, 24549, 36400, 49349, 57577 },  // M 0.68
+    { 17602, 24561, 36270, 49407, 57435 },  // M 0.69
+    { 17533, 24571, 36139, 49464, 57290 },  // M 0.70
+    { 17464, 24580, 36006, 49518, 57143 },  // M 0.71
+    { 17395, 24587, 35873, 49570, 56994 },  // M 0.72
+    { 17325, 24592, 35737, 49619, 56842 },  // M 0.73
+    { 17254, 24595, 35601, 49666, 56688 },  // M 0.74
+    { 17184, 24596, 35462, 49709, 56530 },  // M 0.75
+    { 17112, 24595, 35322, 49749, 56369 },  // M 0.76
+    { 17041, 24592, 35180, 49785, 56204 },  // M 0.77
+    { 16968, 24586, 35036, 49818, 56034 },  // M 0.78
+    { 16896, 24578, 34891, 49845, 55861 },  // M 0.79
+    { 16822, 24567, 34743, 49868, 55682 },  // M 0.80
+    { 16748, 24554, 34592, 49885, 55497 },  // M 0.81
+    { 16674, 24537, 34440, 49895, 55306 },  // M 0.82
+    { 16598, 24518, 34284, 49899, 55107 },  // M 0.83
+    { 16522, 24495, 34126, 49893, 54901 },  // M 0.84
+    { 16445, 24468, 33965, 49879, 54685 },  // M 0.85
+    { 16367, 24437, 33800, 49853, 54458 },  // M 0.86
+    { 16287, 24402, 33631, 49815, 54218 },  // M 0.87
+    { 16206, 24361, 33458, 49761, 53965 },  // M 0.88
+    { 16124, 24315, 33280, 49690, 53694 },  // M 0.89
+    { 16040, 24263, 33097, 49598, 53402 },  // M 0.90
+    { 15954, 24204, 32907, 49480, 53087 },  // M 0.91
+    { 15865, 24136, 32709, 49331, 52741 },  // M 0.92
+    { 15773, 24058, 32502, 49143, 52358 },  // M 0.93
+    { 15676, 23967, 32283, 48905, 51928 },  // M 0.94
+    { 15574, 23860, 32049, 48603, 51439 },  // M 0.95
+    { 15465, 23732, 31795, 48216, 50870 },  // M 0.96
+    { 15344, 23574, 31510, 47713, 50193 },  // M 0.97
+    { 15207, 23370, 31181, 47042, 49364 },  // M 0.98
+    { 15040, 23090, 30776, 46121, 48311 },  // M 0.99
+    { 14815, 22667, 30226, 44795, 46906 },  // M 1.00
+    { 14449, 21907, 29339, 42754, 44911 },  // M 1.01
+    { 13536, 19993, 27392, 39278, 41877 },  // M 1.02
+};
+
+#endif
@@ -0,0 +1,44 @@
+/*
+ * SPWM compare tables (see spwm_lut.h)
+ */
+
+#include <math.h>
+
+#include "spwm_lut.h"
+
+
+
+void spwm_lut_build(uint16_t *lut, int samples, float m, uint32_t peak, uint32_t max_ticks, uint32_t dt_comp)
+{
+    int half_cycle = samples / 2;
+
+    for (int i = 0; i < samples; i++) {
+        // First half plays the waveform a quarter cycle ahead (formerly done by the ISR lookup)
+        int src = (i < half_cycle) ? (i + half_cycle / 2) % samples : i;
+        float angle = (2.0f * M_PI * src) / samples;
+        float sin_val = fabs(sin(angle));
+
+        // Calculate
+        int32_t duty_ticks = (int32_t)(peak * sin_val * m);
+
+        // Dead-time compensation, sign per half-cycle (load current assumed in phase with voltage):
+        // first half Leg 2 is high and Leg 1 sinks the current, so its high-side diode conducts
+        // during dead time and the effective duty grows -> subtract. Second half Leg 1 sources
+        // the current and the low-side diode steals the dead time -> add.
+        if (i < half_cycle) {
+            duty_ticks -= dt_comp;
+        } else {
+            duty_ticks += dt_comp;
+        }
+
+        // PRE-CALCULATION CLAMP
+        if (duty_ticks < 0) {
+            duty_ticks = 0;
+        }
+        if (duty_ticks > (int32_t)max_ticks) {
+            duty_ticks = max_ticks;
+        }
+
+        lut[i] = duty_ticks;
+    }
+}
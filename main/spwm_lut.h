@@ -0,0 +1,50 @@
+#ifndef SPWM_LUT_H
+#define SPWM_LUT_H
+
+/*
+ * SPWM compare tables: one output cycle of leg 1 compare values, and the compare the carrier
+ * ISR derives from a table entry and the output gain register.
+ *
+ * Leg 2 is held high for the first half cycle and low for the second. With leg 1 high for
+ * cmp / peak of each carrier period, |Vout| = (peak - cmp) / peak * Vbus in the first half
+ * and cmp / peak * Vbus in the second. No hardware or RTOS dependency; tools/spwm_sim.c
+ * checks the output of exactly this code on the host.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+// Output gain register: Q15 fixed point
+#define SPWM_GAIN_Q             15
+#define SPWM_GAIN_ONE           (1UL << SPWM_GAIN_Q)
+
+
+/**
+ * @brief Fill `lut` with one output cycle of `samples` compare values at modulation index m.
+ * The first half plays the waveform a quarter cycle ahead; dead-time compensation of
+ * dt_comp ticks is folded in with the sign of each half cycle. Entries are clamped to
+ * [0, max_ticks].
+ */
+void spwm_lut_build(uint16_t *lut, int samples, float m, uint32_t peak, uint32_t max_ticks, uint32_t dt_comp);
+
+/**
+ * @brief Leg 1 compare for table entry `lut` with the output gain applied.
+ * The gain has to scale |Vout|, which is the complement of the duty while leg 2 is high,
+ * so the first half scales peak - lut instead of lut. Clamped to [0, max_ticks].
+ */
+static inline __attribute__((always_inline)) uint32_t spwm_lut_compare(uint32_t lut, bool first_half, uint32_t gain_q15,
+                                                                       uint32_t peak, uint32_t max_ticks)
+{
+    int32_t cmp;
+    if (first_half) {
+        cmp = (int32_t)peak - (int32_t)(((peak - lut) * gain_q15) >> SPWM_GAIN_Q);
+    } else {
+        cmp = (int32_t)((lut * gain_q15) >> SPWM_GAIN_Q);
+    }
+    if (cmp < 0) cmp = 0;
+    if (cmp > (int32_t)max_ticks) cmp = (int32_t)max_ticks;
+    return (uint32_t)cmp;
+}
+
+#endif
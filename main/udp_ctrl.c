@@ -0,0 +1,201 @@
+/*
+ * Local UDP control endpoint (frame format in udp_ctrl.h)
+ *
+ * Same driver calls as the MQTT handlers, without the broker hop; a request is answered
+ * from spwm_get_state() right after it is applied.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_random.h"
+#include "lwip/sockets.h"
+#include "mbedtls/md.h"
+
+#include "udp_ctrl.h"
+
+#include "credentials.h"
+
+
+#ifndef UDP_CTRL_PORT
+#define UDP_CTRL_PORT           UDP_CTRL_DEFAULT_PORT
+#endif
+
+#define UDP_CTRL_TASK_PRIO      5       // same as mqtt_pub_task; work per frame is a few us
+
+static const char *TAG = "UDP_CTRL";
+
+static udp_ctrl_stats_t udp_stats;
+static portMUX_TYPE udp_lock = portMUX_INITIALIZER_UNLOCKED;
+
+
+
+#ifdef UDP_CTRL_KEY
+
+static spwm_handle_t udp_inverters[SPWM_MAX_INSTANCES]; // by instance id
+static uint32_t udp_session = 0;
+static uint32_t udp_last_seq = 0;
+
+
+static void udp_ctrl_mac(const void *data, size_t len, uint8_t out[UDP_CTRL_MAC_LEN])
+{
+    uint8_t full[32];
+    mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256),
+                    (const unsigned char *)UDP_CTRL_KEY, strlen(UDP_CTRL_KEY),
+                    data, len, full);
+    memcpy(out, full, UDP_CTRL_MAC_LEN);
+}
+
+
+// Constant time, so a forger learns nothing from how fast a frame is dropped
+static bool udp_ctrl_mac_ok(const udp_ctrl_request_t *req)
+{
+    uint8_t expected[UDP_CTRL_MAC_LEN];
+    uint8_t diff = 0;
+
+    udp_ctrl_mac(req, offsetof(udp_ctrl_request_t, mac), expected);
+    for (int i = 0; i < UDP_CTRL_MAC_LEN; i++) diff |= expected[i] ^ req->mac[i];
+    return diff == 0;
+}
+
+
+static udp_ctrl_status_t udp_ctrl_execute(const udp_ctrl_request_t *req, int64_t rx_us)
+{
+    if (req->cmd == UDP_CTRL_CMD_HELLO) return UDP_CTRL_OK;
+
+    if (req->session != udp_session) return UDP_CTRL_ERR_SESSION;
+    if (req->seq <= udp_last_seq) return UDP_CTRL_ERR_REPLAY;
+    if (req->instance >= SPWM_MAX_INSTANCES || udp_inverters[req->instance] == NULL) return UDP_CTRL_ERR_INSTANCE;
+
+    spwm_handle_t inv = udp_inverters[req->instance];
+    switch ((udp_ctrl_cmd_t)req->cmd) {
+        case UDP_CTRL_CMD_SET_FREQ:
+            spwm_set_target_frequency_traced(inv, req->arg, rx_us);
+            break;
+        case UDP_CTRL_CMD_START:
+            spwm_start(inv, req->arg > 0 ? req->arg : DEFAULT_FREQ_HZ);
+            break;
+        case UDP_CTRL_CMD_STOP:
+            spwm_stop(inv);
+            break;
+        case UDP_CTRL_CMD_GET_STATE:
+            break;
+        default:
+            return UDP_CTRL_ERR_CMD;
+    }
+
+    udp_last_seq = req->seq;
+    return UDP_CTRL_OK;
+}
+
+
+static void udp_ctrl_task(void *pvParameters)
+{
+    int sock = (int)(intptr_t)pvParameters;
+    udp_ctrl_request_t req;
+    udp_ctrl_reply_t reply;
+    struct sockaddr_in from;
+    spwm_runtime_state_t state;
+    spwm_fault_status_t fault;
+
+    while (1) {
+        socklen_t from_len = sizeof(from);
+        int len = recvfrom(sock, &req, sizeof(req), 0, (struct sockaddr *)&from, &from_len);
+        int64_t rx_us = esp_timer_get_time();
+        if (len < 0) continue;
+
+        taskENTER_CRITICAL(&udp_lock);
+        udp_stats.rx++;
+        taskEXIT_CRITICAL(&udp_lock);
+
+        if (len != sizeof(req) || req.version != UDP_CTRL_VERSION || !udp_ctrl_mac_ok(&req)) {
+            taskENTER_CRITICAL(&udp_lock);
+            udp_stats.bad_mac++;
+            taskEXIT_CRITICAL(&udp_lock);
+            continue;
+        }
+
+        udp_ctrl_status_t status = udp_ctrl_execute(&req, rx_us);
+
+        taskENTER_CRITICAL(&udp_lock);
+        if (status == UDP_CTRL_OK) udp_stats.accepted++;
+        else udp_stats.rejected++;
+        taskEXIT_CRITICAL(&udp_lock);
+
+        memset(&reply, 0, sizeof(reply));
+        reply.version = UDP_CTRL_VERSION;
+        reply.cmd = req.cmd | UDP_CTRL_REPLY_FLAG;
+        reply.instance = req.instance;
+        reply.status = status;
+        reply.session = udp_session;
+        reply.seq = (req.cmd == UDP_CTRL_CMD_HELLO) ? udp_last_seq : req.seq;
+
+        if (status == UDP_CTRL_OK && req.instance < SPWM_MAX_INSTANCES && udp_inverters[req.instance] != NULL) {
+            spwm_get_state(udp_inverters[req.instance], &state);
+            spwm_get_fault_status(udp_inverters[req.instance], &fault);
+            reply.running = state.running;
+            reply.update_pending = state.update_pending;
+            reply.fault_latched = fault.latched;
+            reply.current_hz = state.current_frequency;
+            reply.target_hz = state.target_frequency;
+            reply.mod_index_permille = (int32_t)(state.mod_index * 1000.0f);
+        }
+
+        udp_ctrl_mac(&reply, offsetof(udp_ctrl_reply_t, mac), reply.mac);
+        sendto(sock, &reply, sizeof(reply), 0, (struct sockaddr *)&from, from_len);
+    }
+}
+
+#endif
+
+
+
+esp_err_t udp_ctrl_init(const spwm_handle_t *inverters, int count)
+{
+#ifndef UDP_CTRL_KEY
+    ESP_LOGI(TAG, "No UDP_CTRL_KEY in credentials.h, UDP control disabled");
+    return ESP_ERR_NOT_SUPPORTED;
+#else
+    for (int i = 0; i < count; i++) {
+        if (inverters[i] != NULL) udp_inverters[spwm_get_instance_id(inverters[i])] = inverters[i];
+    }
+
+    // Never 0, so a zeroed frame cannot match
+    do {
+        udp_session = esp_random();
+    } while (udp_session == 0);
+
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0) {
+        ESP_LOGE(TAG, "socket() failed: errno %d", errno);
+        return ESP_FAIL;
+    }
+
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(UDP_CTRL_PORT),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        ESP_LOGE(TAG, "bind() to port %d failed: errno %d", UDP_CTRL_PORT, errno);
+        close(sock);
+        return ESP_FAIL;
+    }
+
+    xTaskCreatePinnedToCore(udp_ctrl_task, "udp_ctrl_task", 4096, (void *)(intptr_t)sock, UDP_CTRL_TASK_PRIO, NULL, 0);
+    ESP_LOGI(TAG, "Listening on UDP port %d", UDP_CTRL_PORT);
+    return ESP_OK;
+#endif
+}
+
+
+void udp_ctrl_get_stats(udp_ctrl_stats_t *out)
+{
+    taskENTER_CRITICAL(&udp_lock);
+    *out = udp_stats;
+    taskEXIT_CRITICAL(&udp_lock);
+}
@@ -0,0 +1,91 @@
+#ifndef UDP_CTRL_H
+#define UDP_CTRL_H
+
+/*
+ * Local UDP control endpoint, enabled by defining UDP_CTRL_KEY in credentials.h
+ *
+ * One datagram per request, one per reply, all fields little-endian:
+ *
+ *   request (32 B):  version, cmd, instance, 0, session u32, seq u32, arg i32, mac[16]
+ *   reply   (44 B):  version, cmd | 0x80, instance, status, session u32, seq u32,
+ *                    running, update_pending, fault_latched, 0,
+ *                    current Hz i32, target Hz i32, mod_index permille i32, mac[16]
+ *
+ * mac = HMAC-SHA256(UDP_CTRL_KEY, everything before it), truncated to 16 bytes.
+ * UDP_CTRL_CMD_HELLO needs no valid session/seq and returns the session id chosen at boot
+ * and, in seq, the last accepted seq. Every other request must carry that session and a
+ * higher seq, so a captured frame cannot be replayed in this boot nor after a restart.
+ * Frames with a bad MAC are dropped without reply. tools/udp_ctrl_client.py is the host side.
+ */
+
+#include <stdint.h>
+#include "esp_err.h"
+
+#include "driver.h"
+
+
+#define UDP_CTRL_DEFAULT_PORT   5005
+#define UDP_CTRL_VERSION        1
+#define UDP_CTRL_MAC_LEN        16
+#define UDP_CTRL_REPLY_FLAG     0x80
+
+typedef enum {
+    UDP_CTRL_CMD_HELLO = 0,
+    UDP_CTRL_CMD_SET_FREQ,      // arg = Hz
+    UDP_CTRL_CMD_START,         // arg = Hz, 0 = DEFAULT_FREQ_HZ
+    UDP_CTRL_CMD_STOP,
+    UDP_CTRL_CMD_GET_STATE,
+} udp_ctrl_cmd_t;
+
+typedef enum {
+    UDP_CTRL_OK = 0,
+    UDP_CTRL_ERR_SESSION,       // stale session id, send HELLO again
+    UDP_CTRL_ERR_REPLAY,        // seq not above the last accepted one
+    UDP_CTRL_ERR_INSTANCE,
+    UDP_CTRL_ERR_CMD,
+} udp_ctrl_status_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t version;
+    uint8_t cmd;
+    uint8_t instance;
+    uint8_t reserved;
+    uint32_t session;
+    uint32_t seq;
+    int32_t arg;
+    uint8_t mac[UDP_CTRL_MAC_LEN];
+} udp_ctrl_request_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t version;
+    uint8_t cmd;
+    uint8_t instance;
+    uint8_t status;
+    uint32_t session;
+    uint32_t seq;
+    uint8_t running;
+    uint8_t update_pending;
+    uint8_t fault_latched;
+    uint8_t reserved;
+    int32_t current_hz;
+    int32_t target_hz;
+    int32_t mod_index_permille;
+    uint8_t mac[UDP_CTRL_MAC_LEN];
+} udp_ctrl_reply_t;
+
+typedef struct {
+    uint32_t rx;
+    uint32_t accepted;
+    uint32_t bad_mac;       // includes malformed frames
+    uint32_t rejected;      // valid MAC, refused (session / replay / instance / cmd)
+} udp_ctrl_stats_t;
+
+/**
+ * @brief Start the listener task on UDP_CTRL_PORT (default UDP_CTRL_DEFAULT_PORT).
+ * @return ESP_ERR_NOT_SUPPORTED when credentials.h defines no UDP_CTRL_KEY
+ */
+esp_err_t udp_ctrl_init(const spwm_handle_t *inverters, int count);
+
+void udp_ctrl_get_stats(udp_ctrl_stats_t *out);
+
+#endif
@@ -0,0 +1,58 @@
+#!/usr/bin/env python3
+"""
+Turn status/diag snapshots into README result rows (carrier ISR and CPU load).
+
+  mosquitto_sub -v -t 'home/inverter/+/status/diag' -C 1 | isr_report.py --label "running 50 Hz"
+  mosquitto_sub -v -t 'home/inverter/+/status/diag' -C 2 | isr_report.py --label "2 instances" --rail-ma 182
+
+Reads "<topic> <json>" lines (mosquitto_sub -v) from stdin and prints one Markdown table row per
+message: label, device, ISR rate, ISR load, worst exec time and jitter, per-core CPU load and the
+3.3 V rail current given on the command line (measured externally, left as "-" when omitted).
+Trigger the snapshot with control/diag "ONCE" after the state has settled; the ISR and CPU figures
+cover the interval since the previous snapshot of the same inverter.
+"""
+
+import argparse
+import json
+import sys
+
+HEADER = ("| State | Device | ISR rate (calls/s) | ISR load (%) | Max exec (us) | Max jitter (us) "
+          "| CPU core 0 / 1 (%) | 3.3 V rail (mA) |")
+RULE = "|---|---|---|---|---|---|---|---|"
+
+
+def row(label, topic, diag, rail_ma):
+    device = topic.split("/")[2] if topic.count("/") >= 2 else topic
+    isr = diag.get("isr", {})
+    cpu = " / ".join("%.1f" % c for c in diag.get("cpu", [])) or "-"
+    return "| %s | %s | %.0f | %.2f | %.2f | %.2f | %s | %s |" % (
+        label, device, isr.get("rate_hz", 0), isr.get("load_pct", 0), isr.get("max_exec_us", 0),
+        isr.get("max_jitter_us", 0), cpu, "%.0f" % rail_ma if rail_ma is not None else "-")
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("--label", required=True, help="state the snapshot was taken in")
+    ap.add_argument("--rail-ma", type=float, help="3.3 V rail current measured in that state")
+    ap.add_argument("--no-header", action="store_true")
+    args = ap.parse_args()
+
+    if not args.no_header:
+        print(HEADER)
+        print(RULE)
+
+    rows = 0
+    for line in sys.stdin:
+        topic, _, payload = line.strip().partition(" ")
+        try:
+            diag = json.loads(payload)
+        except ValueError:
+            print("skipped, not JSON: %s" % topic, file=sys.stderr)
+            continue
+        print(row(args.label, topic, diag, args.rail_ma))
+        rows += 1
+    return 0 if rows else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
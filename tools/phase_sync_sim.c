@@ -0,0 +1,113 @@
+/*
+ * Host simulation of the phase alignment controller (main/phase_sync.c)
+ *
+ *   cc -O2 -Imain -o phase_sync_sim tools/phase_sync_sim.c main/phase_sync.c -lm
+ *   ./phase_sync_sim [units] [seconds] [hz]
+ *
+ * Every simulated unit has its own crystal error and start phase. Its cycle length is the
+ * driver's (sample count rounding included) plus the controller's trim, and it sees a
+ * fake wall clock: true time plus a per-unit SNTP offset. The controller is updated at the
+ * driver's ramp task period. Once a second, the error of each unit against its own
+ * clock's grid is printed, together with the spread of the true cycle-start times, which
+ * is what beats between units.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "phase_sync.h"
+
+
+// Driver constants (driver.h) without the ESP-IDF headers
+#define SAMPLE_RATE_HZ      40000.0     // CARRIER_FREQ_HZ * SPWM_UPDATES_PER_CARRIER
+#define UPDATES_PER_CARRIER 2
+#define TRIM_US             0.2         // SPWM_PHASE_TRIM_US
+#define UPDATE_PERIOD_US    500000.0    // freq_update_task period
+#define EPOCH_US            1750000000000000LL
+#define MAX_UNITS           16
+
+typedef struct {
+    double ppm;                 // crystal error
+    double sntp_offset_us;      // wall clock error
+    double cycle_start_us;      // true time of the current cycle start
+    uint32_t cycles;
+    uint32_t last_cycles;
+    int32_t trim;
+    phase_sync_t ctl;
+} sim_unit_t;
+
+
+// The fake clock: what the unit reads as Unix time at true time t
+static int64_t unit_wall_us(const sim_unit_t *u, double t)
+{
+    return EPOCH_US + (int64_t)llround(t + u->sntp_offset_us);
+}
+
+
+int main(int argc, char **argv)
+{
+    int units = argc > 1 ? atoi(argv[1]) : 3;
+    int seconds = argc > 2 ? atoi(argv[2]) : 60;
+    int hz = argc > 3 ? atoi(argv[3]) : 50;
+    if (units < 1 || units > MAX_UNITS || hz <= 0) {
+        fprintf(stderr, "usage: %s [units 1..%d] [seconds] [hz]\n", argv[0], MAX_UNITS);
+        return 1;
+    }
+
+    int samples = (int)(SAMPLE_RATE_HZ / hz);
+    double cycle_us = samples * 1e6 / SAMPLE_RATE_HZ;
+    int32_t max_trim = samples / (2 * UPDATES_PER_CARRIER) - 2;
+
+    sim_unit_t unit[MAX_UNITS] = { 0 };
+    srand(1);
+    for (int i = 0; i < units; i++) {
+        unit[i].ppm = (rand() % 81) - 40;                   // +-40 ppm
+        unit[i].sntp_offset_us = (rand() % 2001) - 1000;    // +-1 ms
+        unit[i].cycle_start_us = (rand() % 1000) * cycle_us / 1000.0;
+        phase_sync_reset(&unit[i].ctl);
+        printf("unit %d: %+.0f ppm, clock offset %+.0f us\n", i, unit[i].ppm, unit[i].sntp_offset_us);
+    }
+    printf("%d Hz, %d samples per cycle, untrimmed cycle %.3f us, trim limit %d\n\n", hz, samples, cycle_us, max_trim);
+
+    double next_update = UPDATE_PERIOD_US;
+    double next_report = 1e6;
+    for (double t = 0; t < seconds * 1e6; t += 100.0) {
+        for (int i = 0; i < units; i++) {
+            sim_unit_t *u = &unit[i];
+            double len = (cycle_us + u->trim * TRIM_US) * (1.0 + u->ppm * 1e-6);
+            while (u->cycle_start_us + len <= t) {
+                u->cycle_start_us += len;
+                u->cycles++;
+            }
+        }
+
+        if (t >= next_update) {
+            next_update += UPDATE_PERIOD_US;
+            for (int i = 0; i < units; i++) {
+                sim_unit_t *u = &unit[i];
+                u->trim = phase_sync_update(&u->ctl, unit_wall_us(u, u->cycle_start_us), hz, cycle_us,
+                                            u->cycles - u->last_cycles, TRIM_US, max_trim);
+                u->last_cycles = u->cycles;
+            }
+        }
+
+        if (t >= next_report) {
+            next_report += 1e6;
+            double period = 1e6 / hz, lo = 0, hi = 0;
+            printf("t=%3.0f s ", t / 1e6);
+            for (int i = 0; i < units; i++) {
+                // True cycle-start phase relative to unit 0, wrapped to +-half a period
+                double rel = fmod(unit[i].cycle_start_us - unit[0].cycle_start_us, period);
+                if (rel > period / 2) rel -= period;
+                if (rel < -period / 2) rel += period;
+                if (rel < lo) lo = rel;
+                if (rel > hi) hi = rel;
+                printf(" | u%d err %8.1f us trim %4d%s", i, unit[i].ctl.error_us, unit[i].trim,
+                       unit[i].ctl.locked ? " L" : "  ");
+            }
+            printf(" | spread %.1f us\n", hi - lo);
+        }
+    }
+    return 0;
+}
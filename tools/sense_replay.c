@@ -0,0 +1,140 @@
+/*
+ * Host replay of a recorded sense stream through the firmware's cycle statistics
+ * (main/sense_cycle.c)
+ *
+ *   cc -O2 -Imain -o sense_replay tools/sense_replay.c main/sense_cycle.c -lm
+ *   ./sense_replay tools/sense_capture.csv
+ *
+ * File format: one "channel,raw" pair per line in acquisition order, as the ADC DMA frames
+ * deliver them; '#' starts a comment. Directives in comments:
+ *   # window N                 samples per fundamental cycle (driver samples_per_cycle)
+ *   # expect NAME VALUE TOL    NAME = current_|vbus_ followed by rms|peak|avg|clipped
+ * Raw codes are converted with the nominal ADC scale of sense_adc.c (no eFuse calibration).
+ * Prints every cycle and the mean over all complete cycles; exits with 1 when an expectation
+ * is missed or no cycle completes.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sense_cycle.h"
+
+
+// sense.c / sense_adc.c constants without the ESP-IDF headers
+#define SENSE_CURRENT_CH        6
+#define SENSE_VBUS_CH           7
+#define ADC_NOMINAL_FULL_MV     3100
+#define ADC_MAX_RAW             4095
+#define DEFAULT_WINDOW          400     // CARRIER_FREQ_HZ / DEFAULT_FREQ_HZ
+
+#define MAX_EXPECT              16
+
+typedef struct {
+    char name[16];
+    double value;
+    double tol;
+} expect_t;
+
+
+typedef struct {
+    double rms, peak, avg, clipped;
+} mean_stats_t;
+
+
+static double stat_value(const mean_stats_t *mean, const char *name)
+{
+    static const char *qty_name[SENSE_QTY_COUNT] = { "current", "vbus" };
+
+    for (int q = 0; q < SENSE_QTY_COUNT; q++) {
+        size_t len = strlen(qty_name[q]);
+        if (strncmp(name, qty_name[q], len) != 0 || name[len] != '_') continue;
+        const char *field = name + len + 1;
+        if (strcmp(field, "rms") == 0) return mean[q].rms;
+        if (strcmp(field, "peak") == 0) return mean[q].peak;
+        if (strcmp(field, "avg") == 0) return mean[q].avg;
+        if (strcmp(field, "clipped") == 0) return mean[q].clipped;
+    }
+    return NAN;
+}
+
+
+int main(int argc, char **argv)
+{
+    const char *path = argc > 1 ? argv[1] : "tools/sense_capture.csv";
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return 1;
+    }
+
+    sense_cycle_t cycle = { .window = DEFAULT_WINDOW };
+    sense_stats_t stats[SENSE_QTY_COUNT];
+    mean_stats_t sum[SENSE_QTY_COUNT] = { 0 };
+    expect_t expect[MAX_EXPECT];
+    int expect_count = 0, cycles = 0;
+    long samples = 0;
+    char line[128];
+
+    printf("cycle  I rms   I peak  I avg    Vbus avg  Vbus peak  clipped\n");
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (line[0] == '#') {
+            expect_t *e = &expect[expect_count];
+            if (sscanf(line, "# window %d", &cycle.window) == 1) continue;
+            if (expect_count < MAX_EXPECT && sscanf(line, "# expect %15s %lf %lf", e->name, &e->value, &e->tol) == 3) {
+                expect_count++;
+            }
+            continue;
+        }
+
+        unsigned channel, raw;
+        if (sscanf(line, "%u,%u", &channel, &raw) != 2) continue;
+        sense_qty_t qty;
+        if (channel == SENSE_CURRENT_CH) qty = SENSE_QTY_CURRENT;
+        else if (channel == SENSE_VBUS_CH) qty = SENSE_QTY_VBUS;
+        else continue;
+
+        samples++;
+        int mv = (int)raw * ADC_NOMINAL_FULL_MV / ADC_MAX_RAW;
+        if (!sense_cycle_add(&cycle, qty, mv, stats)) continue;
+
+        cycles++;
+        printf("%5d  %5.3f  %6.3f  %6.3f  %8.2f  %9.2f  %3lu / %lu\n", cycles, stats[SENSE_QTY_CURRENT].rms,
+               stats[SENSE_QTY_CURRENT].peak, stats[SENSE_QTY_CURRENT].avg, stats[SENSE_QTY_VBUS].avg,
+               stats[SENSE_QTY_VBUS].peak, (unsigned long)stats[SENSE_QTY_CURRENT].clipped,
+               (unsigned long)stats[SENSE_QTY_VBUS].clipped);
+        for (int q = 0; q < SENSE_QTY_COUNT; q++) {
+            sum[q].rms += stats[q].rms;
+            sum[q].peak += stats[q].peak;
+            sum[q].avg += stats[q].avg;
+            sum[q].clipped += stats[q].clipped;
+        }
+    }
+    fclose(f);
+
+    printf("%ld samples, window %d, %d complete cycles\n", samples, cycle.window, cycles);
+    if (cycles == 0) {
+        printf("FAIL\n");
+        return 1;
+    }
+
+    for (int q = 0; q < SENSE_QTY_COUNT; q++) {
+        sum[q].rms /= cycles;
+        sum[q].peak /= cycles;
+        sum[q].avg /= cycles;
+        sum[q].clipped /= cycles;
+    }
+
+    int failed = 0;
+    for (int i = 0; i < expect_count; i++) {
+        double v = stat_value(sum, expect[i].name);
+        int ok = !isnan(v) && fabs(v - expect[i].value) <= expect[i].tol;
+        printf("  %-15s %8.3f  expected %8.3f +- %.3f  %s\n", expect[i].name, v, expect[i].value,
+               expect[i].tol, ok ? "ok" : "MISS");
+        if (!ok) failed = 1;
+    }
+
+    printf("\n%s\n", failed ? "FAIL" : "OK");
+    return failed;
+}
@@ -0,0 +1,195 @@
+#!/usr/bin/env python3
+"""
+Offline solver for the selective harmonic elimination (SHE) switching angles used by the
+driver's SHE modulation mode. Writes main/she_table.h.
+
+  she_gen.py [-n 5] [--m-min 0.05] [--m-max 1.15] [--m-step 0.01] [-o main/she_table.h]
+
+The output is the unipolar (three-level) full-bridge waveform with quarter-wave symmetry:
+0 until a1, active until a2, 0 until a3, ... mirrored about 90 deg and negated in the second
+half. With N angles per quarter the fundamental is set to M (amplitude / DC bus) and the odd
+harmonics 3 .. 2N-1 are removed:
+
+  sum_k (-1)^k cos(a_k)   = M * pi / 4
+  sum_k (-1)^k cos(h a_k) = 0                  h = 3, 5, .. 2N-1
+
+Newton's method is run with continuation over M, so neighbouring table rows come from the
+same solution family and the driver can interpolate between them. Angles closer than the
+driver's shortest slot (one carrier period at MAX_FREQ_HZ) are rejected. M values without a
+solution are dropped from the ends; a hole in the middle is an error. Pure Python, no deps.
+
+For every row the THD and the weighted THD (harmonic / order, i.e. load current
+distortion) of the ideal waveform up to the 49th harmonic are printed;
+tools/she_sim.c repeats the check on the slot tables the firmware actually plays.
+"""
+
+import argparse
+import math
+import random
+import sys
+
+CARRIER_FREQ_HZ = 20000         # driver.h
+MAX_FREQ_HZ = 60
+GAP_MARGIN = 1.25               # headroom over the shortest slot, covers tick rounding
+THD_MAX_HARMONIC = 49
+ANGLE_ONE = 65536               # Q16 of a quarter cycle, as stored in the table
+
+
+def harmonics(n):
+    return [1] + [2 * j + 1 for j in range(1, n)]
+
+
+def residual(a, m, hs):
+    f = [sum((-1) ** k * math.cos(h * x) for k, x in enumerate(a)) for h in hs]
+    f[0] -= m * math.pi / 4
+    return f
+
+
+def jacobian(a, hs):
+    return [[-(-1) ** k * h * math.sin(h * x) for k, x in enumerate(a)] for h in hs]
+
+
+def solve_linear(mat, rhs):
+    n = len(rhs)
+    m = [row[:] + [rhs[i]] for i, row in enumerate(mat)]
+    for c in range(n):
+        p = max(range(c, n), key=lambda r: abs(m[r][c]))
+        if abs(m[p][c]) < 1e-12:
+            return None
+        m[c], m[p] = m[p], m[c]
+        for r in range(c + 1, n):
+            f = m[r][c] / m[c][c]
+            for k in range(c, n + 1):
+                m[r][k] -= f * m[c][k]
+    x = [0.0] * n
+    for r in reversed(range(n)):
+        x[r] = (m[r][n] - sum(m[r][k] * x[k] for k in range(r + 1, n))) / m[r][r]
+    return x
+
+
+def valid(a, gap):
+    if a[0] < gap or math.pi / 2 - a[-1] < gap / 2:
+        return False
+    return all(a[k + 1] - a[k] >= gap for k in range(len(a) - 1))
+
+
+def newton(a, m, hs, gap, iters=50):
+    a = a[:]
+    for _ in range(iters):
+        f = residual(a, m, hs)
+        if max(abs(v) for v in f) < 1e-10:
+            return a if valid(a, gap) else None
+        d = solve_linear(jacobian(a, hs), [-v for v in f])
+        if d is None:
+            return None
+        # Damped step: never move an angle by more than ~3 deg at once
+        s = min(1.0, 0.05 / max(abs(v) for v in d))
+        a = [x + s * dx for x, dx in zip(a, d)]
+        if any(not 0.0 < x < math.pi / 2 for x in a):
+            return None
+    return None
+
+
+def random_start(n, rng):
+    return sorted(rng.uniform(0.02, math.pi / 2 - 0.02) for _ in range(n))
+
+
+def search(m, n, hs, gap, rng, tries=2000):
+    for _ in range(tries):
+        a = newton(random_start(n, rng), m, hs, gap)
+        if a is not None:
+            return a
+    return None
+
+
+def thd(a, weighted=False):
+    """Voltage THD up to THD_MAX_HARMONIC; weighted divides each harmonic by its order, which
+    is what the current of an inductive load (motor) sees"""
+    hs = range(1, THD_MAX_HARMONIC + 1, 2)
+    b = [sum((-1) ** k * math.cos(h * x) for k, x in enumerate(a)) / h for h in hs]
+    if weighted:
+        b = [v / h for v, h in zip(b, hs)]
+    return math.sqrt(sum(v * v for v in b[1:])) / abs(b[0])
+
+
+def sweep(ms, n, hs, gap, seed_m, rng):
+    """Continuation from seed_m in both directions; None where the family is lost"""
+    out = {}
+    a0 = search(seed_m, n, hs, gap, rng)
+    if a0 is None:
+        return out
+    out[seed_m] = a0
+    for direction in (1, -1):
+        a = a0
+        i = ms.index(seed_m) + direction
+        while 0 <= i < len(ms):
+            nxt = newton(a, ms[i], hs, gap)
+            if nxt is None:
+                break
+            out[ms[i]] = a = nxt
+            i += direction
+    return out
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("-n", "--angles", type=int, default=5, help="switching angles per quarter cycle")
+    ap.add_argument("--m-min", type=float, default=0.05)
+    ap.add_argument("--m-max", type=float, default=1.15)
+    ap.add_argument("--m-step", type=float, default=0.01)
+    ap.add_argument("--seeds", type=int, default=20, help="solution families tried, the widest one is kept")
+    ap.add_argument("-o", "--output", default="main/she_table.h")
+    args = ap.parse_args()
+
+    n = args.angles
+    hs = harmonics(n)
+    gap = 2 * math.pi * MAX_FREQ_HZ / CARRIER_FREQ_HZ * GAP_MARGIN
+    steps = int(round((args.m_max - args.m_min) / args.m_step))
+    ms = [round(args.m_min + i * args.m_step, 6) for i in range(steps + 1)]
+    rng = random.Random(1)
+
+    # Several families exist; keep the one covering the longest contiguous M range
+    best = {}
+    for s in range(args.seeds):
+        fam = sweep(ms, n, hs, gap, ms[(s * 7919) % len(ms)], rng)
+        if len(fam) > len(best):
+            best = fam
+    if not best:
+        sys.exit("no solution found")
+
+    covered = [m for m in ms if m in best]
+    lo, hi = ms.index(covered[0]), ms.index(covered[-1])
+    rows = ms[lo:hi + 1]
+    missing = [m for m in rows if m not in best]
+    if missing:
+        sys.exit("solution family has holes at M = %s" % ", ".join("%.2f" % m for m in missing))
+
+    print("N=%d, eliminated %s, min gap %.2f deg, M %.2f .. %.2f (%d rows)"
+          % (n, ",".join(map(str, hs[1:])), math.degrees(gap), rows[0], rows[-1], len(rows)))
+    print("   M   THD%   WTHD%   angles (deg)")
+    for m in rows:
+        a = best[m]
+        print("%5.2f %7.2f %7.3f   %s" % (m, 100 * thd(a), 100 * thd(a, True),
+                                         " ".join("%6.2f" % math.degrees(x) for x in a)))
+
+    with open(args.output, "w") as f:
+        f.write("// Generated by tools/she_gen.py -n %d --m-min %g --m-max %g --m-step %g, do not edit\n"
+                % (n, args.m_min, args.m_max, args.m_step))
+        f.write("#ifndef SHE_TABLE_H\n#define SHE_TABLE_H\n\n#include <stdint.h>\n\n")
+        f.write("#define SHE_ANGLES          %d      // per quarter cycle; harmonics 3 .. %d eliminated\n"
+                % (n, 2 * n - 1))
+        f.write("#define SHE_TABLE_LEN       %d\n" % len(rows))
+        f.write("#define SHE_TABLE_M_MIN     %.4ff  // modulation index (fundamental / DC bus) of row 0\n"
+                % rows[0])
+        f.write("#define SHE_TABLE_M_STEP    %.4ff\n" % args.m_step)
+        f.write("#define SHE_ANGLE_ONE       %dU  // angles in Q16 of a quarter cycle (90 deg)\n\n" % ANGLE_ONE)
+        f.write("static const uint16_t she_angle_table[SHE_TABLE_LEN][SHE_ANGLES] = {\n")
+        for m in rows:
+            q = [min(ANGLE_ONE - 1, int(round(x / (math.pi / 2) * ANGLE_ONE))) for x in best[m]]
+            f.write("    { %s },  // M %.2f\n" % (", ".join("%5d" % v for v in q), m))
+        f.write("};\n\n#endif\n")
+    print("wrote %s" % args.output)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,151 @@
+/*
+ * Host check of the SHE slot tables (main/she.c, main/she_table.h)
+ *
+ *   cc -O2 -Wall -Wextra -Imain -o she_sim tools/she_sim.c main/she.c -lm
+ *   ./she_sim [hz ...]
+ *
+ * Builds the slots the driver plays for every table row and every midpoint between rows
+ * (the driver interpolates), at the driver's timer resolution and slot limits, and takes
+ * the spectrum of the resulting three-level output exactly (the waveform is piecewise
+ * constant). Per frequency it prints a row every 0.1 of M with the fundamental error, the
+ * largest eliminated harmonic (3 .. 2N-1), THD and weighted THD up to the 49th, slots and
+ * carrier ISR calls per second against SPWM. Dead time is not modelled. Exits with 1 when
+ * an eliminated harmonic exceeds SHE_SIM_LIMIT_PCT of the fundamental anywhere, or when the
+ * weighted THD exceeds SHE_SIM_WTHD_LIMIT(M) at any M the driver plays as SHE (M >= SHE_MIN_M;
+ * below it the driver falls back to SPWM).
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "she.h"
+#include "she_table.h"
+
+
+// Driver constants (driver.h / driver.c) without the ESP-IDF headers
+#define TIMER_RESOLUTION_HZ     10000000.0
+#define CARRIER_FREQ_HZ         20000
+#define SAMPLE_RATE_HZ          40000   // SPWM ISR calls per second (double update)
+#define ISR_CALLS_PER_SLOT      2       // TEZ + TEP
+#define PEAK_TICKS              250     // shortest slot
+#define SHE_MAX_PEAK            32000   // longest slot
+#define MAX_SLOTS               666     // LUT buffer / slot size
+
+#define MAX_HARMONIC            49
+#define SHE_SIM_LIMIT_PCT       0.5
+// The current table runs 11.4 % at M 0.3 down to 3.0 % at M 1.0; half a point of margin
+#define SHE_SIM_WTHD_LIMIT(m)   (15.5 - 12.0 * (m))
+
+typedef struct {
+    double m_out;           // fundamental amplitude / DC bus
+    double worst_elim_pct;  // largest of harmonics 3 .. 2N-1, % of fundamental
+    double thd_pct;
+    double wthd_pct;
+    int slots;
+    int edges;              // leg 1 transitions per cycle
+} she_result_t;
+
+
+// The driver plays SPWM below SHE_MIN_M; the row positions are not exact in binary
+static int she_played(double m)
+{
+    return m > SHE_MIN_M - 1e-6;
+}
+
+
+static int analyse(double m, int hz, she_result_t *r)
+{
+    static she_slot_t slots[MAX_SLOTS];
+    double a[MAX_HARMONIC + 1] = { 0 }, b[MAX_HARMONIC + 1] = { 0 };
+    uint32_t cycle_ticks = (uint32_t)(TIMER_RESOLUTION_HZ / hz + 0.5);
+
+    int n = she_build_cycle((float)m, cycle_ticks, PEAK_TICKS, SHE_MAX_PEAK, slots, MAX_SLOTS);
+    if (n < 0) return -1;
+
+    double total = 0;
+    for (int i = 0; i < n; i++) total += 2.0 * slots[i].peak;
+
+    // Output = leg 2 - leg 1, in units of the DC bus; the slot list is exactly one period
+    double t = 0;
+    r->edges = 0;
+    for (int i = 0; i < n; i++) {
+        double v = ((slots[i].level & SHE_LEG2_HIGH) ? 1 : 0) - ((slots[i].level & SHE_LEG1_HIGH) ? 1 : 0);
+        double th0 = 2 * M_PI * t / total;
+        t += 2.0 * slots[i].peak;
+        double th1 = 2 * M_PI * t / total;
+        for (int h = 1; h <= MAX_HARMONIC; h++) {
+            a[h] += v / (M_PI * h) * (sin(h * th1) - sin(h * th0));
+            b[h] += v / (M_PI * h) * (cos(h * th0) - cos(h * th1));
+        }
+        if ((slots[i].level ^ slots[(i + 1) % n].level) & SHE_LEG1_HIGH) r->edges++;
+    }
+
+    double c1 = hypot(a[1], b[1]), sum = 0, wsum = 0;
+    r->worst_elim_pct = 0;
+    for (int h = 2; h <= MAX_HARMONIC; h++) {
+        double c = hypot(a[h], b[h]) / c1;
+        sum += c * c;
+        wsum += (c / h) * (c / h);
+        if ((h & 1) && h <= 2 * SHE_ANGLES - 1 && 100 * c > r->worst_elim_pct) r->worst_elim_pct = 100 * c;
+    }
+    r->m_out = c1;
+    r->thd_pct = 100 * sqrt(sum);
+    r->wthd_pct = 100 * sqrt(wsum);
+    r->slots = n;
+    return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+    int default_hz[] = { 30, 50, 60 };
+    int nf = argc > 1 ? argc - 1 : 3;
+    int failed = 0;
+
+    float m_min, m_max;
+    she_m_range(&m_min, &m_max);
+    printf("SHE: %d angles, harmonics 3 .. %d eliminated, M %.2f .. %.2f\n",
+           SHE_ANGLES, 2 * SHE_ANGLES - 1, m_min, m_max);
+
+    for (int f = 0; f < nf; f++) {
+        int hz = argc > 1 ? atoi(argv[f + 1]) : default_hz[f];
+        if (hz <= 0) continue;
+
+        printf("\n%d Hz (SPWM: %d ISR calls/s, %d leg 1 edges/cycle)\n", hz, SAMPLE_RATE_HZ, 2 * CARRIER_FREQ_HZ / hz);
+        printf("    M   M out  elim%%    THD%%   WTHD%%  slots  edges  ISR/s\n");
+
+        double worst = 0, worst_m = 0, worst_m_err = 0, wthd_over = -1e9, wthd_m = 0;
+        for (int i = 0; i <= 2 * (SHE_TABLE_LEN - 1); i++) {
+            double m = SHE_TABLE_M_MIN + i * SHE_TABLE_M_STEP / 2; // rows and midpoints
+            she_result_t r;
+            if (analyse(m, hz, &r) != 0) {
+                printf("  %.3f: slot buffer too small\n", m);
+                failed = 1;
+                continue;
+            }
+            if (r.worst_elim_pct > worst) {
+                worst = r.worst_elim_pct;
+                worst_m = m;
+            }
+            if (fabs(r.m_out - m) > worst_m_err) worst_m_err = fabs(r.m_out - m);
+            if (she_played(m) && r.wthd_pct - SHE_SIM_WTHD_LIMIT(m) > wthd_over) {
+                wthd_over = r.wthd_pct - SHE_SIM_WTHD_LIMIT(m);
+                wthd_m = m;
+            }
+
+            if (i % 20 == 0) {
+                printf("  %.2f  %.3f  %5.2f  %6.1f  %6.2f  %5d  %5d  %5d%s\n", m, r.m_out, r.worst_elim_pct,
+                       r.thd_pct, r.wthd_pct, r.slots, r.edges, r.slots * ISR_CALLS_PER_SLOT * hz,
+                       !she_played(m) ? "  (SPWM)" : "");
+            }
+        }
+        printf("  worst eliminated harmonic %.3f%% (M %.3f), worst |M error| %.4f\n", worst, worst_m, worst_m_err);
+        printf("  WTHD vs limit %+.2f points (M %.3f), limit %.1f%% at M %.1f .. %.1f%% at M 1.0\n", wthd_over, wthd_m,
+               SHE_SIM_WTHD_LIMIT(SHE_MIN_M), SHE_MIN_M, SHE_SIM_WTHD_LIMIT(1.0));
+        if (worst > SHE_SIM_LIMIT_PCT || wthd_over > 0) failed = 1;
+    }
+
+    printf("\n%s\n", failed ? "FAIL" : "OK");
+    return failed;
+}
@@ -0,0 +1,288 @@
+/*
+ * Host check of the SPWM compare path (main/spwm_lut.c, main/spwm_lut.h)
+ *
+ *   cc -O2 -Wall -Wextra -Imain -o spwm_sim tools/spwm_sim.c main/spwm_lut.c -lm
+ *   ./spwm_sim
+ *
+ * Bus compensation: builds the table the driver plays, applies the output gain the way the
+ * carrier ISR does for a sagging or raised bus (gain = NOMINAL_VBUS_V / vbus) and compares
+ * |Vout| of every sample against the table at nominal bus and unity gain, per half cycle.
+ * Samples whose compensated compare would leave [0, MAX_TICKS] are counted as saturated
+ * (no headroom) and left out of the error. The former plain multiply (lut * gain in both
+ * halves) is shown for reference. Fails when an unsaturated sample is off by more than
+ * GAIN_LIMIT_TICKS of the bus.
+ *
+ * Dead time: plays the table as leg 1 edges (up-count sample high from the valley to its
+ * compare, down-count sample high from its compare to the valley), delays the edge the dead
+ * time acts on by DEAD_TIME_TICKS, with the load current assumed in phase with the output
+ * voltage (leg 1 sources it in the second half: rising edge late, sinks it in the first half:
+ * falling edge late), and takes the exact spectrum of Vout = leg 1 - leg 2 (piecewise
+ * constant). Against the waveform without dead time it prints the fundamental error and the
+ * error in harmonics 2 .. LOW_ORDER_MAX for no compensation, the table compensation
+ * (DT_COMP_TICKS), the other rounding (3) and the exact 3.5 ticks. Fails unless the table
+ * compensation beats no compensation on both and stays within ROUNDING_LIMIT_PCT of the
+ * exact compensation. Leg 2 switches twice per cycle; its dead time is not modelled.
+ *
+ * Exits with 1 on any failure.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "spwm_lut.h"
+
+
+// Driver constants (driver.h / driver.c) without the ESP-IDF headers
+#define TIMER_RESOLUTION_HZ     10000000.0
+#define CARRIER_FREQ_HZ         20000
+#define SAMPLE_RATE_HZ          40000   // LUT samples per second (double update)
+#define PEAK_TICKS              250
+#define MAX_TICKS               ((uint32_t)(PEAK_TICKS * 0.95f))
+#define DEAD_TIME_TICKS         7
+#define DT_COMP_TICKS           4       // DEAD_TIME_TICKS * CARRIER_FREQ_HZ * PEAK_TICKS / TIMER_RESOLUTION_HZ, rounded
+#define NOMINAL_VBUS_V          325.0
+#define SPWM_BUS_GAIN_MIN       0.85    // spwm_set_bus_voltage() clamp
+#define SPWM_BUS_GAIN_MAX       1.15
+#define MAX_SAMPLES             (SAMPLE_RATE_HZ / 30)
+
+#define GAIN_LIMIT_TICKS        1.0     // Q15 truncation and the 1-tick compare resolution
+
+#define LOW_ORDER_MAX           13
+#define ROUNDING_LIMIT_PCT      0.5     // of the fundamental, table rounding against exact 3.5 ticks
+#define MAX_EDGES               (2 * MAX_SAMPLES)
+
+
+typedef struct {
+    double max_err_v[2];    // per half cycle, unsaturated samples
+    int saturated[2];
+} gain_result_t;
+
+
+// The former ISR: gain on the duty in both halves, whichever leg carries |Vout|
+static uint32_t plain_compare(uint32_t lut, uint32_t gain_q15, uint32_t max_ticks)
+{
+    uint32_t cmp = (lut * gain_q15) >> SPWM_GAIN_Q;
+    return cmp > max_ticks ? max_ticks : cmp;
+}
+
+
+static void gain_check(const uint16_t *lut, int samples, double vbus, bool plain, gain_result_t *r)
+{
+    double gain = NOMINAL_VBUS_V / vbus;
+    if (gain < SPWM_BUS_GAIN_MIN) gain = SPWM_BUS_GAIN_MIN;
+    if (gain > SPWM_BUS_GAIN_MAX) gain = SPWM_BUS_GAIN_MAX;
+    uint32_t gain_q15 = (uint32_t)(gain * SPWM_GAIN_ONE + 0.5);
+    int half_cycle = samples / 2;
+
+    for (int h = 0; h < 2; h++) {
+        r->max_err_v[h] = 0;
+        r->saturated[h] = 0;
+    }
+
+    for (int i = 0; i < samples; i++) {
+        int h = i < half_cycle ? 0 : 1;
+        bool first_half = h == 0;
+
+        // |Vout| the table asks for: leg 2 high -> complement of the duty
+        double want = NOMINAL_VBUS_V * (first_half ? PEAK_TICKS - lut[i] : lut[i]) / PEAK_TICKS;
+        double ideal_cmp = first_half ? PEAK_TICKS - want / vbus * PEAK_TICKS : want / vbus * PEAK_TICKS;
+        if (ideal_cmp < 0 || ideal_cmp > MAX_TICKS) {
+            r->saturated[h]++;
+            continue;
+        }
+
+        uint32_t cmp = plain ? plain_compare(lut[i], gain_q15, MAX_TICKS)
+                             : spwm_lut_compare(lut[i], first_half, gain_q15, PEAK_TICKS, MAX_TICKS);
+        double got = vbus * (first_half ? PEAK_TICKS - (double)cmp : (double)cmp) / PEAK_TICKS;
+        if (fabs(got - want) > r->max_err_v[h]) r->max_err_v[h] = fabs(got - want);
+    }
+}
+
+
+typedef struct {
+    double start, end;      // leg 1 high, in ticks from the cycle start
+} pulse_t;
+
+typedef struct {
+    double re[LOW_ORDER_MAX + 1], im[LOW_ORDER_MAX + 1];
+} spectrum_t;
+
+
+// Leg 1 high intervals of one output cycle for compare values cmp[], merged across the
+// valleys; the pulse around the cycle start is kept whole (it may start at a negative time)
+static int leg1_pulses(const double *cmp, int samples, pulse_t *out)
+{
+    int n = 0;
+    for (int j = 0; j < samples; j++) {
+        if (cmp[j] <= 0) continue;
+        double s = (j & 1) ? (j + 1) * (double)PEAK_TICKS - cmp[j] : j * (double)PEAK_TICKS;
+        double e = (j & 1) ? (j + 1) * (double)PEAK_TICKS : j * (double)PEAK_TICKS + cmp[j];
+        if (n > 0 && out[n - 1].end >= s) {
+            out[n - 1].end = e;
+        } else {
+            out[n].start = s;
+            out[n].end = e;
+            n++;
+        }
+    }
+    double period = (double)samples * PEAK_TICKS;
+    if (n > 1 && out[0].start <= 0 && out[n - 1].end >= period) {
+        out[0].start = out[n - 1].start - period;
+        n--;
+    }
+    return n;
+}
+
+
+// Load current in phase with the voltage: negative (leg 1 sinks) in the first half
+static void apply_dead_time(pulse_t *p, int n, int samples, double dead_ticks)
+{
+    double half = (double)samples * PEAK_TICKS / 2;
+    double period = 2 * half;
+
+    for (int k = 0; k < n; k++) {
+        double s = fmod(p[k].start + period, period);
+        double e = fmod(p[k].end, period);
+        if (s >= half) p[k].start += dead_ticks;    // sourcing: the low-side diode holds the leg low
+        if (e < half) p[k].end += dead_ticks;       // sinking: the high-side diode holds it high
+        if (k > 0 && p[k - 1].end > p[k].start) p[k].start = p[k - 1].end; // low gap closed
+        if (p[k].end < p[k].start) p[k].end = p[k].start;   // pulse swallowed
+    }
+}
+
+
+// Exact Fourier coefficients of Vout = leg 1 - leg 2 in units of the bus
+static void spectrum(const pulse_t *p, int n, int samples, spectrum_t *sp)
+{
+    double period = (double)samples * PEAK_TICKS;
+
+    for (int h = 1; h <= LOW_ORDER_MAX; h++) {
+        double w = 2 * M_PI * h / period;
+        double re = 0, im = 0;
+        for (int k = 0; k < n; k++) {
+            re += (sin(w * p[k].end) - sin(w * p[k].start)) / (M_PI * h);
+            im += (cos(w * p[k].start) - cos(w * p[k].end)) / (M_PI * h);
+        }
+        // Leg 2 high over [0, period / 2)
+        re -= (sin(M_PI * h) - 0) / (M_PI * h);
+        im -= (1 - cos(M_PI * h)) / (M_PI * h);
+        sp->re[h] = re;
+        sp->im[h] = im;
+    }
+}
+
+
+typedef struct {
+    double fund_err_pct;    // |c1 - c1_ideal| / |c1_ideal|
+    double low_err_pct;     // RSS of |ch - ch_ideal|, h = 2 .. LOW_ORDER_MAX, of |c1_ideal|
+} dt_result_t;
+
+
+static void dead_time_case(const uint16_t *lut0, int samples, double comp, double dead_ticks,
+                           const spectrum_t *ideal, spectrum_t *out, dt_result_t *r)
+{
+    static double cmp[MAX_SAMPLES];
+    static pulse_t pulses[MAX_EDGES];
+    int half_cycle = samples / 2;
+
+    // Same sign and clamp as spwm_lut_build(), but comp may be fractional
+    for (int j = 0; j < samples; j++) {
+        double c = lut0[j] + (j < half_cycle ? -comp : comp);
+        cmp[j] = c < 0 ? 0 : c > MAX_TICKS ? MAX_TICKS : c;
+    }
+    int n = leg1_pulses(cmp, samples, pulses);
+    apply_dead_time(pulses, n, samples, dead_ticks);
+    spectrum(pulses, n, samples, out);
+
+    if (ideal == NULL) return;
+    double c1 = hypot(ideal->re[1], ideal->im[1]), sum = 0;
+    r->fund_err_pct = 100 * hypot(out->re[1] - ideal->re[1], out->im[1] - ideal->im[1]) / c1;
+    for (int h = 2; h <= LOW_ORDER_MAX; h++) {
+        double d = hypot(out->re[h] - ideal->re[h], out->im[h] - ideal->im[h]);
+        sum += d * d;
+    }
+    r->low_err_pct = 100 * sqrt(sum) / c1;
+}
+
+
+static int dead_time_check(void)
+{
+    static uint16_t lut0[MAX_SAMPLES], lut_table[MAX_SAMPLES];
+    const double m_list[] = { 0.15, 0.3, 0.6, 0.9 };
+    const int hz_list[] = { 30, 50, 60 };
+    int failed = 0;
+
+    printf("\nDead time %d ticks, load current in phase; error against no dead time, %% of fundamental\n",
+           DEAD_TIME_TICKS);
+    printf("   Hz     M   none: fund  low    table (%d): fund  low    3: fund  low    3.5: fund  low\n",
+           DT_COMP_TICKS);
+
+    for (size_t fi = 0; fi < sizeof(hz_list) / sizeof(hz_list[0]); fi++) {
+        int samples = SAMPLE_RATE_HZ / hz_list[fi];
+
+        for (size_t mi = 0; mi < sizeof(m_list) / sizeof(m_list[0]); mi++) {
+            float m = (float)m_list[mi];
+            spwm_lut_build(lut0, samples, m, PEAK_TICKS, MAX_TICKS, 0);
+            spwm_lut_build(lut_table, samples, m, PEAK_TICKS, MAX_TICKS, DT_COMP_TICKS);
+
+            spectrum_t ideal, sp;
+            dt_result_t none, table, three, exact;
+            dead_time_case(lut0, samples, 0, 0, NULL, &ideal, NULL);
+            dead_time_case(lut0, samples, 0, DEAD_TIME_TICKS, &ideal, &sp, &none);
+            dead_time_case(lut0, samples, 3, DEAD_TIME_TICKS, &ideal, &sp, &three);
+            dead_time_case(lut0, samples, DEAD_TIME_TICKS / 2.0, DEAD_TIME_TICKS, &ideal, &sp, &exact);
+
+            // The firmware table itself, not a re-derivation of it
+            for (int j = 0; j < samples; j++) lut0[j] = lut_table[j];
+            dead_time_case(lut0, samples, 0, DEAD_TIME_TICKS, &ideal, &sp, &table);
+
+            printf("  %3d  %.2f      %5.2f %5.2f        %5.2f %5.2f    %5.2f %5.2f      %5.2f %5.2f\n",
+                   hz_list[fi], m, none.fund_err_pct, none.low_err_pct, table.fund_err_pct, table.low_err_pct,
+                   three.fund_err_pct, three.low_err_pct, exact.fund_err_pct, exact.low_err_pct);
+
+            if (table.fund_err_pct >= none.fund_err_pct || table.low_err_pct >= none.low_err_pct) failed = 1;
+            if (fabs(table.fund_err_pct - exact.fund_err_pct) > ROUNDING_LIMIT_PCT ||
+                fabs(table.low_err_pct - exact.low_err_pct) > ROUNDING_LIMIT_PCT) failed = 1;
+        }
+    }
+    printf("  rounding limit: table within %.1f%% of the exact 3.5 ticks\n", ROUNDING_LIMIT_PCT);
+    return failed;
+}
+
+
+int main(void)
+{
+    static uint16_t lut[MAX_SAMPLES];
+    const double m_list[] = { 0.3, 0.6, 0.85 };
+    const double vbus_list[] = { 0.90, 0.95, 1.00, 1.10 };  // of NOMINAL_VBUS_V, inside the gain clamp
+    const int hz = 50;
+    int samples = SAMPLE_RATE_HZ / hz;
+    int failed = 0;
+
+    printf("Bus compensation, %d Hz, %d samples/cycle; max |Vout| error in V (saturated samples)\n", hz, samples);
+    printf("    M   Vbus    1st half        2nd half        plain 1st half  plain 2nd half\n");
+
+    for (size_t mi = 0; mi < sizeof(m_list) / sizeof(m_list[0]); mi++) {
+        spwm_lut_build(lut, samples, (float)m_list[mi], PEAK_TICKS, MAX_TICKS, DT_COMP_TICKS);
+
+        for (size_t vi = 0; vi < sizeof(vbus_list) / sizeof(vbus_list[0]); vi++) {
+            double vbus = NOMINAL_VBUS_V * vbus_list[vi];
+            double limit = GAIN_LIMIT_TICKS * vbus / PEAK_TICKS;
+            gain_result_t r, p;
+            gain_check(lut, samples, vbus, false, &r);
+            gain_check(lut, samples, vbus, true, &p);
+
+            printf("  %.2f  %4.0f  %6.2f (%3d)    %6.2f (%3d)    %6.2f          %6.2f\n", m_list[mi], vbus,
+                   r.max_err_v[0], r.saturated[0], r.max_err_v[1], r.saturated[1], p.max_err_v[0], p.max_err_v[1]);
+            if (r.max_err_v[0] > limit || r.max_err_v[1] > limit) failed = 1;
+        }
+    }
+    printf("  limit: %.1f tick of the bus (%.2f V at nominal)\n", GAIN_LIMIT_TICKS,
+           GAIN_LIMIT_TICKS * NOMINAL_VBUS_V / PEAK_TICKS);
+
+    failed |= dead_time_check();
+
+    printf("\n%s\n", failed ? "FAIL" : "OK");
+    return failed;
+}
@@ -0,0 +1,151 @@
+#!/usr/bin/env python3
+"""
+Host client for the inverter's UDP control endpoint (frame format: main/udp_ctrl.h).
+
+  udp_ctrl_client.py --host 192.168.1.50 --key secret state
+  udp_ctrl_client.py --host 192.168.1.50 --key secret set 45
+  udp_ctrl_client.py --host 192.168.1.50 --key secret start [HZ] | stop
+  udp_ctrl_client.py --host 192.168.1.50 --key secret bench --count 1000 [--rate 100]
+
+The key can also come from $UDP_CTRL_KEY. `bench` sends GET_STATE requests and prints
+round-trip latency percentiles and losses.
+"""
+
+import argparse
+import hashlib
+import hmac
+import os
+import socket
+import struct
+import sys
+import time
+
+VERSION = 1
+MAC_LEN = 16
+REPLY_FLAG = 0x80
+
+CMD_HELLO, CMD_SET_FREQ, CMD_START, CMD_STOP, CMD_GET_STATE = range(5)
+STATUS_NAMES = ["ok", "bad session", "replay", "bad instance", "bad command"]
+
+REQ_FMT = "<BBBBIIi"                # version, cmd, instance, reserved, session, seq, arg
+REPLY_FMT = "<BBBBIIBBBBiii"        # ... running, update_pending, fault_latched, reserved, hz, target, mod
+REQ_LEN = struct.calcsize(REQ_FMT) + MAC_LEN
+REPLY_LEN = struct.calcsize(REPLY_FMT) + MAC_LEN
+
+
+class Client:
+    def __init__(self, host, port, key, instance, timeout):
+        self.addr = (host, port)
+        self.key = key.encode()
+        self.instance = instance
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.sock.settimeout(timeout)
+        self.session = 0
+        self.seq = 0
+
+    def _mac(self, data):
+        return hmac.new(self.key, data, hashlib.sha256).digest()[:MAC_LEN]
+
+    def request(self, cmd, arg=0):
+        if cmd != CMD_HELLO:
+            self.seq += 1
+        body = struct.pack(REQ_FMT, VERSION, cmd, self.instance, 0, self.session, self.seq, arg)
+        self.sock.sendto(body + self._mac(body), self.addr)
+
+        while True:
+            data, _ = self.sock.recvfrom(256)
+            if len(data) != REPLY_LEN or not hmac.compare_digest(self._mac(data[:-MAC_LEN]), data[-MAC_LEN:]):
+                raise ValueError("reply failed authentication")
+            fields = struct.unpack(REPLY_FMT, data[:-MAC_LEN])
+            if fields[1] == cmd | REPLY_FLAG and (cmd == CMD_HELLO or fields[5] == self.seq):
+                return fields
+            # late reply to an earlier, timed-out request: skip it
+
+    def hello(self):
+        # Session of this boot and the last seq the device accepted (from any client)
+        reply = self.request(CMD_HELLO)
+        self.session, self.seq = reply[4], reply[5]
+
+    def command(self, cmd, arg=0):
+        if self.session == 0:
+            self.hello()
+        reply = self.request(cmd, arg)
+        if reply[3] in (1, 2):  # device restarted, or another client advanced the seq
+            self.hello()
+            reply = self.request(cmd, arg)
+        return reply
+
+
+def print_state(reply):
+    (_, _, instance, status, _, _, running, pending, fault, _, hz, target, mod) = reply
+    if status != 0:
+        print(f"inverter {instance}: {STATUS_NAMES[status] if status < len(STATUS_NAMES) else status}")
+        return
+    print(f"inverter {instance}: {'ON' if running else 'OFF'}{' FAULT' if fault else ''} "
+          f"{hz} Hz -> {target} Hz, mod {mod / 1000:.3f}{' (update pending)' if pending else ''}")
+
+
+def bench(client, count, rate):
+    client.hello()
+    rtts = []
+    lost = 0
+    period = 1.0 / rate if rate > 0 else 0
+    for _ in range(count):
+        start = time.perf_counter()
+        try:
+            client.request(CMD_GET_STATE)
+            rtts.append((time.perf_counter() - start) * 1000)
+        except socket.timeout:
+            lost += 1
+        if period:
+            time.sleep(max(0.0, period - (time.perf_counter() - start)))
+
+    if not rtts:
+        print(f"no replies, {lost} lost")
+        return
+    rtts.sort()
+    pct = lambda p: rtts[min(len(rtts) - 1, int(p / 100 * len(rtts)))]
+    print(f"{len(rtts)} replies, {lost} lost; RTT ms: min {rtts[0]:.2f} p50 {pct(50):.2f} "
+          f"p90 {pct(90):.2f} p99 {pct(99):.2f} max {rtts[-1]:.2f}")
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("--host", required=True)
+    ap.add_argument("--port", type=int, default=5005)
+    ap.add_argument("--key", default=os.environ.get("UDP_CTRL_KEY"))
+    ap.add_argument("--instance", type=int, default=0)
+    ap.add_argument("--timeout", type=float, default=0.5)
+    sub = ap.add_subparsers(dest="cmd", required=True)
+    sub.add_parser("state")
+    sub.add_parser("stop")
+    p = sub.add_parser("set")
+    p.add_argument("hz", type=int)
+    p = sub.add_parser("start")
+    p.add_argument("hz", type=int, nargs="?", default=0)
+    p = sub.add_parser("bench")
+    p.add_argument("--count", type=int, default=1000)
+    p.add_argument("--rate", type=float, default=0, help="requests per second, 0 = back to back")
+    args = ap.parse_args()
+
+    if not args.key:
+        sys.exit("no key: use --key or $UDP_CTRL_KEY")
+
+    client = Client(args.host, args.port, args.key, args.instance, args.timeout)
+    try:
+        if args.cmd == "bench":
+            bench(client, args.count, args.rate)
+        elif args.cmd == "state":
+            print_state(client.command(CMD_GET_STATE))
+        elif args.cmd == "set":
+            print_state(client.command(CMD_SET_FREQ, args.hz))
+        elif args.cmd == "start":
+            print_state(client.command(CMD_START, args.hz))
+        elif args.cmd == "stop":
+            print_state(client.command(CMD_STOP))
+    except socket.timeout:
+        sys.exit("no reply (wrong key, host or port?)")
+
+
+if __name__ == "__main__":
+    main()